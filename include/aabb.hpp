@@ -2,6 +2,7 @@
 #define AABB_H
 
 #include <cmath>
+#include <utility>
 
 #include "utils.hpp"
 #include "ray.hpp"
@@ -17,16 +18,26 @@ class AABB {
         Vector3f min() const {return minimum; }
         Vector3f max() const {return maximum; }
 
+        // Slab test. One reciprocal per axis and plain comparisons instead of
+        // the libm fmin/fmax calls. A ray parallel to an axis whose origin
+        // lies on a face plane gives a NaN slab, which fails both comparisons
+        // and leaves the interval alone: such a ray grazing the face now
+        // counts as a hit, where the fmin/fmax version reported a miss.
         bool intersect(const Ray& r, float t_min, float t_max) const {
-            float tmin = t_min, tmax = t_max;
+            return clip(r, t_min, t_max);
+        }
+
+        // The same test, narrowing [t_min, t_max] to the part of the ray
+        // inside the box; intersect() runs it on copies.
+        bool clip(const Ray& r, float& t_min, float& t_max) const {
             for (int a = 0; a < 3; a++) {
-                auto t0 = fmin((minimum[a] - r.getOrigin()[a]) / r.getDirection()[a],
-                               (maximum[a] - r.getOrigin()[a]) / r.getDirection()[a]);
-                auto t1 = fmax((minimum[a] - r.getOrigin()[a]) / r.getDirection()[a],
-                               (maximum[a] - r.getOrigin()[a]) / r.getDirection()[a]);
-                tmin = fmax(t0, tmin);
-                tmax = fmin(t1, tmax);
-                if (tmax <= tmin)
+                float invD = 1.0f / r.getDirection()[a];
+                float t0 = (minimum[a] - r.getOrigin()[a]) * invD;
+                float t1 = (maximum[a] - r.getOrigin()[a]) * invD;
+                if (invD < 0.0f) std::swap(t0, t1);
+                t_min = t0 > t_min ? t0 : t_min;
+                t_max = t1 < t_max ? t1 : t_max;
+                if (t_max <= t_min)
                     return false;
             }
             return true;
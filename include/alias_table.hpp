@@ -0,0 +1,65 @@
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+
+#include <algorithm>
+#include <vector>
+
+#include "utils.hpp"
+
+// Draws index i with probability weight[i] / sum(weight) in O(1) (Vose's
+// alias method). Built in O(n); all weights zero leaves it empty.
+class AliasTable {
+public:
+    AliasTable() : total(0) {}
+
+    explicit AliasTable(const std::vector<double> &weights) : weight(weights), total(0) {
+        int n = weight.size();
+        for (double w : weight) total += w;
+        prob.assign(n, 1);
+        alias.resize(n);
+        for (int i = 0; i < n; ++i) alias[i] = i;
+        if (total <= 0) return;
+        std::vector<double> scaled(n);
+        std::vector<int> small, large;
+        for (int i = 0; i < n; ++i) {
+            scaled[i] = weight[i] * n / total;
+            (scaled[i] < 1 ? small : large).push_back(i);
+        }
+        while (!small.empty() && !large.empty()) {
+            int s = small.back(), l = large.back();
+            small.pop_back();
+            prob[s] = scaled[s];
+            alias[s] = l;
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+    }
+
+    bool empty() const { return total <= 0; }
+    int size() const { return weight.size(); }
+    double sum() const { return total; }
+    size_t memoryBytes() const {
+        return weight.capacity() * sizeof(double) + prob.capacity() * sizeof(double) + alias.capacity() * sizeof(int);
+    }
+
+    double probability(int i) const { return weight[i] / total; }
+
+    // one uniform number picks the column and decides between it and its alias
+    int sample() const {
+        int n = weight.size();
+        double u = random_double() * n;
+        int i = std::min((int)u, n - 1);
+        return u - i < prob[i] ? i : alias[i];
+    }
+
+private:
+    std::vector<double> weight;
+    std::vector<double> prob;
+    std::vector<int> alias;
+    double total;
+};
+
+#endif // ALIAS_TABLE_H
@@ -0,0 +1,123 @@
+#ifndef BERNSTEIN_H
+#define BERNSTEIN_H
+
+#include <cassert>
+#include <cmath>
+
+// Polynomials of degree deg on [0, 1] in Bernstein form, given by their
+// coefficients c[0..deg]:
+//   p(u) = sum_i c[i] * C(deg, i) * u^i * (1 - u)^(deg - i)
+// The polynomial lies in the convex hull of its coefficients and has at most
+// as many roots in [0, 1] as the coefficients have sign changes (exactly one
+// if they have one), which is all the root isolation below relies on.
+
+#define BERNSTEIN_MAX_DEGREE 64
+// subdivision gives up at intervals this narrow and reports a (multiple) root
+#define BERNSTEIN_MIN_WIDTH 1e-10
+#define BERNSTEIN_NEWTON_STEPS 32
+
+inline double binomial(int n, int k) {
+    double b = 1;
+    for (int i = 1; i <= k; ++i) b = b * (n - k + i) / i;
+    return b;
+}
+
+// de Casteljau
+inline double bernsteinEval(const double *c, int deg, double u) {
+    double tmp[BERNSTEIN_MAX_DEGREE + 1];
+    for (int i = 0; i <= deg; ++i) tmp[i] = c[i];
+    for (int r = 1; r <= deg; ++r) {
+        for (int i = 0; i <= deg - r; ++i) tmp[i] = (1 - u) * tmp[i] + u * tmp[i + 1];
+    }
+    return tmp[0];
+}
+
+// out (degree da + db) = a * b
+inline void bernsteinMultiply(const double *a, int da, const double *b, int db, double *out) {
+    for (int k = 0; k <= da + db; ++k) out[k] = 0;
+    for (int i = 0; i <= da; ++i) {
+        for (int j = 0; j <= db; ++j) {
+            out[i + j] += binomial(da, i) * binomial(db, j) / binomial(da + db, i + j) * a[i] * b[j];
+        }
+    }
+}
+
+// sign changes among the non-zero coefficients
+inline int bernsteinSignChanges(const double *c, int deg) {
+    int changes = 0;
+    double last = 0;
+    for (int i = 0; i <= deg; ++i) {
+        if (c[i] == 0) continue;
+        if (last != 0 && (c[i] < 0) != (last < 0)) ++changes;
+        last = c[i];
+    }
+    return changes;
+}
+
+// coefficients of the halves [0, 1/2] and [1/2, 1], each reparametrised to [0, 1]
+inline void bernsteinSplit(const double *c, int deg, double *left, double *right) {
+    assert(deg >= 0 && deg <= BERNSTEIN_MAX_DEGREE);
+    double tmp[BERNSTEIN_MAX_DEGREE + 1]{};
+    for (int i = 0; i <= deg; ++i) tmp[i] = c[i];
+    left[0] = tmp[0];
+    right[deg] = tmp[deg];
+    for (int r = 1; r <= deg; ++r) {
+        for (int i = 0; i <= deg - r; ++i) tmp[i] = 0.5 * (tmp[i] + tmp[i + 1]);
+        left[r] = tmp[0];
+        right[deg - r] = tmp[deg - r];
+    }
+}
+
+// The single root of a polynomial whose coefficients change sign once:
+// Newton's method, falling back to bisection whenever a step leaves the
+// bracket.
+inline double bernsteinRefine(const double *c, int deg) {
+    double dc[BERNSTEIN_MAX_DEGREE];
+    for (int i = 0; i < deg; ++i) dc[i] = deg * (c[i + 1] - c[i]);
+    double lo = 0, hi = 1;
+    bool lo_negative = c[0] != 0 ? c[0] < 0 : c[deg] > 0;
+    double u = c[0] / (c[0] - c[deg]);
+    for (int i = 0; i < BERNSTEIN_NEWTON_STEPS; ++i) {
+        double f = bernsteinEval(c, deg, u);
+        if (f == 0) return u;
+        if ((f < 0) == lo_negative) lo = u;
+        else hi = u;
+        double next = u - f / bernsteinEval(dc, deg - 1, u);
+        if (!(next > lo && next < hi)) next = 0.5 * (lo + hi);
+        if (fabs(next - u) < 1e-14) return next;
+        u = next;
+    }
+    return u;
+}
+
+inline void bernsteinIsolate(const double *c, int deg, double u0, double u1, double *roots, int &count, int max_roots) {
+    if (count >= max_roots) return;
+    int changes = bernsteinSignChanges(c, deg);
+    if (changes == 0) return;
+    if (changes == 1) {
+        roots[count++] = u0 + (u1 - u0) * bernsteinRefine(c, deg);
+        return;
+    }
+    double mid = 0.5 * (u0 + u1);
+    if (u1 - u0 < BERNSTEIN_MIN_WIDTH) {
+        roots[count++] = mid;
+        return;
+    }
+    double left[BERNSTEIN_MAX_DEGREE + 1], right[BERNSTEIN_MAX_DEGREE + 1];
+    bernsteinSplit(c, deg, left, right);
+    bernsteinIsolate(left, deg, u0, mid, roots, count, max_roots);
+    // a root exactly at the split point is a zero coefficient on both sides
+    if (left[deg] == 0 && count < max_roots) roots[count++] = mid;
+    bernsteinIsolate(right, deg, mid, u1, roots, count, max_roots);
+}
+
+// Roots of c in [0, 1] in increasing order, at most max_roots of them.
+// Intervals are halved until their coefficients change sign at most once,
+// then the isolated root is polished. Returns the number of roots.
+inline int bernsteinRoots(const double *c, int deg, double *roots, int max_roots) {
+    int count = 0;
+    bernsteinIsolate(c, deg, 0, 1, roots, count, max_roots);
+    return count;
+}
+
+#endif // BERNSTEIN_H
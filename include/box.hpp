@@ -38,6 +38,13 @@ public:
         return flag;
     }
 
+    bool occluded(const Ray& r, float t_min = 0.0, float t_max = infinity) const override {
+        for (const auto& side : sides) {
+            if (side.occluded(r, t_min, t_max)) return true;
+        }
+        return false;
+    }
+
     bool bounding_box(double time0, double time1, AABB& output_box) const override {
         output_box = AABB(box_min, box_max);
         return true;
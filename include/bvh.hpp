@@ -4,6 +4,7 @@
 
 #include "object3d.hpp"
 #include "group.hpp"
+#include "flat_bvh.hpp"
 
 #include <algorithm>
 #include <memory>
@@ -26,6 +27,12 @@ class BVHnode : public Object3D  {
         virtual bool intersect(
             const Ray& r, Hit& rec, float tmin = 0.0, float tmax = infinity) const override;
 
+        virtual bool occluded(const Ray& r, float tmin = 0.0, float tmax = infinity) const override;
+
+        virtual double transmittance(const Ray& r, float tmin = 0.0, float tmax = infinity) const override;
+
+        virtual unsigned intersectPacket(RayPacket& packet, Hit* hits, unsigned active) const override;
+
         virtual bool bounding_box(double time0, double time1, AABB& output_box) const override;
 
     public:
@@ -44,5 +51,8 @@ bool box_y_compare (const shared_ptr<Object3D> a, const shared_ptr<Object3D> b)
 
 bool box_z_compare (const shared_ptr<Object3D> a, const shared_ptr<Object3D> b) ;
 
+// Builds the acceleration structure selected by mode over objects.
+shared_ptr<Object3D> make_bvh(const std::vector<shared_ptr<Object3D>>& objects, BVHMode mode);
+
 
 #endif
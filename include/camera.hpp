@@ -5,6 +5,7 @@
 #include "utils.hpp"
 #include <vecmath.h>
 #include <float.h>
+#include <algorithm>
 #include <cmath>
 #include <vector>
 #include <iostream>
@@ -29,6 +30,9 @@ public:
     int getWidth() const { return width; }
     int getHeight() const { return height; } 
 
+    // angle between the rays through neighbouring pixels, 0 if unknown
+    virtual float getPixelSpread() const { return 0; }
+
 protected:
     // Extrinsic parameters
     Vector3f origin;
@@ -54,6 +58,8 @@ public:
         focus_vertical = focus_dis * half_height * up * 2;
         focus_origin = origin + focus_dis*direction - focus_horizontal/2 -focus_vertical/2; 
         len_radius = aperture/2;
+        // finite for a one-row image, whose rows have no neighbours
+        pixel_spread = 2 * half_height / std::max(imgH - 1, 1);
         time0 = tm0;
         time1 = tm1;
     }
@@ -65,8 +71,11 @@ public:
         dir_ray.normalize();
         return Ray(origin+offset,dir_ray,random_double(time0,time1));
     }
+
+    float getPixelSpread() const override { return pixel_spread; }
 protected:
     float len_radius;
+    float pixel_spread;
     float time0;
     float time1;
     Vector3f focus_origin; // 焦平面坐标系原点 位于焦平面左下角
@@ -5,60 +5,87 @@
 #include "material.hpp"
 #include "texture.hpp"
 
+// A medium of constant density inside a closed boundary. The free flight is
+// drawn first, so a ray whose nearest possible scattering lies beyond tmax
+// costs no boundary query at all.
 class ConstantMedium : public Object3D {
 public:
-    ConstantMedium(shared_ptr<Object3D> b, double d, shared_ptr<Texture> m)
-        : boundary(b), neg_inv_density(-1/d), phase_function(make_shared<Isotropic>(m)) {
+    // phase: an ISOTROPIC or HENYEY_GREENSTEIN material from the scene's MaterialTable
+    ConstantMedium(shared_ptr<Object3D> b, double d, shared_ptr<Material> phase)
+        : boundary(b), neg_inv_density(-1/d), phase_function(phase) {
             material = phase_function;
     }
-    
-    ConstantMedium(shared_ptr<Object3D> b, double d, Vector3f c)
-        : boundary(b), neg_inv_density(-1/d), phase_function(make_shared<Isotropic>(c)) {
-            material = phase_function;
-    }   
 
     virtual bool intersect(
         const Ray& r, Hit& rec, float t_min = 0.0, float t_max = infinity
     ) const override {
+        float t;
+        if (!scatterAt(r, t_min, t_max, t)) return false;
 
-        Hit rec1, rec2;
-
-        if (!boundary->intersect(r, rec1, -infinity, infinity))
-            return false;
+        rec.t = t;
+        rec.intersectP = r.pointAtParameter(rec.t);
 
-        if (!boundary->intersect(r, rec2, rec1.getT()+0.0001, infinity))
-            return false;
+        rec.normal = Vector3f(1,0,0);  // arbitrary
+        rec.frontFace = true;     // also arbitrary
+        rec.u = rec.v = 0;
+        rec.uv_rate = 0;
+        rec.material = phase_function.get();
 
-        if (rec1.getT() < t_min) rec1.t = t_min;
-        if (rec2.getT() > t_max) rec2.t = t_max;
+        return true;
+    }
 
-        if (rec1.t >= rec2.t)
-            return false;
+    virtual bool occluded(const Ray& r, float t_min = 0.0, float t_max = infinity) const override {
+        float t;
+        return scatterAt(r, t_min, t_max, t);
+    }
 
-        if (rec1.t < 0)
-            rec1.t = 0;
+    // exp(-density * length) of the part of r in [t_min, t_max] inside the boundary
+    virtual double transmittance(const Ray& r, float t_min = 0.0, float t_max = infinity) const override {
+        float t_enter, t_exit;
+        if (!inside(r, t_min, t_max, t_enter, t_exit))
+            return 1;
+        return exp((t_exit - t_enter) * r.getDirection().length() / neg_inv_density);
+    }
 
+    virtual bool bounding_box(double time0, double time1, AABB& output_box) const override {
+        return boundary->bounding_box(time0, time1, output_box);
+    }
+protected:
+    // Parameter along r of a scattering event in [t_min, t_max], if any.
+    bool scatterAt(const Ray& r, float t_min, float t_max, float& t) const {
         const auto ray_length = r.getDirection().length();
-        const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
         const auto hit_distance = neg_inv_density * log(random_double());
-
-        if (hit_distance > distance_inside_boundary)
+        // scattering happens no earlier than hit_distance past t_min
+        if (t_min + hit_distance / ray_length > t_max)
             return false;
 
-        rec.t = rec1.t + hit_distance / ray_length;
-        rec.intersectP = r.pointAtParameter(rec.t);
-
-        rec.normal = Vector3f(1,0,0);  // arbitrary
-        rec.frontFace = true;     // also arbitrary
-        rec.material = phase_function;
+        float t_enter, t_exit;
+        if (!inside(r, t_min, t_max, t_enter, t_exit))
+            return false;
 
+        const auto distance_inside_boundary = (t_exit - t_enter) * ray_length;
+        if (hit_distance > distance_inside_boundary)
+            return false;
+        t = t_enter + hit_distance / ray_length;
         return true;
     }
 
-    virtual bool bounding_box(double time0, double time1, AABB& output_box) const override {
-        return boundary->bounding_box(time0, time1, output_box);
+    // The part [t_enter, t_exit] of [t_min, t_max] inside the boundary. The
+    // first two hits along the whole line bound it, whichever way the
+    // boundary's normals face, so meshes of any winding work.
+    bool inside(const Ray& r, float t_min, float t_max, float& t_enter, float& t_exit) const {
+        Hit rec1, rec2;
+        if (!boundary->intersect(r, rec1, -infinity, infinity))
+            return false;
+        // the offset grows with t so that it survives float rounding
+        if (!boundary->intersect(r, rec2, rec1.getT() + 0.0001f * (1 + fabs(rec1.getT())), infinity))
+            return false;
+        t_enter = rec1.getT() < t_min ? t_min : rec1.getT();
+        t_exit = rec2.getT() > t_max ? t_max : rec2.getT();
+        if (t_enter < 0) t_enter = 0;
+        return t_enter < t_exit;
     }
-protected:
+
     shared_ptr<Object3D> boundary;
     shared_ptr<Material> phase_function;
     double neg_inv_density;
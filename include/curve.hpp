@@ -4,15 +4,27 @@
 #include <vecmath.h>
 
 #include <algorithm>
+#include <cassert>
 #include <vector>
 #include "object3d.hpp"
 #include "utils.hpp"
 
+// Highest curve degree evaluated without allocating (a Bezier curve of n
+// controls has degree n - 1); higher degrees use a heap workspace.
+#define CURVE_MAX_DEGREE 31
+
 struct CurvePoint {
     Vector3f V;  // Vertex
     Vector3f T;  // Tangent  (unit)
 };
 
+// One polynomial piece of a curve in Bezier form: controls[0..k] on the
+// parameter interval [t0, t1].
+struct CurveSpan {
+    float t0, t1;
+    std::vector<Vector3f> controls;
+};
+
 class Curve {
    protected:
     std::vector<Vector3f> controls;
@@ -32,62 +44,17 @@ class Curve {
 
     std::vector<Vector3f> &getControls() { return controls; }
 
-    CurvePoint caculate(float mu) {
-        CurvePoint pt;
-        int bpos;
-        if (mu == t[0]){
-            bpos = upper_bound(t.begin(), t.end(), mu) - t.begin() - 1;
-        } else {
-            bpos = std::max((long long)0, lower_bound(t.begin(), t.end(), mu) - t.begin() - 1);
-        }
-        
-        std::vector<float> s(k + 2, 0), ds(k + 1, 1);
-        s[k] = 1;
-        for (int p = 1; p <= k; ++p) {
-            for (int ii = k - p; ii < k + 1; ++ii) {
-                int i = ii + bpos - k;
-                float w1, dw1, w2, dw2;
-                if (tpad[i + p] == tpad[i]) {
-                    w1 = mu;
-                    dw1 = 1;
-                } else {
-                    w1 = (mu - tpad[i]) / (tpad[i + p] - tpad[i]);
-                    dw1 = 1.0 / (tpad[i + p] - tpad[i]);
-                }
-                if (tpad[i + p + 1] == tpad[i + 1]) {
-                    w2 = 1 - mu;
-                    dw2 = -1;
-                } else {
-                    w2 = (tpad[i + p + 1] - mu) /
-                         (tpad[i + p + 1] - tpad[i + 1]);
-                    dw2 = -1 / (tpad[i + p + 1] - tpad[i + 1]);
-                }
-                if (p == k) ds[ii] = (dw1 * s[ii] + dw2 * s[ii + 1]) * p;
-                s[ii] = w1 * s[ii] + w2 * s[ii + 1];
-            }
-        }
-        s.pop_back();
-        int lsk = k - bpos, rsk = bpos + 1 - n;
-        if (lsk > 0) {
-            for (int i = lsk; i < s.size(); ++i) {
-                s[i - lsk] = s[i];
-                ds[i - lsk] = ds[i];
-            }
-            s.resize(s.size() - lsk);
-            ds.resize(ds.size() - lsk);
-            lsk = 0;
-        }
-        if (rsk > 0) {
-            if (rsk < s.size()) {
-                s.resize(s.size() - rsk);
-                ds.resize(ds.size() - rsk);
-            }
-        }
-        for (int j = 0; j < s.size(); ++j) {
-            pt.V += controls[-lsk + j] * s[j];
-            pt.T += controls[-lsk + j] * ds[j];
-        }
-        return pt;
+    // Point and unit-less tangent at mu, clamped to [range[0], range[1]].
+    // Up to CURVE_MAX_DEGREE the basis lives in fixed stack arrays, and the
+    // common cubic case is compiled separately so its loops are fully
+    // unrolled.
+    CurvePoint caculate(float mu) const {
+        mu = std::min(std::max(mu, range[0]), range[1]);
+        int bpos = span(mu);
+        if (k == 3) return evaluate<3>(mu, bpos, 3);
+        if (k <= CURVE_MAX_DEGREE) return evaluate<CURVE_MAX_DEGREE>(mu, bpos, k);
+        std::vector<float> s(k + 2), ds(k + 1);
+        return evaluate(mu, bpos, k, s.data(), ds.data());
     }
 
     void discretize(int resolution, std::vector<CurvePoint> &data) { // 此处定义与原PA3不同 resolution 为总采样次数
@@ -109,11 +76,30 @@ class Curve {
         }
     }
 
+    // The non-empty knot spans of the curve as Bezier segments, ordered by
+    // parameter.
+    void bezierSpans(std::vector<CurveSpan> &spans) const {
+        spans.clear();
+        for (int bpos = k; bpos < n; ++bpos) {
+            if (t[bpos + 1] <= t[bpos]) continue;
+            CurveSpan span;
+            span.t0 = t[bpos];
+            span.t1 = t[bpos + 1];
+            span.controls.resize(k + 1);
+            for (int j = 0; j <= k; ++j) span.controls[j] = blossom(bpos, k - j);
+            spans.push_back(span);
+        }
+    }
+
     void pad() {
         int tSize = t.size();
         tpad.resize(tSize + k);
         for (int i = 0; i < tSize; ++i) tpad[i] = t[i];
         for (int i = 0; i < k; ++i) tpad[i + tSize] = t.back();
+        uniform_knots = true;
+        for (int i = 0; i < tSize && uniform_knots; ++i) {
+            uniform_knots = fabs(t[i] - (float)i / (tSize - 1)) < 1e-6;
+        }
     }
 
     int n, k;
@@ -121,6 +107,92 @@ class Curve {
     std::vector<float> tpad;
     float y_min, y_max, radius;
     float range[2];
+
+   protected:
+    bool uniform_knots = false;
+
+    // Knot span of mu: the largest bpos with t[bpos] < mu (t[0] maps to the
+    // first non-empty span), limited to the spans of the curve [k, n-1].
+    int span(float mu) const {
+        int bpos;
+        if (uniform_knots) {
+            // t[i] = i / (size - 1), correct the rounding of the direct guess
+            int last = (int)t.size() - 1;
+            bpos = std::min(std::max((int)(mu * last), 0), last);
+            while (bpos > 0 && t[bpos] >= mu) --bpos;
+            while (bpos < last && t[bpos + 1] < mu) ++bpos;
+        } else if (mu == t[0]) {
+            bpos = (int)(std::upper_bound(t.begin(), t.end(), mu) - t.begin()) - 1;
+        } else {
+            bpos = (int)(std::lower_bound(t.begin(), t.end(), mu) - t.begin()) - 1;
+        }
+        return std::min(std::max(bpos, k), n - 1);
+    }
+
+    // Polar form of span bpos at (t[bpos] repeated count0 times, t[bpos+1]
+    // for the rest): de Boor's algorithm with its own parameter per level.
+    // Its values for count0 = k ... 0 are the Bezier controls of the span.
+    Vector3f blossom(int bpos, int count0) const {
+        std::vector<Vector3f> d(controls.begin() + (bpos - k), controls.begin() + (bpos + 1));
+        for (int r = 1; r <= k; ++r) {
+            float u = r <= count0 ? t[bpos] : t[bpos + 1];
+            for (int j = k; j >= r; --j) {
+                int i = bpos - k + j;
+                float alpha = (u - t[i]) / (t[i + k + 1 - r] - t[i]);
+                d[j] = (1 - alpha) * d[j - 1] + alpha * d[j];
+            }
+        }
+        return d[k];
+    }
+
+    template <int MAX_K>
+    CurvePoint evaluate(float mu, int bpos, int deg) const {
+        assert(deg <= MAX_K);
+        float s[MAX_K + 2], ds[MAX_K + 1];
+        return evaluate(mu, bpos, deg, s, ds);
+    }
+
+    // Cox-de Boor recursion over span bpos for degree deg, giving the deg+1
+    // non-zero basis values and their derivatives in one pass; s and ds hold
+    // deg + 2 and deg + 1 values.
+    CurvePoint evaluate(float mu, int bpos, int deg, float *s, float *ds) const {
+        for (int i = 0; i <= deg; ++i) {
+            s[i] = 0;
+            ds[i] = 1;
+        }
+        s[deg] = 1;
+        s[deg + 1] = 0;
+        for (int p = 1; p <= deg; ++p) {
+            for (int ii = deg - p; ii < deg + 1; ++ii) {
+                int i = ii + bpos - deg;
+                float w1, dw1, w2, dw2;
+                if (tpad[i + p] == tpad[i]) {
+                    w1 = mu;
+                    dw1 = 1;
+                } else {
+                    w1 = (mu - tpad[i]) / (tpad[i + p] - tpad[i]);
+                    dw1 = 1.0 / (tpad[i + p] - tpad[i]);
+                }
+                if (tpad[i + p + 1] == tpad[i + 1]) {
+                    w2 = 1 - mu;
+                    dw2 = -1;
+                } else {
+                    w2 = (tpad[i + p + 1] - mu) /
+                         (tpad[i + p + 1] - tpad[i + 1]);
+                    dw2 = -1 / (tpad[i + p + 1] - tpad[i + 1]);
+                }
+                if (p == deg) ds[ii] = (dw1 * s[ii] + dw2 * s[ii + 1]) * p;
+                s[ii] = w1 * s[ii] + w2 * s[ii + 1];
+            }
+        }
+        CurvePoint pt;
+        const Vector3f *c = &controls[bpos - deg];
+        for (int j = 0; j <= deg; ++j) {
+            pt.V += c[j] * s[j];
+            pt.T += c[j] * ds[j];
+        }
+        return pt;
+    }
 };
 
 class BezierCurve : public Curve {
@@ -45,9 +45,10 @@ public:
         Vector3f np = near - center;
         np.y() = 0;
         double theta = std::acos(np.x() / radius);
-        h.set(l, material, np, r);
+        h.set(l, material.get(), np, r);
         h.u = theta / (2 * M_PI);
         h.v = t;
+        h.uv_rate = 1 / sqrt(2 * M_PI * radius * (maxy - miny));
         return true;
     }
 
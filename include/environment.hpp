@@ -0,0 +1,152 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include <vecmath.h>
+#include <algorithm>
+#include <vector>
+
+#include "texture.hpp"
+#include "alias_table.hpp"
+#include "utils.hpp"
+
+// One face of a cube map: the image spans center +- u_axis +- v_axis, u and
+// v growing along the axes as on a Rectangle. Axes are stored normalized.
+struct EnvironmentFace {
+    shared_ptr<ImageTexture> image;
+    Vector3f center, u_axis, v_axis;
+
+    EnvironmentFace(shared_ptr<ImageTexture> img, const Vector3f &c, const Vector3f &u, const Vector3f &v)
+        : image(img), center(c.normalized()), u_axis(u.normalized()), v_axis(v.normalized()) {}
+};
+
+// Radiance arriving from infinitely far away, looked up by direction only:
+// either a latitude-longitude image (u turning around +y from +x towards +z,
+// v from the -y pole up to +y) or the faces of a cube map. Texels are
+// constant over their cell, and an alias table over all cells, weighted by
+// luminance times the solid angle of the cell, samples directions towards
+// the bright parts of the sky.
+class Environment {
+public:
+    explicit Environment(shared_ptr<ImageTexture> image, float _intensity = 1)
+        : latlong(true), intensity(_intensity) {
+        faces.push_back(EnvironmentFace(image, Vector3f(0, 1, 0), Vector3f(1, 0, 0), Vector3f(0, 0, 1)));
+        build();
+    }
+
+    explicit Environment(const std::vector<EnvironmentFace> &_faces, float _intensity = 1)
+        : faces(_faces), latlong(false), intensity(_intensity) {
+        build();
+    }
+
+    // radiance arriving along -dir
+    Vector3f eval(const Vector3f &dir) const {
+        int f;
+        double u, v;
+        lookup(dir.normalized(), f, u, v);
+        return intensity * faces[f].image->value(u, v, dir);
+    }
+
+    // Samples a direction, returns the radiance from it and its solid-angle
+    // density.
+    Vector3f sample(Vector3f &dir, double &pdf) const {
+        pdf = 0;
+        if (table.empty()) return Vector3f::ZERO;
+        int cell = table.sample();
+        int f = std::upper_bound(offset.begin(), offset.end(), cell) - offset.begin() - 1;
+        const EnvironmentFace &face = faces[f];
+        int w = face.image->getWidth();
+        int i = (cell - offset[f]) % w, j = (cell - offset[f]) / w;
+        double u = (i + random_double()) / w, v = (j + random_double()) / face.image->getHeight();
+        dir = direction(f, u, v);
+        pdf = table.probability(cell) * density(f, u, v);
+        return intensity * face.image->value(u, v, dir);
+    }
+
+    // solid-angle density of sample() choosing dir
+    double pdf(const Vector3f &dir) const {
+        if (table.empty()) return 0;
+        int f;
+        double u, v;
+        lookup(dir.normalized(), f, u, v);
+        return table.probability(cellOf(f, u, v)) * density(f, u, v);
+    }
+
+private:
+    std::vector<EnvironmentFace> faces;
+    std::vector<int> offset;  // first cell of each face in the table
+    AliasTable table;
+    bool latlong;
+    float intensity;
+
+    void build() {
+        std::vector<double> weight;
+        for (int f = 0; f < (int)faces.size(); ++f) {
+            offset.push_back(weight.size());
+            const ImageTexture &image = *faces[f].image;
+            int w = image.getWidth(), h = image.getHeight();
+            for (int j = 0; j < h; ++j) {
+                for (int i = 0; i < w; ++i) {
+                    double u = (i + 0.5) / w, v = (j + 0.5) / h;
+                    double lum = std::max(luminance(image.value(u, v, Vector3f::ZERO)), 0.0);
+                    weight.push_back(lum / density(f, u, v));
+                }
+            }
+        }
+        table = AliasTable(weight);
+    }
+
+    Vector3f direction(int f, double u, double v) const {
+        if (latlong) {
+            double phi = 2 * M_PI * u, theta = M_PI * (1 - v);
+            return Vector3f(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+        }
+        const EnvironmentFace &face = faces[f];
+        return (face.center + (2 * u - 1) * face.u_axis + (2 * v - 1) * face.v_axis).normalized();
+    }
+
+    void lookup(const Vector3f &d, int &f, double &u, double &v) const {
+        if (latlong) {
+            f = 0;
+            double phi = atan2(d.z(), d.x());
+            if (phi < 0) phi += 2 * M_PI;
+            u = phi / (2 * M_PI);
+            // atan2 keeps theta accurate near the poles, unlike acos
+            v = 1 - atan2(sqrt(d.x() * d.x() + d.z() * d.z()), (double)d.y()) / M_PI;
+            return;
+        }
+        f = 0;
+        double best = -infinity;
+        for (int i = 0; i < (int)faces.size(); ++i) {
+            double c = Vector3f::dot(d, faces[i].center);
+            if (c > best) {
+                best = c;
+                f = i;
+            }
+        }
+        const EnvironmentFace &face = faces[f];
+        u = clamp((Vector3f::dot(d, face.u_axis) / best + 1) / 2, 0.0, 1.0);
+        v = clamp((Vector3f::dot(d, face.v_axis) / best + 1) / 2, 0.0, 1.0);
+    }
+
+    int cellOf(int f, double u, double v) const {
+        int w = faces[f].image->getWidth(), h = faces[f].image->getHeight();
+        int i = std::min((int)(u * w), w - 1), j = std::min((int)(v * h), h - 1);
+        return offset[f] + j * w + i;
+    }
+
+    // texel cells per unit solid angle around (u, v): the image covers the
+    // unit square, so this is w * h over the solid angle per unit of u and v
+    double density(int f, double u, double v) const {
+        const ImageTexture &image = *faces[f].image;
+        double cells = (double)image.getWidth() * image.getHeight();
+        if (latlong) {
+            double s = sin(M_PI * (1 - v));
+            return s > 0 ? cells / (2 * M_PI * M_PI * s) : 0;
+        }
+        double x = 2 * u - 1, y = 2 * v - 1;
+        double r = sqrt(1 + x * x + y * y);
+        return cells * r * r * r / 4;
+    }
+};
+
+#endif // ENVIRONMENT_H
@@ -0,0 +1,549 @@
+#ifndef FLAT_BVH_H
+#define FLAT_BVH_H
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "object3d.hpp"
+#include "ray_packet.hpp"
+#include "aabb.hpp"
+#include "utils.hpp"
+
+// Pointer-free BVH. The whole tree is one contiguous array of nodes, children
+// are referenced by 32-bit index and leaves by a range of primitive indices,
+// so there are no vtables, no shared_ptr control blocks and no per-node heap
+// allocations.
+//
+// Memory / speed trade-off (per node, x86-64):
+//   BVHnode                 ~80 bytes + shared_ptr control block + malloc
+//                           header, one heap allocation per node, 1 primitive
+//                           per leaf.
+//   FullBVHNode             56 bytes, exact child boxes. Same traversal cost as
+//                           BVHnode minus the pointer chasing.
+//   QuantizedBVHNode<16>    48 bytes, child boxes rounded outwards to 1/65535
+//                           of the parent box. Practically as tight as exact.
+//   QuantizedBVHNode<8>     36 bytes, child boxes rounded outwards to 1/255 of
+//                           the parent box. Boxes are looser, so rays visit a
+//                           few percent more nodes and every box test pays for
+//                           the decode; expect traversal to be somewhat slower
+//                           than the exact layouts in exchange for the
+//                           smallest tree.
+// Leaves hold up to BVH_MAX_LEAF_SIZE primitives, which roughly halves the
+// node count again compared to one primitive per leaf.
+
+#define BVH_MAX_LEAF_SIZE 15
+#define BVH_STACK_SIZE 64
+
+// Exact child boxes, the reference layout.
+struct FullBVHNode {
+    float lo[2][3];
+    float hi[2][3];
+    uint32_t child[2];
+
+    void setFrame(const float frame_min[3], const float frame_max[3]) {}
+
+    void setChildBox(int c, const float cmin[3], const float cmax[3]) {
+        for (int a = 0; a < 3; a++) {
+            lo[c][a] = cmin[a];
+            hi[c][a] = cmax[a];
+        }
+    }
+
+    void childBox(int c, float cmin[3], float cmax[3]) const {
+        for (int a = 0; a < 3; a++) {
+            cmin[a] = lo[c][a];
+            cmax[a] = hi[c][a];
+        }
+    }
+};
+
+// Child boxes stored as Q-bit integers relative to the node's own box:
+// coordinate = origin + q * 2^exponent. Power-of-two steps make q * step
+// exact, and encoding checks every value against the very same decode
+// expression, so a decoded box always contains the original one.
+template <typename Q>
+struct QuantizedBVHNode {
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t pad;
+    Q lo[2][3];
+    Q hi[2][3];
+    uint32_t child[2];
+
+    static const uint32_t levels = (uint32_t)(Q)(~(Q)0);
+
+    static float step(int e) {
+        uint32_t bits = (uint32_t)(e + 127) << 23;
+        float s;
+        memcpy(&s, &bits, sizeof(float));
+        return s;
+    }
+
+    void setFrame(const float frame_min[3], const float frame_max[3]) {
+        for (int a = 0; a < 3; a++) {
+            origin[a] = frame_min[a];
+            float extent = frame_max[a] - frame_min[a];
+            int e = -126;
+            if (extent > 0) {
+                e = (int)std::ceil(std::log2(extent / levels));
+                e = std::max(-126, std::min(127, e));
+            }
+            // make sure the top level really reaches the frame maximum
+            while (e < 127 && origin[a] + (float)levels * step(e) < frame_max[a]) e++;
+            exponent[a] = (int8_t)e;
+        }
+    }
+
+    void setChildBox(int c, const float cmin[3], const float cmax[3]) {
+        for (int a = 0; a < 3; a++) {
+            float s = step(exponent[a]);
+            float ql = std::floor((cmin[a] - origin[a]) / s);
+            float qh = std::ceil((cmax[a] - origin[a]) / s);
+            int64_t l = (int64_t)std::max(0.0f, std::min((float)levels, ql));
+            int64_t h = (int64_t)std::max(0.0f, std::min((float)levels, qh));
+            while (l > 0 && origin[a] + (float)l * s > cmin[a]) l--;
+            while (h < (int64_t)levels && origin[a] + (float)h * s < cmax[a]) h++;
+            lo[c][a] = (Q)l;
+            hi[c][a] = (Q)h;
+        }
+    }
+
+    void childBox(int c, float cmin[3], float cmax[3]) const {
+        for (int a = 0; a < 3; a++) {
+            float s = step(exponent[a]);
+            cmin[a] = origin[a] + (float)lo[c][a] * s;
+            cmax[a] = origin[a] + (float)hi[c][a] * s;
+        }
+    }
+};
+
+typedef QuantizedBVHNode<uint16_t> QuantizedBVHNode16;
+typedef QuantizedBVHNode<uint8_t> QuantizedBVHNode8;
+
+// Ray data that is computed once per traversal instead of once per box.
+struct BVHRay {
+    float o[3];
+    float inv[3];
+
+    explicit BVHRay(const Ray& r) {
+        for (int a = 0; a < 3; a++) {
+            o[a] = r.getOrigin()[a];
+            inv[a] = 1.0f / r.getDirection()[a];
+        }
+    }
+
+    bool hitBox(const float bmin[3], const float bmax[3], float tmin, float tmax, float& tenter) const {
+        for (int a = 0; a < 3; a++) {
+            float t0 = (bmin[a] - o[a]) * inv[a];
+            float t1 = (bmax[a] - o[a]) * inv[a];
+            if (inv[a] < 0) std::swap(t0, t1);
+            tmin = t0 > tmin ? t0 : tmin;
+            tmax = t1 < tmax ? t1 : tmax;
+            if (tmax < tmin) return false;
+        }
+        tenter = tmin;
+        return true;
+    }
+};
+
+template <typename Node>
+class FlatBVH {
+public:
+    static const uint32_t LEAF_BIT = 0x80000000u;
+    static const uint32_t COUNT_SHIFT = 27;
+    static const uint32_t FIRST_MASK = (1u << COUNT_SHIFT) - 1;
+
+    FlatBVH() {}
+
+    // Builds the tree over the given primitive boxes. On return order[i] is
+    // the index of the primitive that must be stored at slot i, so that every
+    // leaf covers a contiguous range of slots.
+    void build(const std::vector<AABB>& boxes, std::vector<uint32_t>& order, int max_leaf = 4) {
+        nodes.clear();
+        attached = nullptr;
+        attached_count = 0;
+        order.resize(boxes.size());
+        for (size_t i = 0; i < boxes.size(); i++) order[i] = (uint32_t)i;
+        leaf_size = std::max(1, std::min(BVH_MAX_LEAF_SIZE, max_leaf));
+        if (boxes.empty()) return;
+        // leaf references keep the first slot in COUNT_SHIFT bits
+        if (boxes.size() > FIRST_MASK) {
+            printf("A BVH holds at most %u primitives, got %zu.\n", FIRST_MASK, boxes.size());
+            exit(0);
+        }
+
+        bounds = rangeBox(boxes, order, 0, order.size());
+        nodes.reserve(2 * boxes.size() / leaf_size + 1);
+        nodes.push_back(Node());
+        float frame_min[3], frame_max[3];
+        boxToArray(bounds, frame_min, frame_max);
+        buildNode(0, boxes, order, 0, order.size(), frame_min, frame_max);
+        std::vector<Node>(nodes).swap(nodes);
+    }
+
+    // Uses count nodes that live elsewhere (e.g. a mapped file) instead of
+    // building; they must outlive the tree.
+    void attach(const Node* node_data, size_t count, const AABB& root_box, int max_leaf) {
+        nodes.clear();
+        attached = node_data;
+        attached_count = count;
+        bounds = root_box;
+        leaf_size = max_leaf;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    const Node* data() const { return nodes.empty() ? attached : nodes.data(); }
+    size_t size() const { return nodes.empty() ? attached_count : nodes.size(); }
+
+    const AABB& box() const { return bounds; }
+    int leafSize() const { return leaf_size; }
+
+    // attached nodes are not counted
+    size_t memoryBytes() const { return nodes.capacity() * sizeof(Node); }
+
+    // Closest-hit traversal. leaf(first, count, tmax) intersects the slots
+    // [first, first+count), shrinks tmax on a hit and returns whether it hit.
+    template <typename LeafFn>
+    bool intersect(const Ray& r, float tmin, float& tmax, LeafFn& leaf) const {
+        if (empty()) return false;
+        BVHRay ray(r);
+        float bmin[3], bmax[3], t_root;
+        boxToArray(bounds, bmin, bmax);
+        if (!ray.hitBox(bmin, bmax, tmin, tmax, t_root)) return false;
+        return intersectFrom(0, ray, tmin, tmax, leaf);
+    }
+
+    // Packet traversal for the lanes of `active`. Every child box is tested
+    // against all remaining lanes at once; a subtree that only one lane
+    // still reaches is finished on the single-ray path.
+    // leaf(first, count, lane) intersects one lane against the slots and
+    // shrinks packet.tmax[lane] on a hit.
+    template <typename LeafFn>
+    unsigned intersectPacket(RayPacket& packet, unsigned active, LeafFn& leaf) const {
+        if (empty()) return 0;
+        const Node* node_data = data();
+        float bmin[3], bmax[3];
+        boxToArray(bounds, bmin, bmax);
+        active = packet.hitBox(bmin, bmax, active);
+        if (!active) return 0;
+        uint32_t stack[BVH_STACK_SIZE];
+        unsigned masks[BVH_STACK_SIZE];
+        int top = 0;
+        stack[top] = 0;
+        masks[top++] = active;
+        unsigned hit = 0;
+        while (top > 0) {
+            --top;
+            const Node& node = node_data[stack[top]];
+            unsigned mask = masks[top];
+            for (int c = 1; c >= 0; c--) {
+                uint32_t ref = node.child[c];
+                if ((ref & LEAF_BIT) && !((ref & ~LEAF_BIT) >> COUNT_SHIFT)) continue;
+                float cmin[3], cmax[3];
+                node.childBox(c, cmin, cmax);
+                unsigned child_mask = packet.hitBox(cmin, cmax, mask);
+                if (!child_mask) continue;
+                if (ref & LEAF_BIT) {
+                    uint32_t count = (ref & ~LEAF_BIT) >> COUNT_SHIFT;
+                    for (unsigned m = child_mask; m; m &= m - 1) {
+                        int lane = packetFirstLane(m);
+                        if (leaf(ref & FIRST_MASK, count, lane)) hit |= 1u << lane;
+                    }
+                } else if (packetLaneCount(child_mask) == 1) {
+                    int lane = packetFirstLane(child_mask);
+                    LaneLeaf<LeafFn> lane_leaf = {&leaf, lane};
+                    BVHRay ray(packet.rays[lane]);
+                    if (intersectFrom(ref, ray, packet.tmin, packet.tmax[lane], lane_leaf)) hit |= 1u << lane;
+                } else {
+                    stack[top] = ref;
+                    masks[top++] = child_mask;
+                }
+            }
+        }
+        return hit;
+    }
+
+    // Any-hit traversal, stops at the first leaf for which
+    // leaf(first, count, tmax) returns true.
+    template <typename LeafFn>
+    bool occluded(const Ray& r, float tmin, float tmax, LeafFn& leaf) const {
+        if (empty()) return false;
+        const Node* node_data = data();
+        BVHRay ray(r);
+        float bmin[3], bmax[3], t_enter;
+        boxToArray(bounds, bmin, bmax);
+        if (!ray.hitBox(bmin, bmax, tmin, tmax, t_enter)) return false;
+        uint32_t stack[BVH_STACK_SIZE];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& node = node_data[stack[--top]];
+            for (int c = 0; c < 2; c++) {
+                float cmin[3], cmax[3];
+                node.childBox(c, cmin, cmax);
+                if (!ray.hitBox(cmin, cmax, tmin, tmax, t_enter)) continue;
+                uint32_t ref = node.child[c];
+                if (ref & LEAF_BIT) {
+                    uint32_t count = (ref & ~LEAF_BIT) >> COUNT_SHIFT;
+                    if (count && leaf(ref & FIRST_MASK, count, tmax)) return true;
+                } else {
+                    stack[top++] = ref;
+                }
+            }
+        }
+        return false;
+    }
+
+protected:
+    std::vector<Node> nodes;
+    const Node* attached = nullptr;
+    size_t attached_count = 0;
+    AABB bounds;
+    int leaf_size;
+
+    // Adapts a packet leaf functor to the single-ray interface for one lane.
+    template <typename LeafFn>
+    struct LaneLeaf {
+        LeafFn* leaf;
+        int lane;
+        bool operator()(uint32_t first, uint32_t count, float& tmax) {
+            return (*leaf)(first, count, lane);
+        }
+    };
+
+    template <typename LeafFn>
+    bool intersectFrom(uint32_t root, const BVHRay& ray, float tmin, float& tmax, LeafFn& leaf) const {
+        const Node* node_data = data();
+        uint32_t stack[BVH_STACK_SIZE];
+        int top = 0;
+        stack[top++] = root;
+        bool hit = false;
+        while (top > 0) {
+            const Node& node = node_data[stack[--top]];
+            float t_enter[2];
+            bool visit[2];
+            for (int c = 0; c < 2; c++) {
+                float cmin[3], cmax[3];
+                node.childBox(c, cmin, cmax);
+                visit[c] = ray.hitBox(cmin, cmax, tmin, tmax, t_enter[c]);
+            }
+            // nearer child first: leaves are intersected right away, inner
+            // nodes are pushed so that the nearer one is popped next
+            int nearer = (visit[0] && visit[1] && t_enter[1] < t_enter[0]) ? 1 : 0;
+            uint32_t push[2];
+            int pushed = 0;
+            for (int k = 0; k < 2; k++) {
+                int c = k == 0 ? nearer : 1 - nearer;
+                if (!visit[c]) continue;
+                uint32_t ref = node.child[c];
+                if (ref & LEAF_BIT) {
+                    uint32_t count = (ref & ~LEAF_BIT) >> COUNT_SHIFT;
+                    if (count && leaf(ref & FIRST_MASK, count, tmax)) hit = true;
+                } else {
+                    push[pushed++] = ref;
+                }
+            }
+            while (pushed > 0) stack[top++] = push[--pushed];
+        }
+        return hit;
+    }
+
+    static void boxToArray(const AABB& b, float bmin[3], float bmax[3]) {
+        for (int a = 0; a < 3; a++) {
+            bmin[a] = b.minimum[a];
+            bmax[a] = b.maximum[a];
+        }
+    }
+
+    static AABB rangeBox(const std::vector<AABB>& boxes, const std::vector<uint32_t>& order, size_t start, size_t end) {
+        AABB b = boxes[order[start]];
+        for (size_t i = start + 1; i < end; i++) b = AABB::surrounding_box(b, boxes[order[i]]);
+        return b;
+    }
+
+    static uint32_t leafRef(size_t start, size_t end) {
+        assert(start <= FIRST_MASK && end - start <= (LEAF_BIT >> COUNT_SHIFT) - 1);
+        return LEAF_BIT | ((uint32_t)(end - start) << COUNT_SHIFT) | (uint32_t)start;
+    }
+
+    // Splits [start, end) at the median along the longest axis of the
+    // centroid bounds and fills node `index`, whose frame is frame_min/frame_max.
+    void buildNode(uint32_t index, const std::vector<AABB>& boxes, std::vector<uint32_t>& order,
+                   size_t start, size_t end, const float frame_min[3], const float frame_max[3]) {
+        nodes[index].setFrame(frame_min, frame_max);
+        size_t span = end - start;
+        if (span <= (size_t)leaf_size) {
+            // a single leaf is stored in the left slot, the right slot is empty
+            float bmin[3], bmax[3];
+            boxToArray(rangeBox(boxes, order, start, end), bmin, bmax);
+            nodes[index].setChildBox(0, bmin, bmax);
+            nodes[index].setChildBox(1, bmin, bmax);
+            nodes[index].child[0] = leafRef(start, end);
+            nodes[index].child[1] = leafRef(end, end);
+            return;
+        }
+
+        Vector3f cmin = (boxes[order[start]].min() + boxes[order[start]].max()) * 0.5f;
+        Vector3f cmax = cmin;
+        for (size_t i = start + 1; i < end; i++) {
+            Vector3f c = (boxes[order[i]].min() + boxes[order[i]].max()) * 0.5f;
+            for (int a = 0; a < 3; a++) {
+                cmin[a] = fmin(cmin[a], c[a]);
+                cmax[a] = fmax(cmax[a], c[a]);
+            }
+        }
+        int axis = AABB(cmin, cmax).longest_axis();
+        size_t mid = start + span / 2;
+        std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+            [&boxes, axis](uint32_t a, uint32_t b) {
+                return boxes[a].min()[axis] + boxes[a].max()[axis] < boxes[b].min()[axis] + boxes[b].max()[axis];
+            });
+
+        size_t ranges[2][2] = {{start, mid}, {mid, end}};
+        for (int c = 0; c < 2; c++) {
+            size_t s = ranges[c][0], e = ranges[c][1];
+            float bmin[3], bmax[3], qmin[3], qmax[3];
+            boxToArray(rangeBox(boxes, order, s, e), bmin, bmax);
+            nodes[index].setChildBox(c, bmin, bmax);
+            if (e - s <= (size_t)leaf_size) {
+                nodes[index].child[c] = leafRef(s, e);
+            } else {
+                // the child's frame is its box as decoded by the parent, so
+                // everything below stays inside what the parent reports
+                nodes[index].childBox(c, qmin, qmax);
+                uint32_t child = (uint32_t)nodes.size();
+                nodes.push_back(Node());
+                nodes[index].child[c] = child;
+                buildNode(child, boxes, order, s, e, qmin, qmax);
+            }
+        }
+    }
+};
+
+enum BVHMode {
+    BVH_POINTER,    // classic BVHnode tree
+    BVH_FLAT,       // FlatBVH<FullBVHNode>
+    BVH_COMPACT16,  // FlatBVH<QuantizedBVHNode16>
+    BVH_COMPACT8    // FlatBVH<QuantizedBVHNode8>, the low-memory mode
+};
+
+// FlatBVH over a list of scene objects, a drop-in replacement for BVHnode.
+template <typename Node>
+class FlatBVHGroup : public Object3D {
+public:
+    FlatBVHGroup(const std::vector<shared_ptr<Object3D>>& src_objects, int max_leaf = 4) {
+        std::vector<AABB> boxes(src_objects.size());
+        for (size_t i = 0; i < src_objects.size(); i++) {
+            if (!src_objects[i]->bounding_box(0, 0, boxes[i]))
+                std::cerr << "No bounding box in FlatBVHGroup constructor.\n";
+        }
+        std::vector<uint32_t> order;
+        tree.build(boxes, order, max_leaf);
+        objects.resize(order.size());
+        for (size_t i = 0; i < order.size(); i++) objects[i] = src_objects[order[i]];
+    }
+
+    bool intersect(const Ray& r, Hit& h, float tmin = 0.0, float tmax = infinity) const override {
+        LeafIntersect leaf = {this, &r, &h, tmin};
+        float closest_t = tmax;
+        return tree.intersect(r, tmin, closest_t, leaf);
+    }
+
+    unsigned intersectPacket(RayPacket& packet, Hit* hits, unsigned active) const override {
+        LeafPacket leaf = {this, &packet, hits};
+        return tree.intersectPacket(packet, active, leaf);
+    }
+
+    bool occluded(const Ray& r, float tmin = 0.0, float tmax = infinity) const override {
+        LeafOccluded leaf = {this, &r, tmin};
+        return tree.occluded(r, tmin, tmax, leaf);
+    }
+
+    // the any-hit traversal, stopped by the first opaque object
+    double transmittance(const Ray& r, float tmin = 0.0, float tmax = infinity) const override {
+        LeafTransmittance leaf = {this, &r, tmin, 1};
+        return tree.occluded(r, tmin, tmax, leaf) ? 0 : leaf.T;
+    }
+
+    bool bounding_box(double time0, double time1, AABB& output_box) const override {
+        if (tree.empty()) return false;
+        output_box = tree.box();
+        return true;
+    }
+
+    size_t memoryBytes() const {
+        return tree.memoryBytes() + objects.capacity() * sizeof(shared_ptr<Object3D>);
+    }
+
+protected:
+    FlatBVH<Node> tree;
+    std::vector<shared_ptr<Object3D>> objects;
+
+    struct LeafIntersect {
+        const FlatBVHGroup* self;
+        const Ray* r;
+        Hit* h;
+        float tmin;
+        bool operator()(uint32_t first, uint32_t count, float& tmax) {
+            bool hit = false;
+            for (uint32_t i = first; i < first + count; i++) {
+                if (self->objects[i]->intersect(*r, *h, tmin, tmax)) {
+                    hit = true;
+                    tmax = h->getT();
+                }
+            }
+            return hit;
+        }
+    };
+
+    struct LeafPacket {
+        const FlatBVHGroup* self;
+        RayPacket* packet;
+        Hit* hits;
+        bool operator()(uint32_t first, uint32_t count, int lane) {
+            bool hit = false;
+            for (uint32_t i = first; i < first + count; i++) {
+                if (self->objects[i]->intersect(packet->rays[lane], hits[lane], packet->tmin, packet->tmax[lane])) {
+                    hit = true;
+                    packet->tmax[lane] = hits[lane].getT();
+                }
+            }
+            return hit;
+        }
+    };
+
+    struct LeafOccluded {
+        const FlatBVHGroup* self;
+        const Ray* r;
+        float tmin;
+        bool operator()(uint32_t first, uint32_t count, float tmax) {
+            for (uint32_t i = first; i < first + count; i++) {
+                if (self->objects[i]->occluded(*r, tmin, tmax)) return true;
+            }
+            return false;
+        }
+    };
+
+    struct LeafTransmittance {
+        const FlatBVHGroup* self;
+        const Ray* r;
+        float tmin;
+        double T;
+        bool operator()(uint32_t first, uint32_t count, float tmax) {
+            for (uint32_t i = first; i < first + count; i++) {
+                T *= self->objects[i]->transmittance(*r, tmin, tmax);
+                if (T <= 0) return true;
+            }
+            return false;
+        }
+    };
+};
+
+#endif // FLAT_BVH_H
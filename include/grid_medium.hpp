@@ -0,0 +1,219 @@
+#ifndef GRID_MEDIUM_H
+#define GRID_MEDIUM_H
+
+#include <vecmath.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "object3d.hpp"
+#include "material.hpp"
+#include "texture.hpp"
+
+// majorant cells per axis of a GridMedium, at most one per voxel
+#define MAJORANT_GRID_RES 16
+// ratio tracking plays Russian roulette below this transmittance
+#define TRANSMITTANCE_RR 0.1
+
+// A heterogeneous medium filling the box [bmin, bmax]; wrap it in a
+// Transform to place it. The density is given on an nx * ny * nz voxel grid,
+// x fastest, with the values at the voxel centers and trilinear in between.
+// A coarse grid keeps the largest density over each of its cells. Free
+// flights are sampled by delta tracking against it cell by cell, so thin and
+// empty regions are crossed in a few steps, and the transmittance is
+// estimated by ratio tracking over the same cells. The box is clipped with
+// one slab test; no boundary object is queried.
+class GridMedium : public Object3D {
+public:
+    // phase: an ISOTROPIC or HENYEY_GREENSTEIN material
+    GridMedium(const Vector3f &bmin, const Vector3f &bmax, int nx, int ny, int nz, const std::vector<float> &density,
+               double scale, shared_ptr<Material> phase)
+        : Object3D(phase), box(bmin, bmax), voxels(density) {
+        assert((int)voxels.size() == nx * ny * nz);
+        res[0] = nx;
+        res[1] = ny;
+        res[2] = nz;
+        for (float &d : voxels) d = std::max(d * scale, 0.0);
+        build();
+    }
+
+    // voxels set to the luminance of texture at their centers, e.g. a
+    // NoiseTexture for smoke
+    GridMedium(const Vector3f &bmin, const Vector3f &bmax, int nx, int ny, int nz, const Texture &texture,
+               double scale, shared_ptr<Material> phase)
+        : GridMedium(bmin, bmax, nx, ny, nz, sampleTexture(bmin, bmax, nx, ny, nz, texture), scale, phase) {}
+
+    bool intersect(const Ray &r, Hit &h, float tmin = 0.0, float tmax = infinity) const override {
+        double hit_t = 0;
+        auto collide = [&](double t, double majorant) {
+            if (random_double() * majorant >= densityAt(r.pointAtParameter(t))) return false;
+            hit_t = t;
+            return true;
+        };
+        if (!track(r, tmin, tmax, collide)) return false;
+        h.t = hit_t;
+        h.intersectP = r.pointAtParameter(hit_t);
+        h.normal = Vector3f(1, 0, 0);  // arbitrary
+        h.frontFace = true;           // also arbitrary
+        h.u = h.v = 0;
+        h.uv_rate = 0;
+        h.material = material.get();
+        return true;
+    }
+
+    bool occluded(const Ray &r, float tmin = 0.0, float tmax = infinity) const override {
+        auto collide = [&](double t, double majorant) {
+            return random_double() * majorant < densityAt(r.pointAtParameter(t));
+        };
+        return track(r, tmin, tmax, collide);
+    }
+
+    // Unbiased estimate of the fraction of light passing r between tmin and
+    // tmax: the product of 1 - density / majorant over tentative collisions.
+    double transmittance(const Ray &r, float tmin = 0.0, float tmax = infinity) const override {
+        double T = 1;
+        auto collide = [&](double t, double majorant) {
+            T *= 1 - densityAt(r.pointAtParameter(t)) / majorant;
+            if (T >= TRANSMITTANCE_RR) return false;
+            if (random_double() < 0.5) {
+                T = 0;
+                return true;
+            }
+            T *= 2;
+            return false;
+        };
+        track(r, tmin, tmax, collide);
+        return T;
+    }
+
+    bool bounding_box(double time0, double time1, AABB &output_box) const override {
+        output_box = box;
+        return true;
+    }
+
+    // density per unit length at local point p, trilinear between voxel centers
+    double densityAt(const Vector3f &p) const {
+        int i[3];
+        double f[3];
+        for (int a = 0; a < 3; ++a) {
+            double g = (p[a] - box.min()[a]) / (box.max()[a] - box.min()[a]) * res[a] - 0.5;
+            double fl = floor(g);
+            i[a] = (int)fl;
+            f[a] = g - fl;
+        }
+        double d = 0;
+        for (int c = 0; c < 8; ++c) {
+            double w = 1;
+            for (int a = 0; a < 3; ++a) w *= (c >> a & 1) ? f[a] : 1 - f[a];
+            if (w > 0) d += w * voxel(i[0] + (c & 1), i[1] + (c >> 1 & 1), i[2] + (c >> 2 & 1));
+        }
+        return d;
+    }
+
+private:
+    AABB box;
+    int res[3];
+    std::vector<float> voxels;
+    int mres[3];
+    std::vector<float> majorants;
+
+    static std::vector<float> sampleTexture(const Vector3f &bmin, const Vector3f &bmax, int nx, int ny, int nz,
+                                            const Texture &texture) {
+        std::vector<float> d;
+        d.reserve(nx * ny * nz);
+        Vector3f ext = bmax - bmin;
+        for (int k = 0; k < nz; ++k) {
+            for (int j = 0; j < ny; ++j) {
+                for (int i = 0; i < nx; ++i) {
+                    Vector3f p = bmin + Vector3f((i + 0.5) / nx * ext.x(), (j + 0.5) / ny * ext.y(), (k + 0.5) / nz * ext.z());
+                    d.push_back(luminance(texture.value(0, 0, p)));
+                }
+            }
+        }
+        return d;
+    }
+
+    // voxel value, indices clamped to the grid
+    float voxel(int i, int j, int k) const {
+        i = std::min(std::max(i, 0), res[0] - 1);
+        j = std::min(std::max(j, 0), res[1] - 1);
+        k = std::min(std::max(k, 0), res[2] - 1);
+        return voxels[(k * res[1] + j) * res[0] + i];
+    }
+
+    // Every majorant cell takes the maximum of the voxels its trilinear
+    // lookups can reach: those overlapping it and one more on each side.
+    void build() {
+        for (int a = 0; a < 3; ++a) mres[a] = std::min(res[a], MAJORANT_GRID_RES);
+        majorants.assign(mres[0] * mres[1] * mres[2], 0);
+        int lo[3], hi[3];
+        for (int k = 0; k < mres[2]; ++k) {
+            for (int j = 0; j < mres[1]; ++j) {
+                for (int i = 0; i < mres[0]; ++i) {
+                    int c[3] = {i, j, k};
+                    for (int a = 0; a < 3; ++a) {
+                        lo[a] = c[a] * res[a] / mres[a] - 1;
+                        hi[a] = ((c[a] + 1) * res[a] + mres[a] - 1) / mres[a];
+                    }
+                    float m = 0;
+                    for (int z = lo[2]; z <= hi[2]; ++z)
+                        for (int y = lo[1]; y <= hi[1]; ++y)
+                            for (int x = lo[0]; x <= hi[0]; ++x) m = std::max(m, voxel(x, y, z));
+                    majorants[(k * mres[1] + j) * mres[0] + i] = m;
+                }
+            }
+        }
+    }
+
+    // Samples tentative collisions along r within the box and [t0, t1]
+    // against the majorant of each cell the ray crosses (3D DDA), calling
+    // collide(t, majorant) at each until it returns true. Returns whether
+    // it did.
+    template <typename Collide>
+    bool track(const Ray &r, float t0, float t1, Collide &collide) const {
+        if (!box.clip(r, t0, t1)) return false;
+        const Vector3f &o = r.getOrigin(), &d = r.getDirection();
+        double len = d.length();
+        int cell[3], step[3];
+        double next[3], delta[3];
+        for (int a = 0; a < 3; ++a) {
+            double size = (box.max()[a] - box.min()[a]) / mres[a];
+            double x = (o[a] + t0 * d[a] - box.min()[a]) / size;
+            cell[a] = std::min(std::max((int)floor(x), 0), mres[a] - 1);
+            if (d[a] > 0) {
+                step[a] = 1;
+                next[a] = (box.min()[a] + (cell[a] + 1) * size - o[a]) / d[a];
+                delta[a] = size / d[a];
+            } else if (d[a] < 0) {
+                step[a] = -1;
+                next[a] = (box.min()[a] + cell[a] * size - o[a]) / d[a];
+                delta[a] = -size / d[a];
+            } else {
+                step[a] = 0;
+                next[a] = delta[a] = infinity;
+            }
+        }
+        double t = t0;
+        while (true) {
+            int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+            double end = std::min(next[axis], (double)t1);
+            double majorant = majorants[(cell[2] * mres[1] + cell[1]) * mres[0] + cell[0]];
+            if (majorant > 0) {
+                // exponential steps; the overshoot past the cell is dropped,
+                // the distribution being memoryless
+                while (true) {
+                    t -= log(1 - random_double()) / (majorant * len);
+                    if (t >= end) break;
+                    if (collide(t, majorant)) return true;
+                }
+            }
+            if (end >= t1) return false;
+            t = end;
+            cell[axis] += step[axis];
+            if (cell[axis] < 0 || cell[axis] >= mres[axis]) return false;
+            next[axis] += delta[axis];
+        }
+    }
+};
+
+#endif // GRID_MEDIUM_H
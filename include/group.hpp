@@ -45,6 +45,30 @@ public:
         return flag;
     }
 
+    unsigned intersectPacket(RayPacket &packet, Hit *hits, unsigned active) const override {
+        unsigned hit = 0;
+        for (const auto& object : objects) {
+            hit |= object->intersectPacket(packet, hits, active);
+        }
+        return hit;
+    }
+
+    bool occluded(const Ray &r, float tmin = 0.0, float tmax = infinity) const override {
+        for (const auto& object : objects) {
+            if (object->occluded(r, tmin, tmax)) return true;
+        }
+        return false;
+    }
+
+    double transmittance(const Ray &r, float tmin = 0.0, float tmax = infinity) const override {
+        double T = 1;
+        for (const auto& object : objects) {
+            T *= object->transmittance(r, tmin, tmax);
+            if (T <= 0) return 0;
+        }
+        return T;
+    }
+
     void addObject(int index, shared_ptr<Object3D> obj) {
         auto pos=objects.begin();
         while (index){
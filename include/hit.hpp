@@ -16,28 +16,23 @@ public:
         time = 0;
         u = 0;
         v = 0;
+        uv_rate = 0;
+        footprint = 0;
         frontFace = true;
         material = nullptr;
         normal = Vector3f::ZERO;
         intersectP = Vector3f::ZERO;
     }
 
-    Hit(float _t, float _time, bool _f, shared_ptr<Material> m, const Vector3f &n, const Vector3f &p) {
+    Hit(float _t, float _time, bool _f, Material *m, const Vector3f &n, const Vector3f &p) {
         t = _t;
         time = _time;
         frontFace = _f;
         material = m;
         normal = n;
         intersectP = p;
-    }
-
-    Hit(const Hit &h) {
-        t = h.t;
-        time = h.time;
-        frontFace = h.frontFace;
-        material = h.material;
-        normal = h.normal;
-        intersectP = h.intersectP;
+        uv_rate = 0;
+        footprint = 0;
     }
 
     // destructor
@@ -51,7 +46,7 @@ public:
         return frontFace;
     }
 
-    shared_ptr<Material> getMaterial() const {
+    Material *getMaterial() const {
         return material;
     }
 
@@ -64,12 +59,13 @@ public:
         return intersectP;
     }
 
-    void set(float _t, shared_ptr<Material> m, const Vector3f &outside_n, const Ray &r) {
+    void set(float _t, Material *m, const Vector3f &outside_n, const Ray &r) {
         t = _t;
         material = m;
         frontFace = Vector3f::dot(r.getDirection(), outside_n) < 0;
         normal = frontFace ? outside_n :-outside_n;
         intersectP = r.pointAtParameter(t);
+        uv_rate = 0;
     }
 
     
@@ -77,9 +73,17 @@ public:
     float t;
     float time; 
     bool frontFace;
-    shared_ptr<Material> material;
+    // owned by the object that was hit, which outlives its hits; a plain
+    // pointer keeps copying hits free of reference counting
+    Material *material;
     Vector3f normal;
     Vector3f intersectP;
+    // (u, v) units per unit length on the surface, 0 if unknown; set by the
+    // object after set()
+    float uv_rate;
+    // width in (u, v) of the pixel footprint about the hit, for filtering
+    // textures; set by the renderer, 0 is a point sample
+    float footprint;
 
 };
 
@@ -0,0 +1,226 @@
+#ifndef LIGHT_SAMPLER_H
+#define LIGHT_SAMPLER_H
+
+#include <vecmath.h>
+#include <algorithm>
+#include <vector>
+
+#include "group.hpp"
+#include "alias_table.hpp"
+
+// From this many lights on they are picked by descending the light BVH,
+// below it from the alias table.
+#define LIGHT_BVH_MIN_LIGHTS 8
+// texture samples per axis when estimating the emission of a light
+#define LIGHT_POWER_SAMPLES 8
+
+// Picks the light for next-event estimation. Every light is weighted by an
+// estimate of its power, area times mean emitted luminance; lights of unknown
+// area get the mean power of the others. Few lights are picked by power alone
+// from an alias table in O(1). Many lights are picked by descending a BVH
+// over them, choosing each child by its power over the squared distance to
+// the shading point (at least its own radius), in O(log n). The same tree
+// finds which light a ray hits, so the probability of a light hit by a BSDF
+// sample is also O(log n).
+class LightSampler {
+public:
+    LightSampler() : bounded(true) {}
+
+    explicit LightSampler(const Group *group) : bounded(true) {
+        if (!group) return;
+        for (const auto &object : group->getObjects()) lights.push_back(object.get());
+        int n = lights.size();
+        if (n == 0) return;
+        power.resize(n);
+        double known = 0;
+        int known_count = 0;
+        for (int i = 0; i < n; ++i) {
+            power[i] = lightPower(lights[i]);
+            if (power[i] > 0) {
+                known += power[i];
+                ++known_count;
+            }
+        }
+        for (int i = 0; i < n; ++i) {
+            if (power[i] < 0) power[i] = known_count ? known / known_count : 1;
+        }
+        table = AliasTable(power);
+
+        std::vector<AABB> boxes(n);
+        for (int i = 0; i < n; ++i) {
+            if (!lights[i]->bounding_box(0, 1, boxes[i])) {
+                // unbounded lights have no distance, they disable the tree
+                boxes[i] = AABB(Vector3f(-infinity, -infinity, -infinity), Vector3f(infinity, infinity, infinity));
+                bounded = false;
+            }
+        }
+        std::vector<int> ids(n);
+        for (int i = 0; i < n; ++i) ids[i] = i;
+        leaf.resize(n);
+        nodes.reserve(2 * n - 1);
+        build(ids, boxes, 0, n, -1);
+    }
+
+    int size() const { return lights.size(); }
+
+    const Object3D *light(int i) const { return lights[i]; }
+
+    // A light for shading point p and the probability of picking it, -1 if
+    // there is none to pick.
+    int sample(const Vector3f &p, double &prob) const {
+        prob = 0;
+        if (table.empty()) return -1;
+        if (!useTree()) {
+            int i = table.sample();
+            prob = table.probability(i);
+            return i;
+        }
+        int node = 0;
+        prob = 1;
+        while (nodes[node].light < 0) {
+            const Node &n = nodes[node];
+            double pl = leftProbability(n, p);
+            if (random_double() < pl) {
+                node = n.left;
+                prob *= pl;
+            } else {
+                node = n.right;
+                prob *= 1 - pl;
+            }
+        }
+        return nodes[node].light;
+    }
+
+    // Probability that sample(p) picks light i.
+    double probability(const Vector3f &p, int i) const {
+        if (table.empty()) return 0;
+        if (!useTree()) return table.probability(i);
+        double prob = 1;
+        for (int node = leaf[i]; nodes[node].parent >= 0; node = nodes[node].parent) {
+            const Node &parent = nodes[nodes[node].parent];
+            double pl = leftProbability(parent, p);
+            prob *= parent.left == node ? pl : 1 - pl;
+        }
+        return prob;
+    }
+
+    // Light with a surface at distance t_hit along r, -1 if none. Only
+    // boxes around that point are visited and the lights are asked for an
+    // any-hit in a thin range around it, so no Hit is built.
+    int lightAt(const Ray &r, float t_hit) const {
+        if (nodes.empty()) return -1;
+        float tmin = t_hit * (1 - 1e-4f), tmax = t_hit * (1 + 1e-4f);
+        int stack[64], top = 0;
+        stack[top++] = 0;
+        while (top) {
+            const Node &n = nodes[stack[--top]];
+            if (!n.box.intersect(r, tmin, tmax)) continue;
+            if (n.light >= 0) {
+                if (lights[n.light]->occluded(r, tmin, tmax)) return n.light;
+                continue;
+            }
+            stack[top++] = n.left;
+            stack[top++] = n.right;
+        }
+        return -1;
+    }
+
+    // Solid-angle density, at origin p, of sampling direction v by picking a
+    // light and sampling it, counting only the light hit at distance t_hit
+    // along v. 0 if no light is there (the hit emitter is not a light).
+    double pdf_value(const Vector3f &p, const Vector3f &v, float t_hit) const {
+        int i = lightAt(Ray(p, v), t_hit);
+        if (i < 0) return 0;
+        return probability(p, i) * lights[i]->pdf_value(p, v);
+    }
+
+private:
+    struct Node {
+        AABB box;
+        double power;
+        int left, right, parent;
+        int light;  // leaf: index of the light, -1 for inner nodes
+    };
+
+    std::vector<const Object3D *> lights;
+    std::vector<double> power;
+    AliasTable table;
+    std::vector<Node> nodes;
+    std::vector<int> leaf;  // node of each light
+    bool bounded;
+
+    bool useTree() const {
+        return bounded && (int)lights.size() >= LIGHT_BVH_MIN_LIGHTS;
+    }
+
+    // area times the mean luminance of the emission, 0 for objects that do
+    // not emit, -1 if unknown
+    static double lightPower(const Object3D *object) {
+        const Material *m = object->getMaterial();
+        if (!m) return -1;
+        if (m->type != DIFFUSE_LIGHT) return 0;
+        if (object->area() <= 0) return -1;
+        Vector3f sum = Vector3f::ZERO;
+        for (int i = 0; i < LIGHT_POWER_SAMPLES; ++i) {
+            for (int j = 0; j < LIGHT_POWER_SAMPLES; ++j) {
+                sum += m->albedo((i + 0.5) / LIGHT_POWER_SAMPLES, (j + 0.5) / LIGHT_POWER_SAMPLES, Vector3f::ZERO);
+            }
+        }
+        sum = sum / (LIGHT_POWER_SAMPLES * LIGHT_POWER_SAMPLES) * m->param;
+        return object->area() * std::max(luminance(sum), 0.0);
+    }
+
+    // Splits at the median centroid along the longest axis of the centroids.
+    int build(std::vector<int> &ids, const std::vector<AABB> &boxes, int begin, int end, int parent) {
+        int index = nodes.size();
+        nodes.push_back(Node());
+        Node node;
+        node.parent = parent;
+        node.left = node.right = node.light = -1;
+        node.power = 0;
+        node.box = boxes[ids[begin]];
+        for (int i = begin; i < end; ++i) {
+            node.box = AABB::surrounding_box(node.box, boxes[ids[i]]);
+            node.power += power[ids[i]];
+        }
+        if (end - begin == 1) {
+            node.light = ids[begin];
+            leaf[node.light] = index;
+            nodes[index] = node;
+            return index;
+        }
+        AABB centroids(center(boxes[ids[begin]]), center(boxes[ids[begin]]));
+        for (int i = begin; i < end; ++i) {
+            centroids = AABB::surrounding_box(centroids, AABB(center(boxes[ids[i]]), center(boxes[ids[i]])));
+        }
+        int axis = centroids.longest_axis();
+        int mid = (begin + end) / 2;
+        std::nth_element(ids.begin() + begin, ids.begin() + mid, ids.begin() + end, [&](int a, int b) {
+            return center(boxes[a])[axis] < center(boxes[b])[axis];
+        });
+        nodes[index] = node;
+        int left = build(ids, boxes, begin, mid, index);
+        int right = build(ids, boxes, mid, end, index);
+        nodes[index].left = left;
+        nodes[index].right = right;
+        return index;
+    }
+
+    static Vector3f center(const AABB &box) {
+        return 0.5f * (box.min() + box.max());
+    }
+
+    // power over squared distance, the distance no less than the node radius
+    static double importance(const Node &n, const Vector3f &p) {
+        Vector3f half = 0.5f * (n.box.max() - n.box.min());
+        double d2 = (p - center(n.box)).squaredLength();
+        return n.power / std::max(d2, (double)half.squaredLength());
+    }
+
+    double leftProbability(const Node &n, const Vector3f &p) const {
+        double il = importance(nodes[n.left], p), ir = importance(nodes[n.right], p);
+        return il + ir > 0 ? il / (il + ir) : 0.5;
+    }
+};
+
+#endif // LIGHT_SAMPLER_H
@@ -0,0 +1,37 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+
+// Read-only memory mapping of a whole file (mmap on POSIX, MapViewOfFile on
+// Windows). The mapping lives as long as the object.
+class MappedFile {
+public:
+    MappedFile() : ptr(nullptr), length(0), handle(nullptr), mapping(nullptr) {}
+    explicit MappedFile(const char *filename) : MappedFile() { open(filename); }
+    ~MappedFile() { close(); }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // False if the file cannot be opened or mapped. An empty file maps to
+    // data() == nullptr, size() == 0 and still succeeds. sequential tells the
+    // system the file is read front to back once; otherwise, as for a BVH,
+    // the access pattern is left to its default.
+    bool open(const char *filename, bool sequential = false);
+    void close();
+
+    bool isOpen() const { return ptr != nullptr || opened; }
+    const char *data() const { return ptr; }
+    size_t size() const { return length; }
+
+private:
+    const char *ptr;
+    size_t length;
+    bool opened = false;
+    // platform handles, the file descriptor is stored in handle on POSIX
+    void *handle;
+    void *mapping;
+};
+
+#endif // MAPPED_FILE_H
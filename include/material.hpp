@@ -2,6 +2,8 @@
 #define MATERIAL_H
 
 #include <cassert>
+#include <deque>
+#include <vector>
 #include <vecmath.h>
 
 #include "ray.hpp"
@@ -14,140 +16,154 @@ struct ScatterRecord {
     Ray specular_ray;
     bool is_specular;
     Vector3f attenuation;
-    shared_ptr<PDF> pdf_ptr;
+    PDF pdf;  // kind NONE for specular scattering
 };
-class Material {
-public:
-
-    Material(
-        const Vector3f &a_color, const Vector3f &d_color, const Vector3f &s_color = Vector3f::ZERO, float s = 0
-        ) : ambientColor(a_color), diffuseColor(d_color), specularColor(s_color), shininess(s){
-
-    }
 
-    Material () {}
+enum MaterialType {
+    LAMBERTIAN, METAL, DIELECTRIC, DIFFUSE_LIGHT, ISOTROPIC, ROUGH_CONDUCTOR, ROUGH_DIELECTRIC, HENYEY_GREENSTEIN
+};
 
-    virtual ~Material() = default;
+// Below this GGX alpha a rough material is made a smooth METAL / DIELECTRIC.
+#define MIN_GGX_ALPHA 1e-3
 
-    Vector3f getDiffuseColor() const {
-        return diffuseColor;
+// A material is a small record whose type selects the meaning of its fields
+// and the branch taken by scatter / eval / emitted. There are no
+// virtual functions: the switches inline, and hits of one type can be shaded
+// together. Records live in a MaterialTable, which also owns their textures.
+class Material {
+public:
+    MaterialType type;
+    // albedo (LAMBERTIAN, METAL, ISOTROPIC, HENYEY_GREENSTEIN), reflectance at normal incidence
+    // (ROUGH_CONDUCTOR), attenuation (DIELECTRIC, ROUGH_DIELECTRIC) or
+    // emission (DIFFUSE_LIGHT), unless a texture is set
+    Vector3f color;
+    const Texture *texture;
+    // fuzz (METAL), index of refraction (DIELECTRIC, ROUGH_DIELECTRIC),
+    // illumination (DIFFUSE_LIGHT), asymmetry g (HENYEY_GREENSTEIN)
+    float param;
+    // GGX alpha, the square of the roughness (ROUGH_CONDUCTOR, ROUGH_DIELECTRIC)
+    float alpha;
+
+    Material(MaterialType t = LAMBERTIAN, const Vector3f &c = Vector3f::ZERO, float p = 0, const Texture *tex = nullptr,
+             float a = 0)
+        : type(t), color(c), texture(tex), param(p), alpha(a) {}
+
+    Vector3f albedo(double u, double v, const Vector3f &p) const {
+        return texture ? texture->value(u, v, p) : color;
     }
 
-    Vector3f getAmbientColor() const {
-        return ambientColor;
+    // averaged over a footprint width wide in (u, v)
+    Vector3f albedo(double u, double v, const Vector3f &p, float width) const {
+        return texture ? texture->filtered(u, v, p, width) : color;
     }
 
-    Vector3f getSpecularColor() const {
-        return specularColor;
+    Vector3f albedo(const Hit &hit) const {
+        return albedo(hit.u, hit.v, hit.getIntersectP(), hit.footprint);
     }
 
-    virtual bool scatter(const Ray &r_in, const Hit &hit, ScatterRecord &srec) const {
-        return false;
+    bool scatter(const Ray &r_in, const Hit &hit, ScatterRecord &srec) const {
+        switch (type) {
+            case LAMBERTIAN:
+                srec.is_specular = false;
+                srec.attenuation = albedo(hit);
+                srec.pdf = CosinePDF(hit.getNormal());
+                return true;
+            case METAL: {
+                Vector3f reflected = reflect(r_in.getDirection().normalized(), hit.getNormal());
+                srec.specular_ray =
+                    Ray(hit.getIntersectP(), reflected + param*random_in_unit_sphere(), r_in.getTime());
+                srec.attenuation = albedo(hit);
+                srec.is_specular = true;
+                srec.pdf = PDF();
+                return true;
+            }
+            case DIELECTRIC:
+                return scatterDielectric(r_in, hit, srec);
+            case ISOTROPIC:
+                srec.attenuation = albedo(hit);
+                srec.is_specular = false;
+                srec.pdf = SpherePDF();
+                return true;
+            case HENYEY_GREENSTEIN:
+                srec.attenuation = albedo(hit);
+                srec.is_specular = false;
+                srec.pdf = HenyeyGreensteinPDF(r_in.getDirection(), param);
+                return true;
+            case ROUGH_CONDUCTOR:
+                srec.attenuation = albedo(hit);
+                srec.is_specular = false;
+                srec.pdf = GGXPDF(hit.getNormal(), -r_in.getDirection(), alpha);
+                return true;
+            case ROUGH_DIELECTRIC:
+                srec.attenuation = color;
+                srec.is_specular = false;
+                srec.pdf = GGXPDF(hit.getNormal(), -r_in.getDirection(), alpha, relativeIndex(hit));
+                return true;
+            default:
+                return false;
+        }
     }
 
-    virtual double scatterPDF(const Ray &r_in, const Hit &hit, const Ray &scattered) const {
-        return 0;
+    double scatterPDF(const Ray &r_in, const Hit &hit, const Ray &scattered) const {
+        switch (type) {
+            case LAMBERTIAN: {
+                auto cosine = Vector3f::dot(hit.getNormal(), scattered.getDirection().normalized());
+                return cosine < 0 ? 0 : cosine/M_PI;
+            }
+            case ISOTROPIC:
+                return 1 / (4 * M_PI);
+            case HENYEY_GREENSTEIN: {
+                auto cosine = Vector3f::dot(r_in.getDirection().normalized(), scattered.getDirection().normalized());
+                return henyey_greenstein(cosine, param);
+            }
+            default:
+                return 0;
+        }
     }
 
-    virtual Vector3f emitted(const Hit &hit, double u, double v, const Vector3f& p, bool isLight = false) {
-        return Vector3f(0,0,0);
+    // BSDF times the cosine of scattered to the normal, the factor a path
+    // continued along scattered takes; only for non-specular scattering.
+    Vector3f eval(const Ray &r_in, const Hit &hit, const Ray &scattered) const {
+        switch (type) {
+            case LAMBERTIAN:
+            case ISOTROPIC:
+            case HENYEY_GREENSTEIN:
+                return albedo(hit) * scatterPDF(r_in, hit, scattered);
+            case ROUGH_CONDUCTOR: {
+                ONB uvw;
+                uvw.build_from_w(hit.getNormal());
+                return GGX::conductorEval(uvw.toLocal(-r_in.getDirection().normalized()),
+                                          uvw.toLocal(scattered.getDirection().normalized()), alpha,
+                                          albedo(hit));
+            }
+            case ROUGH_DIELECTRIC: {
+                ONB uvw;
+                uvw.build_from_w(hit.getNormal());
+                return color * GGX::dielectricEval(uvw.toLocal(-r_in.getDirection().normalized()),
+                                                   uvw.toLocal(scattered.getDirection().normalized()), alpha,
+                                                   relativeIndex(hit));
+            }
+            default:
+                return Vector3f::ZERO;
+        }
     }
 
-    Vector3f Shade(const Ray &ray, const Hit &hit,
-                   const Vector3f &dirToLight, const Vector3f &lightColor) {
-        Vector3f shaded = Vector3f::ZERO;
-        float diffuse=Vector3f::dot(dirToLight,hit.getNormal());
-        diffuse = clamp(diffuse, 0.0);
-        Vector3f R=2*(Vector3f::dot(hit.getNormal(),dirToLight)*hit.getNormal())-dirToLight;
-        R.normalize();
-        float specular=Vector3f::dot(-ray.getDirection(),R);
-        specular = clamp(specular, 0.0);
-        if(specular!=0){
-            specular=pow(specular,shininess);
+    Vector3f emitted(const Hit &hit, double u, double v, const Vector3f& p, bool isLight = false) const {
+        if (type != DIFFUSE_LIGHT || !hit.getFrontFace()) {
+            return Vector3f::ZERO;
         }
-        shaded = lightColor*(diffuseColor*diffuse+specularColor*specular);
-        return shaded;
+        if (isLight){
+            return albedo(u, v, p, hit.footprint);
+        }
+        return albedo(u, v, p, hit.footprint)*param;
     }
-    
-
-protected:
-    Vector3f ambientColor;
-    Vector3f diffuseColor;
-    Vector3f specularColor;
-    float shininess;
-};
 
-class Lambertian : public Material {
-public:
-    Lambertian(
-        const Vector3f &a_color, const Vector3f &d_color, const Vector3f &s_color = Vector3f::ZERO, float s = 0,
-        shared_ptr<Texture> a = nullptr
-    ): Material(a_color,d_color,s_color,s){
-        albedo = a;
-    }
-    Lambertian(Vector3f c) {
-        albedo = make_shared<SolidColor>(c);
-    }
-    Lambertian(shared_ptr<Texture> a) {
-        albedo = a;
-    }
-    bool scatter(const Ray &r_in, const Hit &hit,  ScatterRecord &srec) const override {
-        srec.is_specular = false;
-        srec.attenuation = albedo->value(hit.u, hit.v, hit.getIntersectP());
-        srec.pdf_ptr = make_shared<CosinePDF>(hit.getNormal());
-        return true;
-    }
-    double scatterPDF(
-        const Ray& r_in, const Hit& rec, const Ray& scattered
-    ) const override {
-        auto cosine = Vector3f::dot(rec.getNormal(), scattered.getDirection().normalized());
-        return cosine < 0 ? 0 : cosine/M_PI;
-    }
 protected:
-    shared_ptr<Texture> albedo;
-};
-
-class Metal : public Material {
-public:
-    Metal(
-        const Vector3f &a_color, const Vector3f &d_color, const Vector3f &s_color , float s = 0,
-        shared_ptr<Texture> a = nullptr, float f = 0 
-    ): Material(a_color,d_color,s_color,s){
-        albedo = a;
-        fuzz = f;
-    }
-    Metal (shared_ptr<Texture> a, float f=0.0) : albedo(a), fuzz(f) {}
-    Metal (const Vector3f &c, float f=0.0) : albedo(make_shared<SolidColor>(c)), fuzz(f) {}
-    bool scatter(const Ray &r_in, const Hit &hit, ScatterRecord &srec) const override {
-        Vector3f reflected = reflect(r_in.getDirection().normalized(), hit.getNormal());
-        srec.specular_ray =
-            Ray(hit.getIntersectP(), reflected + fuzz*random_in_unit_sphere(), r_in.getTime());
-        srec.attenuation = albedo->value(hit.u, hit.v, hit.getIntersectP());
+    bool scatterDielectric(const Ray &r_in, const Hit &hit, ScatterRecord &srec) const {
         srec.is_specular = true;
-        srec.pdf_ptr = nullptr;
-        return true;
-    }
-protected:
-    shared_ptr<Texture> albedo;
-    float fuzz;
-};
-
-class Dielectric : public Material {
-public:
-    Dielectric(
-        const Vector3f &a_color, const Vector3f &d_color, const Vector3f &s_color = Vector3f::ZERO, float s = 0,
-        float i = 0, Vector3f a = Vector3f(1.0, 1.0, 1.0)
-    ): Material(a_color,d_color,s_color,s){
-        ir = i; attenuation = a;
-    }
-
-    Dielectric(float i = 0, Vector3f a = Vector3f(1.0, 1.0 ,1.0)): ir(i), attenuation(a) {}
-
-    bool scatter(const Ray &r_in, const Hit &hit, ScatterRecord &srec) const override {
-        srec.is_specular = true;
-        srec.pdf_ptr = nullptr;
-        srec.attenuation = attenuation;
-        double refraction_ratio = hit.getFrontFace() ? (1.0/ir) : ir;
+        srec.pdf = PDF();
+        srec.attenuation = color;
+        double refraction_ratio = hit.getFrontFace() ? (1.0/param) : param;
 
         Vector3f unit_direction = r_in.getDirection().normalized();
         double cos_theta = fmin(Vector3f::dot(-unit_direction, hit.getNormal()), 1.0);
@@ -164,9 +180,12 @@ public:
         srec.specular_ray = Ray(hit.getIntersectP(), direction, r_in.getTime());
         return true;
     }
-protected:
-    float ir;
-    Vector3f attenuation;
+
+    // index of refraction on the far side of the surface over the near one
+    double relativeIndex(const Hit &hit) const {
+        return hit.getFrontFace() ? param : 1.0 / param;
+    }
+
     static double reflectance(double cosine, double ref_idx) {
         // Use Schlick's approximation for reflectance.
         auto r0 = (1-ref_idx) / (1+ref_idx);
@@ -175,65 +194,66 @@ protected:
     }
 };
 
-class DiffuseLight : public Material {
-    public:
-        DiffuseLight(
-            const Vector3f &a_color, const Vector3f &d_color, const Vector3f &s_color = Vector3f::ZERO, float s = 0,
-            shared_ptr<Texture> a = nullptr, float i = 1.0
-        ): Material(a_color,d_color,s_color,s), emit(a), illumination(i) {}
-
-        DiffuseLight(
-            const Vector3f &a_color, const Vector3f &d_color, const Vector3f &s_color = Vector3f::ZERO, float s = 0,
-            Vector3f c = Vector3f::ZERO, float i = 1.0
-        ): Material(a_color,d_color,s_color,s), illumination(i) {
-            emit = make_shared<SolidColor>(c);
-        }
-
-        DiffuseLight(Vector3f c, float i = 1.0): illumination(i) {
-            emit = make_shared<SolidColor>(c);
-        }
-
-        DiffuseLight(shared_ptr<Texture> a, float i = 1.0): illumination(i) {
-            emit = a;
-        }
+// Scene-owned storage of the materials. Records are appended to a deque, so
+// they never move and objects and hits can point at them; the shared_ptr
+// handed out shares ownership of the whole table. Textures given to the
+// table are kept alive with it.
+class MaterialTable {
+public:
+    MaterialTable() : storage(make_shared<Storage>()) {}
 
-        Vector3f emitted(const Hit &hit, double u, double v, const Vector3f& p, bool isLight = false) override {
-            if (!hit.getFrontFace()) {
-                return Vector3f::ZERO;
-            }
-            if (isLight){
-                return emit->value(u, v, p);
-            }
-            return emit->value(u, v, p)*illumination;
+    shared_ptr<Material> add(const Material &m, shared_ptr<Texture> texture = nullptr) {
+        storage->records.push_back(m);
+        if (texture) {
+            storage->textures.push_back(texture);
+            storage->records.back().texture = texture.get();
         }
+        return shared_ptr<Material>(storage, &storage->records.back());
+    }
 
-    public:
-        shared_ptr<Texture> emit;
-        float illumination;
-};
-
-class Isotropic : public Material {
-    public:
-        Isotropic(Vector3f c) {
-            albedo = make_shared<SolidColor>(c);
-        }
-        Isotropic(shared_ptr<Texture> a) : albedo(a) {}
-
-        virtual bool scatter(
-            const Ray& r_in, const Hit& rec, ScatterRecord &srec
-        ) const override {
-            srec.attenuation = albedo->value(rec.u, rec.v, rec.getIntersectP());
-            srec.is_specular = false;
-            srec.pdf_ptr = make_shared<SpherePDF>();
-            return true;
-        }
+    shared_ptr<Material> lambertian(const Vector3f &c) { return add(Material(LAMBERTIAN, c)); }
+    shared_ptr<Material> lambertian(shared_ptr<Texture> a) { return add(Material(LAMBERTIAN), a); }
+    shared_ptr<Material> metal(const Vector3f &c, float fuzz = 0) { return add(Material(METAL, c, fuzz)); }
+    shared_ptr<Material> metal(shared_ptr<Texture> a, float fuzz = 0) { return add(Material(METAL, Vector3f::ZERO, fuzz), a); }
+    shared_ptr<Material> dielectric(float ir, const Vector3f &attenuation = Vector3f(1, 1, 1)) {
+        return add(Material(DIELECTRIC, attenuation, ir));
+    }
+    // GGX conductor and dielectric; at (nearly) zero roughness the smooth ones
+    shared_ptr<Material> roughConductor(const Vector3f &c, float roughness) {
+        if (roughness * roughness < MIN_GGX_ALPHA) return metal(c);
+        return add(Material(ROUGH_CONDUCTOR, c, 0, nullptr, roughness * roughness));
+    }
+    shared_ptr<Material> roughConductor(shared_ptr<Texture> a, float roughness) {
+        if (roughness * roughness < MIN_GGX_ALPHA) return metal(a);
+        return add(Material(ROUGH_CONDUCTOR, Vector3f::ZERO, 0, nullptr, roughness * roughness), a);
+    }
+    shared_ptr<Material> roughDielectric(float ir, float roughness, const Vector3f &attenuation = Vector3f(1, 1, 1)) {
+        if (roughness * roughness < MIN_GGX_ALPHA) return dielectric(ir, attenuation);
+        return add(Material(ROUGH_DIELECTRIC, attenuation, ir, nullptr, roughness * roughness));
+    }
+    shared_ptr<Material> diffuseLight(const Vector3f &c, float illumination = 1) {
+        return add(Material(DIFFUSE_LIGHT, c, illumination));
+    }
+    shared_ptr<Material> diffuseLight(shared_ptr<Texture> a, float illumination = 1) {
+        return add(Material(DIFFUSE_LIGHT, Vector3f::ZERO, illumination), a);
+    }
+    shared_ptr<Material> isotropic(const Vector3f &c) { return add(Material(ISOTROPIC, c)); }
+    shared_ptr<Material> isotropic(shared_ptr<Texture> a) { return add(Material(ISOTROPIC), a); }
+    // phase function of a medium scattering forward for g > 0, back for g < 0
+    shared_ptr<Material> henyeyGreenstein(const Vector3f &c, float g) {
+        if (fabs(g) < 1e-3) return isotropic(c);
+        return add(Material(HENYEY_GREENSTEIN, c, g));
+    }
 
-        double scatterPDF(const Ray& r_in, const Hit& rec, const Ray& scattered) const override {
-            return 1 / (4 * M_PI);
-        }
+    size_t size() const { return storage->records.size(); }
+    const Material &operator[](size_t i) const { return storage->records[i]; }
 
-    public:
-        shared_ptr<Texture> albedo;
+private:
+    struct Storage {
+        std::deque<Material> records;
+        std::vector<shared_ptr<Texture>> textures;
+    };
+    shared_ptr<Storage> storage;
 };
 
 #endif // MATERIAL_H
@@ -1,43 +1,184 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include <string>
 #include <vector>
 #include "object3d.hpp"
-#include "triangle.hpp"
+#include "flat_bvh.hpp"
+#include "triangle_simd.hpp"
+#include "mapped_file.hpp"
+#include "alias_table.hpp"
 #include "Vector2f.h"
 #include "Vector3f.h"
 #include "utils.hpp"
 
+// Triangles per BVH leaf of a mesh, one block of the SIMD triangle kernel.
+#define MESH_LEAF_SIZE TRIANGLE_BLOCK_SIZE
 
+// Read-only view of an array, either one of the mesh's own vectors or a
+// section of a mapped mesh file (see mesh_file.hpp).
+template <typename T>
+struct ArrayView {
+    const T *ptr = nullptr;
+    size_t count = 0;
 
+    ArrayView() {}
+    ArrayView(const T *p, size_t n) : ptr(p), count(n) {}
+    ArrayView(const std::vector<T> &v) : ptr(v.data()), count(v.size()) {}
+
+    const T &operator[](size_t i) const { return ptr[i]; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+};
+
+// Indexed triangle mesh. Positions (and optional vertex normals) are stored
+// once in shared buffers and every triangle is three indices into them, so a
+// triangle costs 12 bytes plus its share of the vertices instead of a whole
+// Triangle object. The BVH references triangles by index; normals and UVs are
+// only looked up for the closest hit. Leaves are intersected by the SIMD
+// kernels of triangle_simd.hpp on an SoA copy with precomputed edges, except
+// in the low-memory mode.
+// Meshes can also be read from the binary container of mesh_file.hpp, in
+// which case the buffers, the tree and the SoA block are used in place from
+// a read-only mapping of the file.
 class Mesh : public Object3D {
 
 public:
-    Mesh(const char *filename, shared_ptr<Material> m);
-    Mesh(const std::vector<shared_ptr<Object3D>> &tri, shared_ptr<Material> m);
-
     struct TriangleIndex {
         TriangleIndex() {
             x[0] = 0; x[1] = 0; x[2] = 0;
         }
+        TriangleIndex(int a, int b, int c) {
+            x[0] = a; x[1] = b; x[2] = c;
+        }
         int &operator[](const int i) { return x[i]; }
         int operator[](const int i) const { return x[i]; }
         // By Computer Graphics convention, counterclockwise winding is front face
         int x[3]{};
     };
 
+    // filename is an .obj file or a mesh file (MESH_FILE_EXTENSION).
+    // mode selects the triangle BVH layout, BVH_COMPACT8 is the low-memory
+    // mode (see flat_bvh.hpp for the trade-off). Meshes are always built on a
+    // flat tree, BVH_POINTER falls back to BVH_FLAT. A mesh file that carries
+    // a tree keeps the layout it was converted with.
+    Mesh(const char *filename, shared_ptr<Material> m, BVHMode mode = BVH_FLAT);
+    // normals is either empty (flat shading) or holds one normal per vertex.
+    Mesh(const std::vector<Vector3f> &vertices, const std::vector<TriangleIndex> &faces,
+         const std::vector<Vector3f> &normals, shared_ptr<Material> m, BVHMode mode = BVH_FLAT);
+
     std::vector<Vector3f> v;
     std::vector<TriangleIndex> t;
+    // Optional shading attributes. They are indexed through tn / tt when
+    // those are filled (OBJ files index them separately, -1 = none for that
+    // face), otherwise through t.
     std::vector<Vector3f> n;
-    std::vector<shared_ptr<Object3D>> triangle;
-    shared_ptr<Object3D> triangle_bvh;
+    std::vector<Vector2f> vt;
+    std::vector<TriangleIndex> tn;
+    std::vector<TriangleIndex> tt;
+    // Optional per-face index into material_names (usemtl), -1 = none.
+    std::vector<int> face_material;
+    std::vector<std::string> material_names;
+
+    // The buffers above are only filled while a mesh is built; a mapped mesh
+    // file leaves them empty. Everything else reads through these views.
+    size_t numVertices() const { return vertices.size(); }
+    size_t numTriangles() const { return faces.size(); }
+    const Vector3f &vertex(size_t i) const { return vertices[i]; }
+    const TriangleIndex &face(size_t i) const { return faces[i]; }
+
+    // Writes the mesh, its tree and SoA block to a mesh file.
+    bool saveBinary(const char *filename) const;
+
     bool intersect(const Ray &r, Hit &h, float tmin = 0.0, float tmax = infinity) const override;
+    bool occluded(const Ray &r, float tmin = 0.0, float tmax = infinity) const override;
+    unsigned intersectPacket(RayPacket &packet, Hit *hits, unsigned active) const override;
     bool bounding_box(double time0, double time1, AABB& output_box) const override;
 
+    // A mesh with an emissive material is a light: random picks a triangle
+    // in proportion to its area times the emission at its center, then a
+    // point on it uniformly. pdf_value sums the density over every triangle
+    // along the direction, not just the nearest.
+    double area() const override;
+    double pdf_value(const Vector3f &o, const Vector3f &v) const override;
+    Vector3f random(const Vector3f &o) const override;
+
+    size_t memoryBytes() const;
+
 private:
+    ArrayView<Vector3f> vertices, normals;
+    ArrayView<Vector2f> texcoords;
+    ArrayView<TriangleIndex> faces, normal_faces, texcoord_faces;
+    ArrayView<int> face_materials;
+    shared_ptr<MappedFile> mapping;
+
+    BVHMode mode;
+    FlatBVH<FullBVHNode> tree;
+    FlatBVH<QuantizedBVHNode16> tree16;
+    FlatBVH<QuantizedBVHNode8> tree8;
+    TriangleSoA soa;
+    TriangleKernel kernel;
+    double total_area;
+    AliasTable light_table;  // empty unless the material emits
+
+    // closest hit found so far: triangle and its barycentrics
+    struct TriangleHit {
+        uint32_t face;
+        float t, u, v;
+    };
+
+    struct LeafIntersect {
+        const Mesh *self;
+        const Ray *r;
+        float tmin;
+        TriangleHit *hit;
+        bool operator()(uint32_t first, uint32_t count, float &tmax);
+    };
+
+    struct LeafPacket {
+        const Mesh *self;
+        RayPacket *packet;
+        TriangleHit *hits;
+        bool operator()(uint32_t first, uint32_t count, int lane);
+    };
+
+    struct LeafOccluded {
+        const Mesh *self;
+        const Ray *r;
+        float tmin;
+        bool operator()(uint32_t first, uint32_t count, float tmax);
+    };
+
+    // sums the light density of every triangle hit in the leaf
+    struct LeafPdf {
+        const Mesh *self;
+        const Ray *r;
+        float tmin;
+        double pdf;
+        bool operator()(uint32_t first, uint32_t count, float tmax);
+    };
+
+    // Points the views at the vectors above.
+    void bindBuffers();
+
+    // Sorts the triangles into BVH order, builds the tree and the SoA block.
+    void buildBVH(BVHMode mode);
+    void buildSoA();
+    // Sums the triangle areas, fills light_table if the material emits.
+    void buildLightTable();
+
+    // Maps a mesh file, see mesh_file.cpp.
+    bool loadBinary(const char *filename, BVHMode mode);
+
+    // Nearest hit in the leaf [first, first+count) with tmin < t < tmax.
+    bool hitLeaf(uint32_t first, uint32_t count, const Ray &r, float tmin, float tmax, TriangleHit &th) const;
+
+    // Moller-Trumbore against triangle f, no range check on t.
+    bool hitTriangle(uint32_t f, const Vector3f &o, const Vector3f &dir, float &t, float &u, float &v) const;
 
-    // Normal can be used for light estimation
-    void computeNormal();
+    // Fills h from the closest hit, interpolating vertex normals and texture
+    // coordinates with the hit's barycentrics if present.
+    void setHit(const Ray &r, Hit &h, const TriangleHit &th) const;
 };
 
 #endif
@@ -0,0 +1,59 @@
+#ifndef MESH_FILE_H
+#define MESH_FILE_H
+
+#include <cstdint>
+
+// Binary mesh container, written once from an OBJ by the MESH_CONVERT tool
+// and then memory-mapped by Mesh without any parsing or copying:
+//
+//   MeshFileHeader
+//   sections, each starting at a multiple of MESH_FILE_ALIGNMENT:
+//     positions         Vector3f  (3 x float)
+//     normals           Vector3f
+//     texcoords         Vector2f  (2 x float)
+//     faces             Mesh::TriangleIndex (3 x int32), in BVH leaf order
+//     normal faces      Mesh::TriangleIndex, -1 = no normals for the face
+//     texcoord faces    Mesh::TriangleIndex, -1 = no texcoords for the face
+//     face materials    int32, index into the material names, -1 = none
+//     material names    '\0'-terminated strings back to back
+//     BVH nodes         FlatBVH nodes of layout bvh_mode
+//     triangle SoA      TriangleSoA block (floats)
+//
+// Every section but positions and faces is optional (count 0). All values
+// are little endian, as on every platform this is built for. A mapping of the
+// file is shared read-only, so renderers running on one machine share one
+// copy of the mesh in the page cache.
+
+#define MESH_FILE_EXTENSION ".tmesh"
+#define MESH_FILE_MAGIC "TRTMESH"
+#define MESH_FILE_VERSION 1
+#define MESH_FILE_ALIGNMENT 64
+
+enum MeshFileSection {
+    MESH_SECTION_POSITIONS,
+    MESH_SECTION_NORMALS,
+    MESH_SECTION_TEXCOORDS,
+    MESH_SECTION_FACES,
+    MESH_SECTION_NORMAL_FACES,
+    MESH_SECTION_TEXCOORD_FACES,
+    MESH_SECTION_FACE_MATERIALS,
+    MESH_SECTION_MATERIAL_NAMES,
+    MESH_SECTION_BVH_NODES,
+    MESH_SECTION_TRIANGLE_SOA,
+    MESH_SECTION_COUNT
+};
+
+struct MeshFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;       // sizeof(MeshFileHeader)
+    int32_t bvh_mode;           // BVHMode of the BVH nodes
+    int32_t bvh_leaf_size;
+    float bounds[6];            // root box of the tree, min then max
+    // elements; bytes for the material names, triangles for the SoA block
+    uint64_t count[MESH_SECTION_COUNT];
+    // from the start of the file, 0 for absent sections
+    uint64_t offset[MESH_SECTION_COUNT];
+};
+
+#endif // MESH_FILE_H
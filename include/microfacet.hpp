@@ -0,0 +1,171 @@
+#ifndef MICROFACET_H
+#define MICROFACET_H
+
+#include <vecmath.h>
+#include <algorithm>
+#include <cmath>
+
+#include "utils.hpp"
+
+// GGX (Trowbridge-Reitz) microfacets for isotropic roughness alpha. All
+// directions are in the shading frame, z along the normal, and point away
+// from the surface; wo is the direction back along the incoming ray and must
+// have wo.z > 0. G is the height-correlated Smith masking-shadowing. Normals
+// are sampled from those visible from wo (Heitz 2018), so no sample is
+// wasted on facets facing away, and the weight f cos / pdf of a sample is
+// just the Fresnel term times G / G1.
+//
+// The *Eval functions return f times |cos| of wi, the factor the path
+// throughput takes. Like the smooth Dielectric, refraction does not scale
+// radiance by the squared ratio of the indices, so rough glass converges to
+// the smooth one as alpha goes to 0.
+namespace GGX {
+
+inline double D(const Vector3f &m, double alpha) {
+    double cos2 = m.z() * m.z();
+    if (m.z() <= 0) return 0;
+    double a2 = alpha * alpha;
+    double k = cos2 * (a2 - 1) + 1;
+    return a2 / (M_PI * k * k);
+}
+
+inline double lambda(const Vector3f &w, double alpha) {
+    double cos2 = w.z() * w.z();
+    if (cos2 == 0) return INFINITY;
+    double tan2 = std::max(0.0, 1 - cos2) / cos2;
+    return (sqrt(1 + alpha * alpha * tan2) - 1) / 2;
+}
+
+inline double G1(const Vector3f &w, double alpha) {
+    return 1 / (1 + lambda(w, alpha));
+}
+
+inline double G(const Vector3f &wo, const Vector3f &wi, double alpha) {
+    return 1 / (1 + lambda(wo, alpha) + lambda(wi, alpha));
+}
+
+// A normal m from D_wo(m) = G1(wo) max(0, wo.m) D(m) / wo.z, wo.z > 0.
+inline Vector3f sampleVisible(const Vector3f &wo, double alpha, double u1, double u2) {
+    // stretch to the hemisphere configuration
+    Vector3f vh = Vector3f(alpha * wo.x(), alpha * wo.y(), wo.z()).normalized();
+    double lensq = vh.x() * vh.x() + vh.y() * vh.y();
+    Vector3f t1 = lensq > 0 ? Vector3f(-vh.y(), vh.x(), 0) / sqrt(lensq) : Vector3f(1, 0, 0);
+    Vector3f t2 = Vector3f::cross(vh, t1);
+    // a point on the projected hemisphere, half disk warped towards vh
+    double r = sqrt(u1), phi = 2 * M_PI * u2;
+    double p1 = r * cos(phi), p2 = r * sin(phi);
+    double s = 0.5 * (1 + vh.z());
+    p2 = (1 - s) * sqrt(std::max(0.0, 1 - p1 * p1)) + s * p2;
+    Vector3f nh = p1 * t1 + p2 * t2 + sqrt(std::max(0.0, 1 - p1 * p1 - p2 * p2)) * vh;
+    // unstretch
+    return Vector3f(alpha * nh.x(), alpha * nh.y(), std::max(0.0f, nh.z())).normalized();
+}
+
+// density of sampleVisible returning m
+inline double visiblePdf(const Vector3f &wo, const Vector3f &m, double alpha) {
+    double wom = Vector3f::dot(wo, m);
+    if (wom <= 0 || wo.z() <= 0) return 0;
+    return G1(wo, alpha) * wom * D(m, alpha) / wo.z();
+}
+
+// Schlick's reflectance at a facet seen under cos_i, for the ratio eta of
+// the index on the far side to the index on the side of wo. 1 under total
+// internal reflection.
+inline double dielectricReflectance(double cos_i, double eta) {
+    if ((1 - cos_i * cos_i) > eta * eta) return 1;
+    double r0 = (1 - eta) / (1 + eta);
+    r0 = r0 * r0;
+    return r0 + (1 - r0) * pow(1 - cos_i, 5);
+}
+
+// Generalized half vector of a refraction from wo into wi, on wo's side.
+inline Vector3f refractionHalf(const Vector3f &wo, const Vector3f &wi, double eta) {
+    Vector3f m = -(wo + eta * wi).normalized();
+    return m.z() < 0 ? -m : m;
+}
+
+// |d m / d wi| of refraction through m.
+inline double refractionJacobian(const Vector3f &wo, const Vector3f &wi, const Vector3f &m, double eta) {
+    double denom = Vector3f::dot(wo, m) + eta * Vector3f::dot(wi, m);
+    return eta * eta * fabs(Vector3f::dot(wi, m)) / (denom * denom);
+}
+
+inline Vector3f reflectOff(const Vector3f &wo, const Vector3f &m) {
+    return 2 * Vector3f::dot(wo, m) * m - wo;
+}
+
+// wo refracted through m into the medium of relative index eta; wo.m > 0
+// and no total internal reflection
+inline Vector3f refractThrough(const Vector3f &wo, const Vector3f &m, double eta) {
+    double c = Vector3f::dot(wo, m);
+    double cos_t = sqrt(std::max(0.0, 1 - (1 - c * c) / (eta * eta)));
+    return (c / eta - cos_t) * m - wo / eta;
+}
+
+inline Vector3f conductorEval(const Vector3f &wo, const Vector3f &wi, double alpha, const Vector3f &f0) {
+    if (wo.z() <= 0 || wi.z() <= 0) return Vector3f::ZERO;
+    Vector3f m = (wo + wi).normalized();
+    double c = std::max(0.0f, Vector3f::dot(wo, m));
+    Vector3f F = f0 + (Vector3f(1, 1, 1) - f0) * pow(1 - c, 5);
+    return F * (D(m, alpha) * G(wo, wi, alpha) / (4 * wo.z()));
+}
+
+inline double conductorPdf(const Vector3f &wo, const Vector3f &wi, double alpha) {
+    if (wo.z() <= 0) return 0;
+    Vector3f m = (wo + wi).normalized();
+    double c = Vector3f::dot(wo, m);
+    return c > 0 ? visiblePdf(wo, m, alpha) / (4 * c) : 0;
+}
+
+// The samplers return the zero vector when the facet sends the direction to
+// the wrong side of the surface, where the pdfs do not count it.
+inline Vector3f sampleConductor(const Vector3f &wo, double alpha) {
+    Vector3f wi = reflectOff(wo, sampleVisible(wo, alpha, random_double(), random_double()));
+    return wi.z() > 0 ? wi : Vector3f::ZERO;
+}
+
+// eta: index of refraction below the surface over the one above it
+inline double dielectricEval(const Vector3f &wo, const Vector3f &wi, double alpha, double eta) {
+    if (wo.z() <= 0 || wi.z() == 0) return 0;
+    if (wi.z() > 0) {
+        Vector3f m = (wo + wi).normalized();
+        double c = Vector3f::dot(wo, m);
+        if (c <= 0) return 0;
+        return dielectricReflectance(c, eta) * D(m, alpha) * G(wo, wi, alpha) / (4 * wo.z());
+    }
+    Vector3f m = refractionHalf(wo, wi, eta);
+    double c = Vector3f::dot(wo, m);
+    if (c <= 0 || Vector3f::dot(wi, m) >= 0) return 0;
+    return (1 - dielectricReflectance(c, eta)) * D(m, alpha) * G(wo, wi, alpha) * c / wo.z() *
+           refractionJacobian(wo, wi, m, eta);
+}
+
+inline double dielectricPdf(const Vector3f &wo, const Vector3f &wi, double alpha, double eta) {
+    if (wo.z() <= 0 || wi.z() == 0) return 0;
+    if (wi.z() > 0) {
+        Vector3f m = (wo + wi).normalized();
+        double c = Vector3f::dot(wo, m);
+        if (c <= 0) return 0;
+        return dielectricReflectance(c, eta) * visiblePdf(wo, m, alpha) / (4 * c);
+    }
+    Vector3f m = refractionHalf(wo, wi, eta);
+    double c = Vector3f::dot(wo, m);
+    if (c <= 0 || Vector3f::dot(wi, m) >= 0) return 0;
+    return (1 - dielectricReflectance(c, eta)) * visiblePdf(wo, m, alpha) * refractionJacobian(wo, wi, m, eta);
+}
+
+// reflects off or refracts through a visible normal, chosen by its reflectance
+inline Vector3f sampleDielectric(const Vector3f &wo, double alpha, double eta) {
+    Vector3f m = sampleVisible(wo, alpha, random_double(), random_double());
+    double c = Vector3f::dot(wo, m);
+    if (random_double() < dielectricReflectance(c, eta)) {
+        Vector3f wi = reflectOff(wo, m);
+        return wi.z() > 0 ? wi : Vector3f::ZERO;
+    }
+    Vector3f wi = refractThrough(wo, m, eta);
+    return wi.z() < 0 ? wi : Vector3f::ZERO;
+}
+
+}  // namespace GGX
+
+#endif // MICROFACET_H
@@ -0,0 +1,51 @@
+#ifndef MIP_FILE_H
+#define MIP_FILE_H
+
+#include <cstdint>
+
+// Tiled mip pyramid of an image, built by ImageTexture when it first loads
+// the image and written next to it as <image>MIP_FILE_EXTENSION, or into the
+// TextureCache mip directory (the system temporary directory if neither can
+// be written), then memory-mapped on later loads without decoding anything:
+//
+//   MipFileHeader
+//   levels, each starting at a multiple of MIP_FILE_ALIGNMENT:
+//     tiles of TEXTURE_TILE_SIZE x TEXTURE_TILE_SIZE RGB texels, row-major
+//     by tile and by texel within a tile, top row of the image first;
+//     tiles on the right and bottom edges repeat the last column / row
+//
+// Level 0 is the image, every further level halves both sides (at least 1
+// texel) with a box filter, down to 1 x 1. RGB8 texels keep the gamma 2
+// encoding of 8-bit images, RGB32F texels are linear. The source file's size
+// and modification time are recorded, a mip file that does not match its
+// source is rebuilt.
+
+#define MIP_FILE_EXTENSION ".tmip"
+#define MIP_FILE_MAGIC "TRTMIP"
+#define MIP_FILE_VERSION 1
+#define MIP_FILE_ALIGNMENT 64
+#define MIP_FILE_MAX_LEVELS 32
+// largest side of level 0, so that the tiles of a level can be numbered in
+// the 35 bits ImageTexture gives them
+#define MIP_FILE_MAX_SIZE (1u << 22)
+#define TEXTURE_TILE_SIZE 32
+
+enum MipFileFormat { MIP_FORMAT_RGB8, MIP_FORMAT_RGB32F };
+
+struct MipFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;       // sizeof(MipFileHeader)
+    uint32_t format;            // MipFileFormat
+    uint32_t tile_size;         // TEXTURE_TILE_SIZE
+    uint32_t levels;
+    uint32_t reserved;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint32_t width[MIP_FILE_MAX_LEVELS];
+    uint32_t height[MIP_FILE_MAX_LEVELS];
+    // from the start of the file
+    uint64_t offset[MIP_FILE_MAX_LEVELS];
+};
+
+#endif // MIP_FILE_H
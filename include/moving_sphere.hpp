@@ -16,29 +16,22 @@ public:
     {};
 
     bool intersect(const Ray& r, Hit& h, float tmin, float tmax) const override {
-        Vector3f oc = r.getOrigin() - center(r.getTime());
-        auto a = r.getDirection().squaredLength();
-        auto half_b = Vector3f::dot(oc, r.getDirection());
-        auto c = oc.squaredLength() - radius*radius;
-
-        auto discriminant = half_b*half_b - a*c;
-        if (discriminant < 0) return false;
-        auto sqrtd = sqrt(discriminant);
-
-        // Find the nearest root that lies in the acceptable range.
-        auto root = (-half_b - sqrtd) / a;
-        if (root < tmin || tmax < root) {
-            root = (-half_b + sqrtd) / a;
-            if (root < tmin || tmax < root)
-                return false;
-        }
+        double root;
+        if (!hitRoot(r, tmin, tmax, root))
+            return false;
         Vector3f intersec_point=r.pointAtParameter(root);
         Vector3f n=(intersec_point-center(r.getTime()))/radius;
-        h.set(root, material, n, r);
+        h.set(root, material.get(), n, r);
         get_sphere_uv(n, h.u, h.v);
+        h.uv_rate = 1 / (M_PI * radius);
         return true;
     }
 
+    bool occluded(const Ray& r, float tmin = 0.0, float tmax = infinity) const override {
+        double root;
+        return hitRoot(r, tmin, tmax, root);
+    }
+
     Vector3f center(float time) const {
         return center0 + ((time - time0) / (time1 - time0))*(center1 - center0);
     }
@@ -58,6 +51,27 @@ protected:
     Vector3f center0, center1;
     double time0, time1;
     double radius;
+
+    // Find the nearest root that lies in the acceptable range.
+    bool hitRoot(const Ray& r, float tmin, float tmax, double& root) const {
+        Vector3f oc = r.getOrigin() - center(r.getTime());
+        auto a = r.getDirection().squaredLength();
+        auto half_b = Vector3f::dot(oc, r.getDirection());
+        auto c = oc.squaredLength() - radius*radius;
+
+        auto discriminant = half_b*half_b - a*c;
+        if (discriminant < 0) return false;
+        auto sqrtd = sqrt(discriminant);
+
+        root = (-half_b - sqrtd) / a;
+        if (root < tmin || tmax < root) {
+            root = (-half_b + sqrtd) / a;
+            if (root < tmin || tmax < root)
+                return false;
+        }
+        return true;
+    }
+
     static void get_sphere_uv(const Vector3f& p, float& u, float& v)  {
         auto phi = atan2(p.z(), p.x());
         auto theta = asin(p.y());
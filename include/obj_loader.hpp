@@ -0,0 +1,15 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+class Mesh;
+
+// Reads the geometry of a Wavefront OBJ file into mesh.v / n / vt and the
+// index buffers t / tn / tt (see mesh.hpp). The file is memory-mapped, cut
+// into chunks at line boundaries and the chunks are parsed in parallel.
+// Polygons are fan-triangulated, negative (relative) indices are resolved.
+// usemtl names go to mesh.material_names and mesh.face_material; groups,
+// smoothing groups and material libraries are ignored.
+// Returns false if the file cannot be read or references a missing vertex.
+bool loadOBJ(const char *filename, Mesh &mesh);
+
+#endif // OBJ_LOADER_H
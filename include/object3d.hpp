@@ -2,6 +2,7 @@
 #define OBJECT3D_H
 
 #include "ray.hpp"
+#include "ray_packet.hpp"
 #include "hit.hpp"
 #include "material.hpp"
 #include "aabb.hpp"
@@ -23,6 +24,37 @@ public:
 
     virtual bool bounding_box(double time0, double time1, AABB& output_box) const = 0;
 
+    // Any-hit query: is there an intersection in [tmin, tmax]? Returns at the
+    // first one found and computes no shading data. Override it wherever a
+    // cheaper test than intersect() exists.
+    virtual bool occluded(const Ray &r, float tmin = 0.0, float tmax = infinity) const {
+        Hit h;
+        return intersect(r, h, tmin, tmax);
+    }
+
+    // Fraction of the light along r in [tmin, tmax] that gets through this
+    // object: 0 or 1 for surfaces, an unbiased estimate for participating
+    // media. Shadow rays multiply it into the light they connect to.
+    virtual double transmittance(const Ray &r, float tmin = 0.0, float tmax = infinity) const {
+        return occluded(r, tmin, tmax) ? 0 : 1;
+    }
+
+    // Closest-hit query for the lanes of `active`, packet.tmax is shrunk for
+    // every lane that hits. Returns the lanes that hit. The default traces
+    // the rays one at a time; acceleration structures override it to share
+    // node fetches between rays.
+    virtual unsigned intersectPacket(RayPacket &packet, Hit *hits, unsigned active) const {
+        unsigned hit = 0;
+        for (int i = 0; i < packet.size; i++) {
+            if (!(active >> i & 1u)) continue;
+            if (intersect(packet.rays[i], hits[i], packet.tmin, packet.tmax[i])) {
+                packet.tmax[i] = hits[i].getT();
+                hit |= 1u << i;
+            }
+        }
+        return hit;
+    }
+
     virtual double pdf_value(const Vector3f& o, const Vector3f& v) const {
         return 0.0;
     }
@@ -30,6 +62,15 @@ public:
     virtual Vector3f random(const Vector3f& o) const {
         return Vector3f(1,0,0);
     }
+
+    // Surface area, used to estimate the power of lights; 0 where unknown.
+    virtual double area() const {
+        return 0.0;
+    }
+
+    const Material *getMaterial() const {
+        return material.get();
+    }
 protected:
 
     shared_ptr<Material> material;
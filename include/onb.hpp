@@ -23,6 +23,11 @@ class ONB
             return a.x()*u() + a.y()*v() + a.z()*w();
         }
 
+        // a in this basis, the inverse of local()
+        Vector3f toLocal(const Vector3f& a) const {
+            return Vector3f(Vector3f::dot(a, u()), Vector3f::dot(a, v()), Vector3f::dot(a, w()));
+        }
+
         void build_from_w(const Vector3f& n) {
             axis[2] = n.normalized();
             Vector3f a = (fabs(w().x()) > 0.9) ? Vector3f(0,1,0) : Vector3f(1,0,0);
@@ -3,33 +3,29 @@
 
 #include <vecmath.h>
 #include <cmath>
+#include <new>
 
 #include "ONB.hpp"
 #include "utils.hpp"
-
-class Group;
+#include "microfacet.hpp"
 
 class Object3D;
 
-class PDF  {
-    public:
-        virtual ~PDF() {}
-
-        virtual double value(const Vector3f& direction) const = 0;
-        virtual Vector3f generate() const = 0;
-};
-
+// The PDFs are small value types without virtual functions: a PDF is one of
+// them selected by a tag and lives in ScatterRecord or on the stack of the
+// tracer, so sampling a bounce allocates nothing.
 
-class CosinePDF : public PDF {
+class CosinePDF {
     public:
+        CosinePDF() {}
         CosinePDF(const Vector3f& w) { uvw.build_from_w(w); }
 
-        virtual double value(const Vector3f& direction) const override {
+        double value(const Vector3f& direction) const {
             auto cosine = Vector3f::dot(direction.normalized(), uvw.w());
             return (cosine <= 0) ? 0 : cosine/M_PI;
         }
 
-        virtual Vector3f generate() const override {
+        Vector3f generate() const {
             return uvw.local(random_cosine_direction());
         }
 
@@ -37,53 +33,137 @@ class CosinePDF : public PDF {
         ONB uvw;
 };
 
-class SpherePDF : public PDF {
+class SpherePDF {
   public:
     SpherePDF() { }
 
-    double value(const Vector3f& direction) const override {
+    double value(const Vector3f& direction) const {
         return 1/ (4 * M_PI);
     }
 
-    Vector3f generate() const override {
+    Vector3f generate() const {
         return random_unit_vector();
     }
 };
 
-class HittablePDF : public PDF {
+// Directions of a rough conductor (eta 0) or dielectric (eta the relative
+// index of refraction across the surface) hit along -wo.
+class GGXPDF {
     public:
-        HittablePDF(const Group* l, const Vector3f& origin) : list(l), o(origin) {}
+        GGXPDF() {}
+        GGXPDF(const Vector3f& n, const Vector3f& wo_world, double a, double e = 0) : alpha(a), eta(e) {
+            uvw.build_from_w(n);
+            wo = uvw.toLocal(wo_world.normalized());
+        }
 
-        virtual double value(const Vector3f& direction) const override ;
+        // 0 for the zero direction, a sample lost to the wrong side
+        double value(const Vector3f& direction) const {
+            if (direction.squaredLength() == 0) return 0;
+            Vector3f wi = uvw.toLocal(direction.normalized());
+            return eta > 0 ? GGX::dielectricPdf(wo, wi, alpha, eta) : GGX::conductorPdf(wo, wi, alpha);
+        }
 
-        virtual Vector3f generate() const override ;
+        Vector3f generate() const {
+            if (wo.z() <= 0) return uvw.w();
+            return uvw.local(eta > 0 ? GGX::sampleDielectric(wo, alpha, eta) : GGX::sampleConductor(wo, alpha));
+        }
 
     public:
-        Vector3f o;
-        const Group* list;
+        ONB uvw;
+        Vector3f wo;
+        double alpha, eta;
 };
 
+// Henyey-Greenstein phase function for the cosine between the direction of
+// travel and the scattered direction; g > 0 scatters forward.
+inline double henyey_greenstein(double cos_theta, double g) {
+    double denom = 1 + g * g - 2 * g * cos_theta;
+    return (1 - g * g) / (4 * M_PI * denom * sqrt(denom));
+}
+
+class HenyeyGreensteinPDF {
+    public:
+        HenyeyGreensteinPDF() {}
+        HenyeyGreensteinPDF(const Vector3f& forward, double _g) : g(_g) { uvw.build_from_w(forward); }
+
+        double value(const Vector3f& direction) const {
+            return henyey_greenstein(Vector3f::dot(direction.normalized(), uvw.w()), g);
+        }
+
+        Vector3f generate() const {
+            double xi = random_double(), cos_theta;
+            if (fabs(g) < 1e-3) {
+                cos_theta = 1 - 2 * xi;
+            } else {
+                double s = (1 - g * g) / (1 - g + 2 * g * xi);
+                cos_theta = (1 + g * g - s * s) / (2 * g);
+            }
+            double sin_theta = sqrt(fmax(0.0, 1 - cos_theta * cos_theta));
+            double phi = 2 * M_PI * random_double();
+            return uvw.local(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta);
+        }
 
-class MixturePDF : public PDF {
     public:
-        MixturePDF(shared_ptr<PDF> p0, shared_ptr<PDF> p1) {
-            p[0] = p0;
-            p[1] = p1;
+        ONB uvw;
+        double g;
+};
+
+class PDF {
+    public:
+        enum Kind { NONE, COSINE, SPHERE, MICROFACET, PHASE };
+
+        PDF() : kind(NONE) {}
+        PDF(const CosinePDF& p) : kind(COSINE), cosine(p) {}
+        PDF(const SpherePDF& p) : kind(SPHERE) {}
+        PDF(const GGXPDF& p) : kind(MICROFACET), ggx(p) {}
+        PDF(const HenyeyGreensteinPDF& p) : kind(PHASE), phase(p) {}
+
+        // only the alternative named by kind is copied
+        PDF(const PDF& p) { assign(p); }
+        PDF& operator=(const PDF& p) {
+            assign(p);
+            return *this;
         }
 
-        virtual double value(const Vector3f& direction) const override {
-            return 0.5 * p[0]->value(direction) + 0.5 *p[1]->value(direction);
+        double value(const Vector3f& direction) const {
+            switch (kind) {
+                case COSINE: return cosine.value(direction);
+                case SPHERE: return SpherePDF().value(direction);
+                case MICROFACET: return ggx.value(direction);
+                case PHASE: return phase.value(direction);
+                default: return 0;
+            }
         }
 
-        virtual Vector3f generate() const override {
-            if (random_double() < 0.5)
-                return p[0]->generate();
-            else
-                return p[1]->generate();
+        Vector3f generate() const {
+            switch (kind) {
+                case COSINE: return cosine.generate();
+                case SPHERE: return SpherePDF().generate();
+                case MICROFACET: return ggx.generate();
+                case PHASE: return phase.generate();
+                default: return Vector3f::ZERO;
+            }
         }
 
     public:
-        shared_ptr<PDF> p[2];
+        Kind kind;
+        // the alternatives hold plain vectors and numbers, nothing to destroy
+        union {
+            CosinePDF cosine;
+            GGXPDF ggx;
+            HenyeyGreensteinPDF phase;
+        };
+
+    private:
+        void assign(const PDF& p) {
+            kind = p.kind;
+            switch (kind) {
+                case COSINE: new (&cosine) CosinePDF(p.cosine); break;
+                case MICROFACET: new (&ggx) GGXPDF(p.ggx); break;
+                case PHASE: new (&phase) HenyeyGreensteinPDF(p.phase); break;
+                default: break;
+            }
+        }
 };
 
-#endif // PDF_H
\ No newline at end of file
+#endif // PDF_H
@@ -25,12 +25,17 @@ public:
     bool intersect(const Ray &r, Hit &h, float tmin = 0.0, float tmax = infinity) const override {
         float t=(d-Vector3f::dot(normal,r.getOrigin()))/(Vector3f::dot(normal,r.getDirection()));
         if(t>=tmin&&t<tmax){
-            h.set(t,material,normal,r);
+            h.set(t,material.get(),normal,r);
             return true;
         }
         return false;
     }
 
+    bool occluded(const Ray &r, float tmin = 0.0, float tmax = infinity) const override {
+        float t=(d-Vector3f::dot(normal,r.getOrigin()))/(Vector3f::dot(normal,r.getDirection()));
+        return t>=tmin&&t<tmax;
+    }
+
     bool bounding_box(double time0, double time1, AABB& output_box) const override {
         return false;
     }
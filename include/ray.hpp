@@ -17,11 +17,6 @@ public:
         time = tm;
     }
 
-    Ray(const Ray &r) {
-        origin = r.origin;
-        direction = r.direction;
-    }
-
     const Vector3f &getOrigin() const {
         return origin;
     }
@@ -0,0 +1,82 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include <vecmath.h>
+
+#include "ray.hpp"
+#include "utils.hpp"
+
+// Number of rays traced together, 4, 8 or 16.
+#define RAY_PACKET_SIZE 8
+
+// Coherent rays (neighbouring camera rays) traced as a group. The rays are
+// kept in structure-of-arrays form so that one box can be tested against all
+// of them in a single vectorisable loop. Lanes are selected by bit masks.
+struct RayPacket {
+    Ray rays[RAY_PACKET_SIZE];
+    float ox[RAY_PACKET_SIZE], oy[RAY_PACKET_SIZE], oz[RAY_PACKET_SIZE];
+    float ix[RAY_PACKET_SIZE], iy[RAY_PACKET_SIZE], iz[RAY_PACKET_SIZE];
+    float tmax[RAY_PACKET_SIZE];
+    float tmin;
+    int size;
+
+    // Fills the SoA arrays from rays[0, n). Unused lanes never hit anything.
+    void setup(int n, float t_min = 0.0, float t_max = infinity) {
+        size = n;
+        tmin = t_min;
+        for (int i = 0; i < RAY_PACKET_SIZE; i++) {
+            if (i < n) {
+                const Vector3f &o = rays[i].getOrigin(), &d = rays[i].getDirection();
+                ox[i] = o.x(); oy[i] = o.y(); oz[i] = o.z();
+                ix[i] = 1.0f / d.x(); iy[i] = 1.0f / d.y(); iz[i] = 1.0f / d.z();
+                tmax[i] = t_max;
+            } else {
+                ox[i] = oy[i] = oz[i] = 0;
+                ix[i] = iy[i] = iz[i] = 1;
+                tmax[i] = -infinity;
+            }
+        }
+    }
+
+    unsigned activeMask() const {
+        return size >= 32 ? ~0u : (1u << size) - 1;
+    }
+
+    // Lanes of `active` whose ray overlaps the box within [tmin, tmax[i]].
+    unsigned hitBox(const float bmin[3], const float bmax[3], unsigned active) const {
+        int hit[RAY_PACKET_SIZE];
+        #pragma omp simd
+        for (int i = 0; i < RAY_PACKET_SIZE; i++) {
+            float t0x = (bmin[0] - ox[i]) * ix[i], t1x = (bmax[0] - ox[i]) * ix[i];
+            float t0y = (bmin[1] - oy[i]) * iy[i], t1y = (bmax[1] - oy[i]) * iy[i];
+            float t0z = (bmin[2] - oz[i]) * iz[i], t1z = (bmax[2] - oz[i]) * iz[i];
+            float nx = t0x < t1x ? t0x : t1x, fx = t0x < t1x ? t1x : t0x;
+            float ny = t0y < t1y ? t0y : t1y, fy = t0y < t1y ? t1y : t0y;
+            float nz = t0z < t1z ? t0z : t1z, fz = t0z < t1z ? t1z : t0z;
+            float tn = tmin, tf = tmax[i];
+            tn = nx > tn ? nx : tn; tn = ny > tn ? ny : tn; tn = nz > tn ? nz : tn;
+            tf = fx < tf ? fx : tf; tf = fy < tf ? fy : tf; tf = fz < tf ? fz : tf;
+            hit[i] = tn <= tf;
+        }
+        unsigned mask = 0;
+        for (int i = 0; i < RAY_PACKET_SIZE; i++) mask |= (unsigned)hit[i] << i;
+        return mask & active;
+    }
+};
+
+inline int packetLaneCount(unsigned mask) {
+    int count = 0;
+    for (; mask; mask &= mask - 1) count++;
+    return count;
+}
+
+inline int packetFirstLane(unsigned mask) {
+    int lane = 0;
+    while (!(mask & 1u)) {
+        mask >>= 1;
+        lane++;
+    }
+    return lane;
+}
+
+#endif // RAY_PACKET_H
@@ -14,23 +14,23 @@ public:
         dir_wid = d_wid.normalized();
         halfL = len/2;
         halfW = wid/2;
-        normal = Vector3f::cross(d_len, d_wid);
+        normal = Vector3f::cross(dir_len, dir_wid).normalized();
         d = Vector3f::dot(normal, center);
     }
     bool intersect(const Ray &r, Hit &h, float tmin = 0.0, float tmax = infinity) const override {
-        float t=(d-Vector3f::dot(normal,r.getOrigin()))/(Vector3f::dot(normal,r.getDirection()));
-        if(t>=tmin&&t<tmax){
-            Vector3f point = r.pointAtParameter(t);
-            float x = Vector3f::dot(point-center,dir_len);
-            float y = Vector3f::dot(point-center,dir_wid);
-            if(abs(x) < halfL && abs(y) < halfW){
-                h.u = x/(halfL*2) + 0.5;
-                h.v = y/(halfW*2) + 0.5;
-                h.set(t,material,normal,r);
-                return true;
-            }
-        }
-        return false;
+        float t, x, y;
+        if (!hitPlane(r, tmin, tmax, t, x, y))
+            return false;
+        h.u = x/(halfL*2) + 0.5;
+        h.v = y/(halfW*2) + 0.5;
+        h.set(t,material.get(),normal,r);
+        h.uv_rate = 1 / (2 * sqrt(halfL * halfW));
+        return true;
+    }
+
+    bool occluded(const Ray &r, float tmin = 0.0, float tmax = infinity) const override {
+        float t, x, y;
+        return hitPlane(r, tmin, tmax, t, x, y);
     }
 
     bool bounding_box(double time0, double time1, AABB& output_box) const override {
@@ -57,16 +57,21 @@ public:
         return true;
     }
 
+    // distance^2 / (cosine * area) at the point v points to, straight from
+    // the plane equation
     double pdf_value(const Vector3f& origin, const Vector3f& v) const override {
-        Hit rec;
-        if (!this->intersect(Ray(origin, v), rec, 0.001, infinity))
-            return 0;
-
-        float area = halfL * halfW * 4;
-        float distance_squared = rec.getT() * rec.getT() * v.squaredLength();
-        float cosine = fabs(Vector3f::dot(v, rec.normal) / v.length());
+        float nv = Vector3f::dot(normal, v);
+        if (nv == 0) return 0;
+        float t = (d - Vector3f::dot(normal, origin)) / nv;
+        if (t < 0.001) return 0;
+        Vector3f q = origin + t * v - center;
+        if (fabs(Vector3f::dot(q, dir_len)) >= halfL || fabs(Vector3f::dot(q, dir_wid)) >= halfW) return 0;
+        float vv = v.squaredLength();
+        return t * t * vv * sqrt(vv) / (fabs(nv) * halfL * halfW * 4);
+    }
 
-        return distance_squared / (cosine * area);
+    double area() const override {
+        return halfL * halfW * 4;
     }
 
     Vector3f random(const Vector3f& origin) const override {
@@ -82,6 +87,18 @@ protected:
     Vector3f dir_len,dir_wid;
     float halfL,halfW;
     float d;
+
+    // Ray parameter and in-plane coordinates of the hit, if it lies inside.
+    bool hitPlane(const Ray &r, float tmin, float tmax, float &t, float &x, float &y) const {
+        t=(d-Vector3f::dot(normal,r.getOrigin()))/(Vector3f::dot(normal,r.getDirection()));
+        if(t>=tmin&&t<tmax){
+            Vector3f point = r.pointAtParameter(t);
+            x = Vector3f::dot(point-center,dir_len);
+            y = Vector3f::dot(point-center,dir_wid);
+            return fabs(x) < halfL && fabs(y) < halfW;
+        }
+        return false;
+    }
 };
 
 #endif // RECTANGLE_H
\ No newline at end of file
@@ -2,19 +2,29 @@
 #define RAY_TRACER_H
 
 #include <vector>
+#include <algorithm>
 #include <vecmath.h>
 #include <iostream>
 #include "group.hpp"
 #include "light.hpp"
 #include "ray.hpp"
+#include "ray_packet.hpp"
 #include "hit.hpp"
 #include "scene_parser.hpp"
 #include "scene_generator.hpp"
 #include "pdf.hpp"
+#include "light_sampler.hpp"
+#include "environment.hpp"
 #include "image.hpp"
 
 #define MIN_WEIGHT 1e-3f
 #define TRACE_DEPTH 20
+// shadow rays stop this fraction short of the light they were aimed at
+#define SHADOW_EPS 1e-4f
+// footprints on surfaces seen at grazing angles are widened as if seen at this cosine
+#define PATH_CONE_MIN_COS 0.2f
+// spread angle of the ray cone after a non-specular bounce
+#define PATH_CONE_DIFFUSE_SPREAD 0.1f
 
 class RayTracer {
 public:
@@ -25,48 +35,81 @@ public:
         image_height = camera->getHeight();
         image_width = camera->getWidth();
         backgroundColor = parser.getBackgroundColor();
+        environment = parser.getEnvironment();
         max_depth = parser.getMaxDepth();
         init_weight = parser.getInitWeight();
         sample_per_pixel = parser.getSamplePerPixel();
         renderedImg = new Image(image_width,image_height);
+        light_sampler = LightSampler(lights);
+        env_pick = environment ? (light_sampler.size() > 0 ? 0.5 : 1) : 0;
     }
     RayTracer(SceneGenerator& generator, char* out) : outputfile(out) {
         baseGroup = generator.getGroup();
         lights = generator.getLight();
         camera = generator.getCamera();
         backgroundColor = generator.getBackGround();
+        environment = generator.getEnvironment();
         image_height = generator.getImageHeight();
         image_width = generator.getImageWidth();
         max_depth = generator.getMaxDepth();
         init_weight = generator.getInitWeight();
         sample_per_pixel = generator.getSample();
         renderedImg = new Image(image_width,image_height);
+        light_sampler = LightSampler(lights);
+        env_pick = environment ? (light_sampler.size() > 0 ? 0.5 : 1) : 0;
     }
     ~RayTracer()=default;
 
+    // Pixels are processed in packets of RAY_PACKET_SIZE neighbouring pixels
+    // of one column. Their camera rays are traced through the scene together
+    // and every ray continues on its own from its first hit.
     void render() {
         for (int x = 0; x < image_width; ++x) {
             printf("\rrendering image pass %.3lf%%", x*100.f/image_width);
-            #pragma omp parallel for schedule(dynamic, 10), num_threads(8)
-            for (int y = 0; y < image_height; ++y) {
-                Vector3f finalColor = Vector3f::ZERO;
-                float actual_samples = sample_per_pixel; 
+            #pragma omp parallel for schedule(dynamic, 2), num_threads(8)
+            for (int y0 = 0; y0 < image_height; y0 += RAY_PACKET_SIZE) {
+                int n = std::min(RAY_PACKET_SIZE, image_height - y0);
+                Vector3f finalColor[RAY_PACKET_SIZE];
+                float actual_samples[RAY_PACKET_SIZE];
+                for (int k = 0; k < n; k++) {
+                    finalColor[k] = Vector3f::ZERO;
+                    actual_samples[k] = sample_per_pixel;
+                }
                 for (int i=0; i<sample_per_pixel; i++) {
-                    float bias_x = random_double(0,1);
-                    float bias_y = random_double(0,1);
-                    Ray camRay = camera->generateRay(Vector2f(x+bias_x, y+bias_y));
-                    Vector3f color = traceRay(camRay, max_depth, init_weight);
-                    for (int i = 0; i < 3; i++) {
-                        if(color[i] != color[i]||color[i] < 0) {
-                            color[i] = 0;
-                            actual_samples -= 1;
+                    RayPacket packet;
+                    Hit records[RAY_PACKET_SIZE];
+                    for (int k = 0; k < n; k++) {
+                        float bias_x = random_double(0,1);
+                        float bias_y = random_double(0,1);
+                        packet.rays[k] = camera->generateRay(Vector2f(x+bias_x, y0+k+bias_y));
+                    }
+                    packet.setup(n, 0.001, infinity);
+                    unsigned hit = 0;
+                    if (max_depth > 0 && init_weight >= MIN_WEIGHT) {
+                        hit = baseGroup->intersectPacket(packet, records, packet.activeMask());
+                    }
+                    for (int k = 0; k < n; k++) {
+                        Vector3f color;
+                        if (max_depth <= 0 || init_weight < MIN_WEIGHT) {
+                            color = Vector3f::ZERO;
+                        } else if (hit >> k & 1u) {
+                            color = shade(packet.rays[k], records[k], max_depth, init_weight);
+                        } else {
+                            color = background(packet.rays[k]);
                         }
+                        for (int c = 0; c < 3; c++) {
+                            if(color[c] != color[c]||color[c] < 0) {
+                                color[c] = 0;
+                                actual_samples[k] -= 1;
+                            }
+                        }
+                        finalColor[k] += color;
                     }
-                    finalColor += color;
                 }
-                if (actual_samples < 1.0) actual_samples = 1.0;
-                finalColor = finalColor/actual_samples;
-                renderedImg->SetPixel(x, y, finalColor);
+                for (int k = 0; k < n; k++) {
+                    if (actual_samples[k] < 1.0) actual_samples[k] = 1.0;
+                    renderedImg->SetPixel(x, y0+k, finalColor[k]/actual_samples[k]);
+                }
             }
         }
         printf("\rrendering image pass 100.000%%\n");
@@ -81,38 +124,132 @@ public:
         }
 
         if (!baseGroup->intersect(camRay, record, 0.001, infinity)) {
-            return backgroundColor;
+            return background(camRay);
         }
+        return shade(camRay, record, depth, weight);
+    }
+
+    // Radiance leaving the hit point `record` of camRay towards its origin,
+    // followed iteratively for up to depth bounces. At every non-specular
+    // vertex a light is sampled and connected with a shadow ray (next-event
+    // estimation), and the BSDF is sampled to continue the path. Emission is
+    // counted by both strategies, weighted with the power heuristic; after a
+    // specular bounce only the BSDF could have found it, so it counts fully.
+    // The environment is one more light, met when a path leaves the scene.
+    // Textures are filtered over the footprint of a cone around the path,
+    // as wide as a pixel from the camera and widened by rough bounces.
+    Vector3f shade(Ray &camRay, const Hit &record, int depth, float weight) {
         Vector3f color = Vector3f::ZERO;
-        ScatterRecord srec;
-        Vector3f attenuation;
-        Vector3f emitted = record.getMaterial()->emitted(record, record.u, record.v, record.getIntersectP()); 
-        if(!record.getMaterial()->scatter(camRay,record,srec)) {
-            if (depth == max_depth) {
-                return record.getMaterial()->emitted(record, record.u, record.v, record.getIntersectP(),true);
+        Vector3f throughput(1, 1, 1);
+        Ray ray = camRay;
+        Hit hit = record;
+        bool specular = true;
+        double bsdf_pdf = 0;
+        bool sample_lights = light_sampler.size() > 0 || environment;
+        float cone_width = 0, cone_spread = camera->getPixelSpread();
+        for (int bounce = 0; ; ++bounce) {
+            const Material *m = hit.getMaterial();
+            const Vector3f &p = hit.getIntersectP();
+            cone_width += cone_spread * hit.getT() * ray.getDirection().length();
+            float cosine = fabs(Vector3f::dot(ray.getDirection().normalized(), hit.getNormal()));
+            hit.footprint = cone_width * hit.uv_rate / std::max(cosine, PATH_CONE_MIN_COS);
+            if (bounce == 0) {
+                color += m->emitted(hit, hit.u, hit.v, p, depth == max_depth);
+            } else if (specular || !sample_lights) {
+                color += throughput * m->emitted(hit, hit.u, hit.v, p);
+            } else {
+                Vector3f Le = m->emitted(hit, hit.u, hit.v, p);
+                if (Le.squaredLength() > 0) {
+                    double light_pdf = (1 - env_pick) * light_sampler.pdf_value(ray.getOrigin(), ray.getDirection(), hit.getT());
+                    color += throughput * Le * powerHeuristic(bsdf_pdf, light_pdf);
+                }
+            }
+
+            ScatterRecord srec;
+            if (bounce + 1 >= depth || !m->scatter(ray, hit, srec)) break;
+            if (srec.is_specular) {
+                throughput = throughput * srec.attenuation;
+                ray = srec.specular_ray;
+                specular = true;
+            } else {
+                if (sample_lights) {
+                    color += throughput * sampleLight(ray, hit, srec);
+                }
+                Ray scattered(p, srec.pdf.generate(), ray.getTime());
+                bsdf_pdf = srec.pdf.value(scattered.getDirection());
+                if (bsdf_pdf <= 0) break;
+                throughput = throughput * m->eval(ray, hit, scattered) / bsdf_pdf;
+                ray = scattered;
+                specular = false;
+                cone_spread = std::max(cone_spread, PATH_CONE_DIFFUSE_SPREAD);
             }
-            else {
-                return emitted;
+            if (throughput.squaredLength() == 0) break;
+            if (!baseGroup->intersect(ray, hit, 0.001, infinity)) {
+                Vector3f Le = background(ray);
+                if (environment && !specular) {
+                    Le = Le * powerHeuristic(bsdf_pdf, env_pick * environment->pdf(ray.getDirection()));
+                }
+                color += throughput * Le;
+                break;
             }
         }
-        if(srec.is_specular) {
-            return srec.attenuation * traceRay(srec.specular_ray, depth-1, weight);
-        }
-        shared_ptr<PDF> light_ptr = make_shared<HittablePDF>(lights, record.getIntersectP());
-        MixturePDF p(light_ptr, srec.pdf_ptr);
-        Ray scattered = Ray(record.getIntersectP(), p.generate(), camRay.getTime());
-        auto pdf_val = p.value(scattered.getDirection());
+        return color;
+    }
+
+    // Next-event estimation at a non-specular hit: one light picked by the
+    // light sampler, one direction towards it, its emission if nothing blocks
+    // the way, MIS-weighted against sampling the same direction from the BSDF.
+    // With an environment it is picked instead with probability env_pick.
+    Vector3f sampleLight(const Ray &ray, const Hit &hit, const ScatterRecord &srec) {
+        if (environment && random_double() < env_pick) return sampleEnvironment(ray, hit, srec);
+        const Vector3f &p = hit.getIntersectP();
+        double pick;
+        int i = light_sampler.sample(p, pick);
+        if (i < 0) return Vector3f::ZERO;
+        const Object3D *light = light_sampler.light(i);
+        Ray shadow(p, light->random(p), ray.getTime());
+        double light_pdf = (1 - env_pick) * pick * light->pdf_value(p, shadow.getDirection());
+        if (light_pdf <= 0) return Vector3f::ZERO;
+        Vector3f f = hit.getMaterial()->eval(ray, hit, shadow);
+        if (f.squaredLength() == 0) return Vector3f::ZERO;
+        Hit light_hit;
+        if (!light->intersect(shadow, light_hit, 0.001, infinity)) return Vector3f::ZERO;
+        Vector3f Le = light_hit.getMaterial()->emitted(light_hit, light_hit.u, light_hit.v, light_hit.getIntersectP());
+        if (Le.squaredLength() == 0) return Vector3f::ZERO;
+        double T = baseGroup->transmittance(shadow, 0.001, light_hit.getT() * (1 - SHADOW_EPS));
+        if (T <= 0) return Vector3f::ZERO;
+        double w = powerHeuristic(light_pdf, srec.pdf.value(shadow.getDirection()));
+        return f * Le * (T * w / light_pdf);
+    }
+
+    Vector3f sampleEnvironment(const Ray &ray, const Hit &hit, const ScatterRecord &srec) {
+        Vector3f dir;
+        double pdf;
+        Vector3f Le = environment->sample(dir, pdf);
+        double light_pdf = env_pick * pdf;
+        if (light_pdf <= 0 || Le.squaredLength() == 0) return Vector3f::ZERO;
+        Ray shadow(hit.getIntersectP(), dir, ray.getTime());
+        Vector3f f = hit.getMaterial()->eval(ray, hit, shadow);
+        if (f.squaredLength() == 0) return Vector3f::ZERO;
+        double T = baseGroup->transmittance(shadow, 0.001, infinity);
+        if (T <= 0) return Vector3f::ZERO;
+        double w = powerHeuristic(light_pdf, srec.pdf.value(dir));
+        return f * Le * (T * w / light_pdf);
+    }
 
-        return emitted
-             + srec.attenuation * record.getMaterial()->scatterPDF(camRay, record, scattered)
-                                * traceRay(scattered, depth-1, weight) / pdf_val; // *attenuation.length() 暂时去除权重
+    // radiance of a ray leaving the scene
+    Vector3f background(const Ray &r) const {
+        return environment ? environment->eval(r.getDirection()) : backgroundColor;
     }
 
 private:
     Camera* camera;
     Group* baseGroup;
     Group* lights;
+    LightSampler light_sampler;
     Vector3f backgroundColor;
+    const Environment *environment;
+    double env_pick;  // probability that next-event estimation samples the environment
     int image_width, image_height, sample_per_pixel;
     float max_depth, init_weight;
     Image* renderedImg;
@@ -4,9 +4,8 @@
 #include "object3d.hpp"
 #include "curve.hpp"
 #include "utils.hpp"
-#include "cylinder.hpp"
-#include "bvh.hpp"
 #include "mesh.hpp"
+#include "bernstein.hpp"
 #include <tuple>
 #include <iostream>
 
@@ -16,9 +15,30 @@
 const int NEWTON_STEPS = 100;
 const float NEWTON_EPS = 1e-4;
 
+// Below this |d.y| / |d| a ray is treated as parallel to the xz plane.
+#define REV_HORIZONTAL_EPS 1e-6
+#define REV_MAX_ROOTS (2 * CURVE_MAX_DEGREE)
+// Pieces of the span hierarchy are halved until the (distance from axis, y)
+// box of their hull is at most REV_BOUND_LEAF_SIZE times the profile size.
+#define REV_BOUND_LEAF_SIZE (1.0 / 16)
+#define REV_BOUND_MAX_DEPTH 8
+#define REV_BOUND_STACK 64
+
+// Tessellation of mesh mode. Without an explicit tolerance the chord error
+// is bounded by REV_MESH_TOLERANCE times the size of the profile.
+#define REV_MESH_TOLERANCE 1e-3
+#define REV_MESH_PIXEL_ERROR 0.5
+// a profile segment turns by at most this angle (radians)
+#define REV_MESH_MAX_TURN 0.2
+#define REV_MESH_MIN_DEPTH 1
+#define REV_MESH_MAX_DEPTH 16
+#define REV_MESH_MIN_STEPS 12
+#define REV_MESH_MAX_STEPS 1024
+
+static_assert(2 * CURVE_MAX_DEGREE <= BERNSTEIN_MAX_DEGREE, "ray equation of a span exceeds the root finder");
+
 class RevSurface : public Object3D {
     // Definition for drawable surface.
-    typedef std::tuple<unsigned, unsigned, unsigned> Tup3u;
     shared_ptr<Mesh> tri_mesh;
     // Surface is just a struct that contains vertices, normals, and
     // faces.  VV[i] is the position of vertex i, and VN[i] is the normal
@@ -26,8 +46,35 @@ class RevSurface : public Object3D {
     // with (vertex i, normal i), (vertex j, normal j), ...
     // Currently this struct is computed every time when canvas refreshes.
     // You can store this as member function to accelerate rendering.
+
+    // A span of the profile, or a piece of one, in Bernstein form over its
+    // own parameter u in [0, 1] (curve parameter t0 + u (t1 - t0)): x and y
+    // of degree k, and x^2, y^2 and y raised to degree 2k for the ray
+    // equation.
+    struct ProfileSpan {
+        float t0, t1;
+        std::vector<double> x, y, xx, yy, y2;
+    };
+
+    // Node of the bound hierarchy, the root is nodes[0]. Its shell is the
+    // solid of revolution y0 <= y <= y1, r0 <= distance from the axis <= r1.
+    struct ProfileNode {
+        float y0, y1, r0, r1;
+        int left = -1, right = -1;
+        int piece = -1;     // index into pieces for leaves
+    };
+
+    // ray terms shared by all shell tests: the squared distance from the
+    // axis along the ray is a t^2 + 2 b t + c
+    struct RayTerms {
+        double oy, dy, a, b, c;
+    };
+
 public:
-    RevSurface(shared_ptr<Curve> pCurve, shared_ptr<Material> material, bool _isMesh = false) : pCurve(pCurve), Object3D(material), isMesh(_isMesh) {
+    // tolerance: largest distance of the mesh from the surface in object
+    // units, 0 for the default (see screenTolerance)
+    RevSurface(shared_ptr<Curve> pCurve, shared_ptr<Material> material, bool _isMesh = false, float tolerance = 0)
+        : pCurve(pCurve), Object3D(material), isMesh(_isMesh), mesh_tolerance(tolerance) {
         // Check flat.
         for (const auto &cp : pCurve->getControls()) {
             if (cp.z() != 0.0) {
@@ -35,23 +82,21 @@ public:
                 exit(0);
             }
         }
-        resolution = 100; resolution_mesh = 1000; steps = 360;
         miny = pCurve->y_min;
         maxy = pCurve->y_max;
         radius = pCurve->radius;
+        normal_sign = profileOrientation();
+        if (!isMesh && pCurve->k > CURVE_MAX_DEGREE) {
+            // the ray equation of a span would exceed the root finder
+            printf("Profile of degree %d is above %d, revSurface falls back to a mesh.\n", pCurve->k,
+                   CURVE_MAX_DEGREE);
+            isMesh = true;
+        }
         if(isMesh) {
             meshInit();
         }
         else {
-            pCurve->discretize(resolution, curvePoints);
-            std::vector<shared_ptr<Object3D>> cylinders;
-            cylinders.reserve(curvePoints.size()-1);
-            for (int i=0; i<curvePoints.size()-1; i++) {
-                float r = fmax(fabs(curvePoints[i].V.x()), fabs(curvePoints[i+1].V.x()));
-                cylinders.push_back(make_shared<Cylinder>(Vector3f(0,0,0), r, fmin(curvePoints[i].V.y(), curvePoints[i+1].V.y()),
-                                fmax(curvePoints[i].V.y(), curvePoints[i+1].V.y()), material));
-            }
-            cylinder_bvh = make_shared<BVHnode>(cylinders, 0, cylinders.size(), 0, 0);
+            spanInit();
         }
     }
 
@@ -61,78 +106,28 @@ public:
 
         if (isMesh) {
             return tri_mesh->intersect(r, h, tmin, tmax);
-        } else {
-            Vector3f ro = r.getOrigin();
-            Vector3f rd = r.getDirection();
-            double dt, dl, d0;
-
-            // intersect with the cylinder
-            double l, a, b, c;
-            a = (rd.x() * rd.x() + rd.z() * rd.z());
-            b = (2 * rd.x() * ro.x() + 2 * rd.z() * ro.z());
-            c = ro.x() * ro.x() + ro.z() * ro.z() - radius * radius;
-            double det = b * b - 4 * a * c;
-
-            if (det < 0) return false;
-            else det = std::sqrt(det);
-            if ((-b - det) / (2 * a) > tmin) l = (-b - det) / (2 * a);
-            else if ((-b + det) / (2 * a) > tmin) l = (-b + det) / (2 * a);
-            else return false;
-            if(l > tmax) return false;
-            Vector3f np = ro + l * rd;
-
-            double t = (np.y() - miny) / (maxy - miny);
-            if (t < 0 || t > 1) return false;
-            double theta0 = std::acos(np.x() / radius);
-
-            Hit rec;
-            std::vector<float> t_vec;
-            if (cylinder_bvh->intersect(r, rec, tmin, tmax)) { 
-                l = rec.getT();
-                theta0 = rec.u * 2 * M_PI;
-                np = ro + l * rd;
-                t = (np.y() - miny) / (maxy - miny);
-                for (int i = 0; i < curvePoints.size()-1; i++) {
-                    if (np.y() >= fmin(curvePoints[i].V.y(), curvePoints[i+1].V.y()) && np.y() < fmax(curvePoints[i].V.y(), curvePoints[i+1].V.y())) {
-                        t_vec.push_back((i + (np.y() - curvePoints[i].V.y())/(curvePoints[i+1].V.y() - curvePoints[i].V.y()))/(float)resolution);
-                    }
-                }
-
-            }
-            bool flag = false; float cloest_t = tmax;
-            if (Levenberg_Marquardt(r, h, tmin, cloest_t, l, t, theta0)){
-                flag = true;
-                cloest_t = h.getT();
-            }
-            for (auto tt : t_vec) {
-                if (Levenberg_Marquardt(r, h, tmin, cloest_t, l, tt, theta0)) {
-                    cloest_t = h.getT();
-                    flag = true;
-                }
-            }
-
-            // float interval = 0.01;
-            // for (int j = 0; j < 10; j ++){
-            //     double s1 = t + interval;
-            //     double s2 = t - interval;
-            //     if (s1 <= 1)
-            //         if (Levenberg_Marquardt(r, h, tmin, tmax, l, s1, theta0)) return true;
-            //     if (s2 >= 0)
-            //         if (Levenberg_Marquardt(r, h, tmin, tmax, l, s2, theta0)) return true;
-            //     interval *= 1.45;
-            // }
-            
-            float interval = 100;
-            for (int j = 0; j <= interval; j ++){
-                double s = pCurve->range[0] + (pCurve->range[1] - pCurve->range[0]) * (float)j/interval;
-                if (Levenberg_Marquardt(r, h, tmin, cloest_t, l, s, theta0)) {
-                    flag = true;
-                    cloest_t = h.getT();
-                }
+        }
+        float t, s;
+        if (!hitProfile(r, tmin, tmax, t, s)) return false;
+        CurvePoint fs = pCurve->caculate(s);
+        Vector3f p = r.pointAtParameter(t);
+        // p = (x cos(theta), y, x sin(theta)) with x = fs.V.x(), which may be negative
+        double theta = fabs(fs.V.x()) > 1e-8 ? atan2(p.z() / fs.V.x(), p.x() / fs.V.x()) : 0;
+        if (theta < 0) theta += 2 * M_PI;
+        Vector3f n(fs.T.y() * cos(theta), -fs.T.x(), fs.T.y() * sin(theta));
+        if (n.squaredLength() < 1e-20) n = Vector3f::UP;
+        h.set(t, material.get(), normal_sign * n.normalized(), r);
+        h.u = theta / (2 * M_PI);
+        h.v = 1 - s;
+        return true;
+    }
 
-            }
-            return flag;
+    bool occluded(const Ray &r, float tmin = 0.0, float tmax = infinity) const override {
+        if (isMesh) {
+            return tri_mesh->occluded(r, tmin, tmax);
         }
+        float t, s;
+        return hitProfile(r, tmin, tmax, t, s);
     }
 
     bool newton_iteration(const Ray &r, Hit &h, float tmin, float tmax, double tr, double s, double theta) const {
@@ -151,7 +146,7 @@ public:
                     if (tr >= tmin && tr < tmax) {
                         Vector3f n(-fs.T.y() * cos(theta), fs.T.x(), -fs.T.y() * sin(theta));
                         n.normalize();
-                        h.set(tr, material, n, r);
+                        h.set(tr, material.get(), n, r);
                         h.u = theta/(2*M_PI);
                         h.v = 1 - s;   
                         return true;
@@ -173,144 +168,376 @@ public:
         return false;
     }
 
-    bool Levenberg_Marquardt(const Ray &r, Hit &h, float tmin, float tmax, double tr, double s, double theta) const {
-        float epsilon1 = 1e-10, epsilon2 = 1e-10, epsilon = 0.01;
-        int imax = 100; float nu=2.0;
-        Vector3f X(tr, s, theta);
-        CurvePoint fs = pCurve->caculate(s);
-        Vector3f p = r.pointAtParameter(tr);
-        Matrix3f JF(r.getDirection().x(), -cos(theta) * fs.T.x(), sin(theta) * fs.V.x(),
-                    r.getDirection().y(), -fs.T.y(),              0,
-                    r.getDirection().z(), -sin(theta) * fs.T.x(), -cos(theta) * fs.V.x());
-        Vector3f F(p.x() - fs.V.x() * cos(theta),
-                    p.y() - fs.V.y(),
-                    p.z() - fs.V.x() * sin(theta));
-        Matrix3f H = JF.transposed()*JF;
-        Vector3f g = JF.transposed()*F;
-        bool found = g.length() <= epsilon1 || F.length() < epsilon;
-        float mu = - infinity;
-        for (int i = 0; i<3; i++) {
-            mu = fmax(mu, H(i,i));
+    bool bounding_box(double time0, double time1, AABB& output_box) const {
+        output_box = AABB(Vector3f(-pCurve->radius, pCurve->y_min - 0.01, -pCurve->radius),
+                 Vector3f(pCurve->radius, pCurve->y_max + 0.01, pCurve->radius));
+        return true;
+    }
+
+    // Tolerance that keeps the mesh within `pixels` pixels of the surface for
+    // a camera with vertical field of view fov (radians) and image_height
+    // rows, seen from distance, when one object unit is scale world units.
+    static float screenTolerance(float fov, int image_height, float distance, float scale,
+                                 float pixels = REV_MESH_PIXEL_ERROR) {
+        return pixels * fov / image_height * distance / scale;
+    }
+
+    // Orientation of the normal: (y', -x') points out of the solid when the
+    // profile sweeps positive area against the y axis.
+    float profileOrientation() const {
+        std::vector<CurveSpan> curve_spans;
+        pCurve->bezierSpans(curve_spans);
+        double area = 0;
+        for (const CurveSpan &span : curve_spans) {
+            for (size_t j = 0; j + 1 < span.controls.size(); ++j) {
+                area += 0.5 * (span.controls[j].x() + span.controls[j + 1].x()) *
+                        (span.controls[j + 1].y() - span.controls[j].y());
+            }
         }
-        mu *= 0.001;
-        for (int i = 0; i<=imax; i++) {
-            if (found) {
-                if (X.x() >= tmin && X.x() < tmax && X.y() <= pCurve->range[1] && X.y() >= pCurve->range[0] && F.length() < epsilon) {
-                    Vector3f ro = r.getOrigin(); ro.y() = 0;
-                    Vector3f n(fs.T.y() * cos(X.z()), -fs.T.x(), fs.T.y() * sin(X.z()));
-                    if ((ro.length() > (fabs(fs.V.x()+0.001)) && Vector3f::dot(r.getDirection(), n) > 0)||
-                        (ro.length() < (fabs(fs.V.x()+0.001)) && Vector3f::dot(r.getDirection(), n) < 0)) {
-                        n = -n;
-                    }
-                    n.normalize();
-                    h.set(X.x(), material, n, r);
-                    h.u = X.z()/(2*M_PI);
-                    h.v = 1 - X.y();
-                    return true;
-                } 
+        return area >= 0 ? 1 : -1;
+    }
+
+    // Bernstein coefficients of every profile span, and the bound hierarchy
+    // over them: consecutive spans are grouped in pairs, and each span is
+    // halved further until its hull is small.
+    void spanInit() {
+        std::vector<CurveSpan> curve_spans;
+        pCurve->bezierSpans(curve_spans);
+        int k = pCurve->k;
+        std::vector<double> ones(k + 1, 1.0);
+        std::vector<ProfileSpan> spans(curve_spans.size());
+        for (size_t i = 0; i < curve_spans.size(); ++i) {
+            const CurveSpan &cs = curve_spans[i];
+            ProfileSpan &span = spans[i];
+            span.t0 = cs.t0;
+            span.t1 = cs.t1;
+            span.x.resize(k + 1);
+            span.y.resize(k + 1);
+            for (int j = 0; j <= k; ++j) {
+                span.x[j] = cs.controls[j].x();
+                span.y[j] = cs.controls[j].y();
+            }
+            span.xx.resize(2 * k + 1);
+            span.yy.resize(2 * k + 1);
+            span.y2.resize(2 * k + 1);
+            bernsteinMultiply(span.x.data(), k, span.x.data(), k, span.xx.data());
+            bernsteinMultiply(span.y.data(), k, span.y.data(), k, span.yy.data());
+            bernsteinMultiply(span.y.data(), k, ones.data(), k, span.y2.data());
+        }
+        bound_pad = 1e-4 * (1 + radius);
+        pieces.clear();
+        nodes.clear();
+        buildSpans(spans, 0, spans.size(), REV_BOUND_LEAF_SIZE * fmax(radius, maxy - miny));
+    }
+
+    // The y range and the range of distances from the axis covered by the
+    // hull of the controls: the piece lies in this shell of revolution.
+    static void pieceBounds(const ProfileSpan &piece, ProfileNode &node) {
+        node.y0 = node.y1 = piece.y[0];
+        node.r0 = node.r1 = fabs(piece.x[0]);
+        bool positive = false, negative = false;
+        for (size_t j = 0; j < piece.x.size(); ++j) {
+            node.y0 = fmin(node.y0, piece.y[j]);
+            node.y1 = fmax(node.y1, piece.y[j]);
+            node.r0 = fmin(node.r0, fabs(piece.x[j]));
+            node.r1 = fmax(node.r1, fabs(piece.x[j]));
+            positive |= piece.x[j] > 0;
+            negative |= piece.x[j] < 0;
+        }
+        // a hull that crosses the axis reaches it
+        if (positive && negative) node.r0 = 0;
+    }
+
+    static void splitPiece(const ProfileSpan &piece, ProfileSpan &left, ProfileSpan &right) {
+        left.t0 = piece.t0;
+        left.t1 = right.t0 = 0.5f * (piece.t0 + piece.t1);
+        right.t1 = piece.t1;
+        std::vector<double> ProfileSpan::*arrays[5] = {&ProfileSpan::x, &ProfileSpan::y, &ProfileSpan::xx,
+                                                      &ProfileSpan::yy, &ProfileSpan::y2};
+        for (int i = 0; i < 5; ++i) {
+            const std::vector<double> &c = piece.*arrays[i];
+            (left.*arrays[i]).resize(c.size());
+            (right.*arrays[i]).resize(c.size());
+            bernsteinSplit(c.data(), c.size() - 1, (left.*arrays[i]).data(), (right.*arrays[i]).data());
+        }
+    }
+
+    int buildPieces(const ProfileSpan &piece, int depth, float leaf_size) {
+        int index = nodes.size();
+        nodes.push_back(ProfileNode());
+        pieceBounds(piece, nodes[index]);
+        float dy = nodes[index].y1 - nodes[index].y0, dr = nodes[index].r1 - nodes[index].r0;
+        if (depth >= REV_BOUND_MAX_DEPTH || dy * dy + dr * dr <= leaf_size * leaf_size) {
+            nodes[index].piece = pieces.size();
+            pieces.push_back(piece);
+            return index;
+        }
+        ProfileSpan left, right;
+        splitPiece(piece, left, right);
+        int l = buildPieces(left, depth + 1, leaf_size);
+        int r = buildPieces(right, depth + 1, leaf_size);
+        nodes[index].left = l;
+        nodes[index].right = r;
+        return index;
+    }
+
+    int buildSpans(const std::vector<ProfileSpan> &spans, size_t lo, size_t hi, float leaf_size) {
+        if (hi - lo == 1) return buildPieces(spans[lo], 0, leaf_size);
+        int index = nodes.size();
+        nodes.push_back(ProfileNode());
+        size_t mid = (lo + hi) / 2;
+        int l = buildSpans(spans, lo, mid, leaf_size);
+        int r = buildSpans(spans, mid, hi, leaf_size);
+        ProfileNode &node = nodes[index];
+        node.left = l;
+        node.right = r;
+        node.y0 = fmin(nodes[l].y0, nodes[r].y0);
+        node.y1 = fmax(nodes[l].y1, nodes[r].y1);
+        node.r0 = fmin(nodes[l].r0, nodes[r].r0);
+        node.r1 = fmax(nodes[l].r1, nodes[r].r1);
+        return index;
+    }
+
+    // Does the ray meet the shell of node within [tmin, tmax]? entry is the
+    // first such t. The shell is padded by bound_pad all around.
+    bool hitShell(const ProfileNode &node, const RayTerms &ray, double tmin, double tmax, double &entry) const {
+        double lo = tmin, hi = tmax;
+        if (ray.dy != 0) {
+            double t1 = (node.y0 - bound_pad - ray.oy) / ray.dy, t2 = (node.y1 + bound_pad - ray.oy) / ray.dy;
+            lo = fmax(lo, fmin(t1, t2));
+            hi = fmin(hi, fmax(t1, t2));
+        } else if (ray.oy < node.y0 - bound_pad || ray.oy > node.y1 + bound_pad) {
+            return false;
+        }
+        double outer = node.r1 + bound_pad;
+        if (ray.a > 0) {
+            double det = ray.b * ray.b - ray.a * (ray.c - outer * outer);
+            if (det < 0) return false;
+            det = sqrt(det);
+            lo = fmax(lo, (-ray.b - det) / ray.a);
+            hi = fmin(hi, (-ray.b + det) / ray.a);
+        } else if (ray.c > outer * outer) {
+            return false;
+        }
+        if (lo > hi) return false;
+        double inner = node.r0 - bound_pad;
+        if (inner > 0) {
+            // take away the part of the ray inside the inner cylinder
+            if (ray.a > 0) {
+                double det = ray.b * ray.b - ray.a * (ray.c - inner * inner);
+                if (det > 0) {
+                    det = sqrt(det);
+                    double i0 = (-ray.b - det) / ray.a, i1 = (-ray.b + det) / ray.a;
+                    if (i0 <= lo && i1 >= hi) return false;
+                    if (lo > i0 && lo < i1) lo = i1;
+                }
+            } else if (ray.c < inner * inner) {
                 return false;
             }
-            H(0, 0) += mu;H(1, 1) += mu;H(2, 2) += mu;
-            Vector3f delta =  H.inverse() * (- g);
-            
-            if (delta.length() < epsilon2*(X.length() * epsilon2)) { 
-                found = true;
+        }
+        entry = lo;
+        return true;
+    }
+
+    // Nearest intersection of r with the surface in (tmin, tmax): ray
+    // parameter t and curve parameter s. Only the pieces whose shells the
+    // ray meets before the nearest hit so far are solved.
+    //
+    // Eliminating the angle, a point of the ray at height y(s) lies on the
+    // surface iff its squared distance from the y axis is x(s)^2. With
+    // t = (y(s) - o.y) / d.y and scaled by d.y^2 this reads, per span,
+    //   d.y^2 x^2 - (A + d.x y)^2 - (C + d.z y)^2 = 0,
+    //   A = o.x d.y - o.y d.x,  C = o.z d.y - o.y d.z,
+    // a polynomial of degree 2k in the span parameter whose roots the
+    // Bernstein subdivision isolates. Horizontal rays solve y(s) = o.y
+    // instead and then the circle of radius x(s) at that height.
+    bool hitProfile(const Ray &r, float tmin, float tmax, float &t_hit, float &s_hit) const {
+        const Vector3f &o = r.getOrigin(), &d = r.getDirection();
+        double ox = o.x(), oy = o.y(), oz = o.z(), dx = d.x(), dy = d.y(), dz = d.z();
+        RayTerms ray;
+        ray.oy = oy;
+        ray.dy = dy;
+        ray.a = dx * dx + dz * dz;
+        ray.b = ox * dx + oz * dz;
+        ray.c = ox * ox + oz * oz;
+        double a = ray.a, b = ray.b;
+
+        int k = pCurve->k;
+        bool horizontal = fabs(dy) <= REV_HORIZONTAL_EPS * sqrt(a + dy * dy);
+        double A = ox * dy - oy * dx, C = oz * dy - oy * dz;
+        double cxx = dy * dy, cyy = a, cy = 2 * (A * dx + C * dz), c0 = A * A + C * C;
+        double best = tmax;
+        bool found = false;
+        double poly[2 * CURVE_MAX_DEGREE + 1], roots[REV_MAX_ROOTS];
+        int stack[REV_BOUND_STACK], top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const ProfileNode &node = nodes[stack[--top]];
+            double entry;
+            if (!hitShell(node, ray, tmin, best, entry)) continue;
+            if (node.piece < 0) {
+                // nearer child on top, its hits cull the other one
+                double entry_left, entry_right;
+                bool left = hitShell(nodes[node.left], ray, tmin, best, entry_left);
+                bool right = hitShell(nodes[node.right], ray, tmin, best, entry_right);
+                if (left && right && entry_right < entry_left) {
+                    stack[top++] = node.left;
+                    stack[top++] = node.right;
+                } else {
+                    if (right) stack[top++] = node.right;
+                    if (left) stack[top++] = node.left;
+                }
+                continue;
+            }
+            const ProfileSpan &span = pieces[node.piece];
+            int count;
+            if (horizontal) {
+                for (int j = 0; j <= k; ++j) poly[j] = span.y[j] - oy;
+                count = bernsteinRoots(poly, k, roots, REV_MAX_ROOTS);
             } else {
-                Vector3f X_new = X + delta;
-                CurvePoint fs_new = pCurve->caculate(X_new.y());
-                Vector3f p_new = r.pointAtParameter(X_new.x());
-                Vector3f F_new(p_new.x() - fs_new.V.x() * cos(X_new.z()),
-                            p_new.y() - fs_new.V.y(),
-                            p_new.z() - fs_new.V.x() * sin(X_new.z()));
-                float rho = (F.squaredLength()-F_new.squaredLength())/(Vector3f::dot(delta, mu*delta - g));
-                if (rho > 0) {
-                    X = X_new;
-                    fs = fs_new;
-                    p = p_new;
-                    F = F_new;
-                    JF = Matrix3f(r.getDirection().x(), -cos(X.z()) * fs.T.x(), sin(X.z()) * fs.V.x(),
-                                r.getDirection().y(), -fs.T.y(),              0,
-                                r.getDirection().z(), -sin(X.z()) * fs.T.x(), -cos(X.z()) * fs.V.x());
-                    H = JF.transposed()*JF;
-                    g = JF.transposed()*F;
-                    found = g.length() <= epsilon1 || F.length() < epsilon;
-                    mu = mu * fmax(1.0/3.0, 1-pow(2*rho-1, 3));
-                    nu = 2.0;
+                for (int j = 0; j <= 2 * k; ++j) {
+                    poly[j] = cxx * span.xx[j] - cyy * span.yy[j] - cy * span.y2[j] - c0;
+                }
+                count = bernsteinRoots(poly, 2 * k, roots, REV_MAX_ROOTS);
+            }
+            for (int i = 0; i < count; ++i) {
+                double u = roots[i];
+                double cand[2];
+                int cands = 0;
+                if (horizontal) {
+                    if (a == 0) continue;
+                    double x = bernsteinEval(span.x.data(), k, u);
+                    double det = b * b - a * (ray.c - x * x);
+                    if (det < 0) continue;
+                    det = sqrt(det);
+                    cand[cands++] = (-b - det) / a;
+                    cand[cands++] = (-b + det) / a;
                 } else {
-                    mu = mu * nu;
-                    nu = 2 * nu;
+                    cand[cands++] = (bernsteinEval(span.y.data(), k, u) - oy) / dy;
+                }
+                for (int j = 0; j < cands; ++j) {
+                    if (cand[j] > tmin && cand[j] < best) {
+                        best = cand[j];
+                        t_hit = cand[j];
+                        s_hit = span.t0 + u * (span.t1 - span.t0);
+                        found = true;
+                    }
                 }
             }
-            if (std::isnan(X.x()) || std::isnan(X.y()) || std::isnan(X.z()))
-                return false;
-            if (X.y() >= 1) X.y() = 1.0 - FLT_EPSILON;
-            if (X.y() <= 0) X.y() = FLT_EPSILON;
-            if (X.x() < tmin) X.x() = tmin + FLT_EPSILON;
-            if (X.x() > tmax) X.x() = tmax - FLT_EPSILON;
         }
-        return false;
+        return found;
     }
 
-    bool bounding_box(double time0, double time1, AABB& output_box) const {
-        output_box = AABB(Vector3f(-pCurve->radius, pCurve->y_min - 0.01, -pCurve->radius),
-                 Vector3f(pCurve->radius, pCurve->y_max + 0.01, pCurve->radius));
-        return true;
+    // Profile points after a up to b: the segment is halved while the curve
+    // strays from the chord by more than tol or its tangent turns by more
+    // than REV_MESH_MAX_TURN.
+    void refineProfile(float a, const CurvePoint &pa, float b, const CurvePoint &pb, float tol, int depth,
+                       std::vector<CurvePoint> &profile) const {
+        float m = 0.5f * (a + b);
+        CurvePoint pm = pCurve->caculate(m);
+        bool split = depth < REV_MESH_MIN_DEPTH;
+        if (!split && depth < REV_MESH_MAX_DEPTH) {
+            Vector3f chord = pb.V - pa.V;
+            float len2 = chord.squaredLength();
+            Vector3f off = pm.V - pa.V;
+            if (len2 > 0) off -= Vector3f::dot(off, chord) / len2 * chord;
+            float ta = pa.T.length(), tb = pb.T.length();
+            split = off.length() > tol ||
+                    (ta > 0 && tb > 0 && Vector3f::dot(pa.T, pb.T) < cos(REV_MESH_MAX_TURN) * ta * tb);
+        }
+        if (split) {
+            refineProfile(a, pa, m, pm, tol, depth + 1, profile);
+            refineProfile(m, pm, b, pb, tol, depth + 1, profile);
+        } else {
+            profile.push_back(pb);
+        }
     }
 
+    // Indexed mesh within the tolerance of the surface: the profile is
+    // refined per span by chord error and curvature, the number of angular
+    // steps keeps the sagitta of the widest ring below the tolerance, and
+    // rings on the axis collapse into one vertex.
     void meshInit() {
+        float size = fmax(radius, maxy - miny);
+        // half of the error budget for the profile, half for the rings
+        float tol = 0.5f * (mesh_tolerance > 0 ? mesh_tolerance : REV_MESH_TOLERANCE * size);
+
+        std::vector<CurveSpan> curve_spans;
+        std::vector<CurvePoint> profile;
+        pCurve->bezierSpans(curve_spans);
+        profile.push_back(pCurve->caculate(curve_spans.front().t0));
+        for (const CurveSpan &span : curve_spans) {
+            CurvePoint start = profile.back();
+            refineProfile(span.t0, start, span.t1, pCurve->caculate(span.t1), tol, 0, profile);
+        }
+
+        float ring_radius = 0;
+        for (const CurvePoint &cp : profile) ring_radius = fmax(ring_radius, fabs(cp.V.x()));
+        int steps = REV_MESH_MAX_STEPS;
+        if (tol >= ring_radius) {
+            steps = REV_MESH_MIN_STEPS;
+        } else if (tol > ring_radius * (1 - cos(M_PI / REV_MESH_MAX_STEPS))) {
+            steps = (int)ceil(M_PI / acos(1 - tol / ring_radius));
+            steps = std::max(steps, REV_MESH_MIN_STEPS);
+        }
+
         std::vector<Vector3f> VV;
         std::vector<Vector3f> VN;
-        std::vector<Tup3u> VF;
-        std::vector<CurvePoint> curve_points;
-        
-        pCurve->discretize_mesh(resolution_mesh, curve_points);
-        for (unsigned int ci = 0; ci < curve_points.size(); ++ci) {
-            const CurvePoint &cp = curve_points[ci];
-            for (unsigned int i = 0; i < steps; ++i) {
-                float t = (float)i / steps;
-                Quat4f rot;
-                // 生成参数曲面
-                rot.setAxisAngle(t * 2 * 3.14159, Vector3f::UP);
-                Vector3f pnew = Matrix3f::rotation(rot) * cp.V;
-                Vector3f pNormal = Vector3f::cross(cp.T, -Vector3f::FORWARD);
-                Vector3f nnew = Matrix3f::rotation(rot) * pNormal;
-                VV.push_back(pnew);
-                VN.push_back(nnew);
+        std::vector<Mesh::TriangleIndex> VF;
+        std::vector<int> ring_start(profile.size());
+        std::vector<bool> pole(profile.size());
+        VV.reserve(profile.size() * steps);
+        VN.reserve(profile.size() * steps);
+        VF.reserve(2 * profile.size() * steps);
+        for (size_t ci = 0; ci < profile.size(); ++ci) {
+            const CurvePoint &cp = profile[ci];
+            // (y', -x') of the profile, from the neighbours where the tangent vanishes
+            Vector3f T = cp.T;
+            if (T.squaredLength() < 1e-20) {
+                T = profile[std::min(ci + 1, profile.size() - 1)].V - profile[ci > 0 ? ci - 1 : 0].V;
+            }
+            Vector3f pn = T.squaredLength() < 1e-20 ? Vector3f(0, 1, 0) : normal_sign * Vector3f(T.y(), -T.x(), 0).normalized();
+            ring_start[ci] = VV.size();
+            pole[ci] = fabs(cp.V.x()) < 1e-6 * size;
+            int count = pole[ci] ? 1 : steps;
+            for (int i = 0; i < count; ++i) {
+                double theta = 2 * M_PI * i / steps;
+                VV.push_back(Vector3f(cp.V.x() * cos(theta), cp.V.y(), cp.V.x() * sin(theta)));
+                VN.push_back(Vector3f(pn.x() * cos(theta), pn.y(), pn.x() * sin(theta)));
+            }
+        }
+        for (size_t ci = 0; ci + 1 < profile.size(); ++ci) {
+            int a = ring_start[ci], b = ring_start[ci + 1];
+            if (pole[ci] && pole[ci + 1]) continue;
+            for (int i = 0; i < steps; ++i) {
                 int i1 = (i + 1 == steps) ? 0 : i + 1;
-                if (ci != curve_points.size() - 1) {
+                if (pole[ci]) {
+                    VF.push_back(Mesh::TriangleIndex(a, b + i, b + i1));
+                } else if (pole[ci + 1]) {
+                    VF.push_back(Mesh::TriangleIndex(a + i, b, a + i1));
+                } else {
                     // 把四边形剖分成两个三角形
-                    VF.emplace_back((ci + 1) * steps + i, ci * steps + i1,
-                                    ci * steps + i);
-                    VF.emplace_back((ci + 1) * steps + i, (ci + 1) * steps +
-                    i1,
-                                    ci * steps + i1);
+                    VF.push_back(Mesh::TriangleIndex(b + i, a + i1, a + i));
+                    VF.push_back(Mesh::TriangleIndex(b + i, b + i1, a + i1));
                 }
             }
         }
-        std::vector<shared_ptr<Object3D>> triangles(VF.size());
-        #pragma omp parallel for schedule(dynamic, 60), num_threads(12)
-        for (int i = 0; i < VF.size(); ++i) {
-            shared_ptr<Triangle> t = make_shared<Triangle>(VV[std::get<0>(VF[i])], VV[std::get<1>(VF[i])],
-                       VV[std::get<2>(VF[i])], material);
-            t->setVNorm(VN[std::get<0>(VF[i])], VN[std::get<1>(VF[i])],
-                       VN[std::get<2>(VF[i])]);
-            shared_ptr<Object3D> tri = t; 
-            
-            triangles[i]=t;
-        }
 
-        tri_mesh = make_shared<Mesh>(triangles, material);
-        std::cout << "mesh inited!" << std::endl;
+        tri_mesh = make_shared<Mesh>(VV, VF, VN, material);
+        std::cout << "mesh inited! " << profile.size() << " x " << steps << " vertices, " << VF.size()
+                  << " triangles" << std::endl;
     }
 
 protected:
-    std::vector<CurvePoint> curvePoints;
-    shared_ptr<BVHnode> cylinder_bvh;
+    std::vector<ProfileSpan> pieces;
+    std::vector<ProfileNode> nodes;
+    float bound_pad;
+    float normal_sign;
     shared_ptr<Curve> pCurve;
     double radius;
     double maxy, miny;
-    int resolution, resolution_mesh, steps;
     bool isMesh;
+    float mesh_tolerance;
 };
 
 #endif //REVSURFACE_HPP
\ No newline at end of file
@@ -16,9 +16,11 @@
 #include "transform.hpp"
 #include "mesh.hpp"
 #include "constant_medium.hpp"
+#include "grid_medium.hpp"
 #include "bvh.hpp"
 #include "curve.hpp"
 #include "revsurface.hpp"
+#include "environment.hpp"
 
 class SceneGenerator {
 public:
@@ -46,6 +48,9 @@ public:
             case 7:
                 final_scene3();
                 break;
+            case 8:
+                cornell_grid_smoke();
+                break;
             default:
                 std::cout<<"matched no scene!"<<std::endl;
                 break;
@@ -90,6 +95,10 @@ public:
         return background;
     }
 
+    Environment* getEnvironment() {
+        return environment.get();
+    }
+
 protected:
     Camera *camera;
     Group *group;
@@ -97,6 +106,8 @@ protected:
     int imgW, imgH, sample_per_pixel;
     float max_depth, init_weight;
     Vector3f background;
+    shared_ptr<Environment> environment;
+    MaterialTable materials;
 
 
     void cornell_box() {
@@ -119,12 +130,12 @@ protected:
         group = new Group(7);
         lights = new Group(1);
 
-        shared_ptr<Material> red = make_shared<Lambertian>(Vector3f(.65, .05, .05));
-        shared_ptr<Material> white = make_shared<Lambertian>(Vector3f(.73, .73, .73));
-        shared_ptr<Material> green = make_shared<Lambertian>(Vector3f(.12, .45, .15));
-        shared_ptr<Material> light = make_shared<DiffuseLight>(Vector3f(1, 1, 1), 7);
-        shared_ptr<Material> wall = make_shared<Lambertian>(make_shared<ImageTexture>("resource/bricks.jpg"));
-        shared_ptr<Material> e = make_shared<Metal>(Vector3f(0.9, 0.6, 0.6));
+        shared_ptr<Material> red = materials.lambertian(Vector3f(.65, .05, .05));
+        shared_ptr<Material> white = materials.lambertian(Vector3f(.73, .73, .73));
+        shared_ptr<Material> green = materials.lambertian(Vector3f(.12, .45, .15));
+        shared_ptr<Material> light = materials.diffuseLight(Vector3f(1, 1, 1), 7);
+        shared_ptr<Material> wall = materials.lambertian(make_shared<ImageTexture>("resource/bricks.jpg"));
+        shared_ptr<Material> e = materials.metal(Vector3f(0.9, 0.6, 0.6));
 
         shared_ptr<Object3D> r1 = make_shared<Rectangle>(Vector3f(555,278,278), Vector3f(0,0,1), Vector3f(0,-1,0), 555, 555, green);
         shared_ptr<Object3D> r2 = make_shared<Rectangle>(Vector3f(0,278,278), Vector3f(0,0,1), Vector3f(0,-1,0), 555, 555, red);
@@ -177,10 +188,10 @@ protected:
         group = new Group(6);
         lights = new Group(1);
 
-        shared_ptr<Material> red = make_shared<Lambertian>(Vector3f(.65, .05, .05));
-        shared_ptr<Material> white = make_shared<Lambertian>(Vector3f(.73, .73, .73));
-        shared_ptr<Material> green = make_shared<Lambertian>(Vector3f(.12, .45, .15));
-        shared_ptr<Material> light = make_shared<DiffuseLight>(Vector3f(1, 1, 1), 7);
+        shared_ptr<Material> red = materials.lambertian(Vector3f(.65, .05, .05));
+        shared_ptr<Material> white = materials.lambertian(Vector3f(.73, .73, .73));
+        shared_ptr<Material> green = materials.lambertian(Vector3f(.12, .45, .15));
+        shared_ptr<Material> light = materials.diffuseLight(Vector3f(1, 1, 1), 7);
 
         shared_ptr<Object3D> r1 = make_shared<Rectangle>(Vector3f(555,278,278), Vector3f(0,0,1), Vector3f(0,-1,0), 555, 555, green);
         shared_ptr<Object3D> r2 = make_shared<Rectangle>(Vector3f(0,278,278), Vector3f(0,0,1), Vector3f(0,-1,0), 555, 555, red);
@@ -191,11 +202,11 @@ protected:
 
         shared_ptr<Object3D> box1 = make_shared<Box>(Vector3f(0, 0, 0), Vector3f(165, 330, 165), white);
         box1 = make_shared<Transform>(box1, Vector3f(1,1,1), Vector3f(265,0,295), 0, 15, 0);
-        box1 = make_shared<ConstantMedium>(box1, 0.01, Vector3f(0, 0, 0));
+        box1 = make_shared<ConstantMedium>(box1, 0.01, materials.isotropic(Vector3f(0, 0, 0)));
 
         shared_ptr<Object3D> box2 = make_shared<Box>(Vector3f(0, 0, 0), Vector3f(165, 165, 165), white);
         box2 = make_shared<Transform>(box2, Vector3f(1,1,1), Vector3f(130,0,65), 0, -18, 0);
-        box2 = make_shared<ConstantMedium>(box2, 0.01, Vector3f(1, 1, 1));
+        box2 = make_shared<ConstantMedium>(box2, 0.01, materials.isotropic(Vector3f(1, 1, 1)));
 
         group->addObject(r1);
         group->addObject(r2);
@@ -212,6 +223,57 @@ protected:
                 DegreesToRadians(angle), aperture, focus_dis);
     }
 
+    // the Cornell box filled with a cloud of turbulent, forward-scattering smoke
+    void cornell_grid_smoke() {
+        std::cout<<"scene: cornell grid smoke"<<std::endl;
+        imgW = 600;
+        imgH = 600;
+        sample_per_pixel = 200;
+        Vector3f lookfrom(278, 278, -800);
+        Vector3f lookat(278, 278, 0);
+        Vector3f vup(0,1,0);
+        float angle = 40.0;
+        float aperture = 0.0;
+        float focus_dis = 10.0;
+
+        max_depth = 50;
+        init_weight = 5;
+
+        background = Vector3f(0,0,0);
+
+        group = new Group(7);
+        lights = new Group(1);
+
+        shared_ptr<Material> red = materials.lambertian(Vector3f(.65, .05, .05));
+        shared_ptr<Material> white = materials.lambertian(Vector3f(.73, .73, .73));
+        shared_ptr<Material> green = materials.lambertian(Vector3f(.12, .45, .15));
+        shared_ptr<Material> light = materials.diffuseLight(Vector3f(1, 1, 1), 7);
+
+        shared_ptr<Object3D> r1 = make_shared<Rectangle>(Vector3f(555,278,278), Vector3f(0,0,1), Vector3f(0,-1,0), 555, 555, green);
+        shared_ptr<Object3D> r2 = make_shared<Rectangle>(Vector3f(0,278,278), Vector3f(0,0,1), Vector3f(0,-1,0), 555, 555, red);
+        shared_ptr<Object3D> l = make_shared<Rectangle>(Vector3f(278,554,278), Vector3f(-1,0,0), Vector3f(0,0,-1), 230, 205, light);
+        shared_ptr<Object3D> r3 = make_shared<Rectangle>(Vector3f(278, 0, 278), Vector3f(-1,0,0),Vector3f(0,0,1), 555, 555, white);
+        shared_ptr<Object3D> r4 = make_shared<Rectangle>(Vector3f(278, 555, 278), Vector3f(-1,0,0),Vector3f(0,0,-1), 555, 555, white);
+        shared_ptr<Object3D> r5 = make_shared<Rectangle>(Vector3f(278, 278, 555), Vector3f(-1,0,0),Vector3f(0,1,0), 555, 555, white);
+
+        NoiseTexture smoke(0.02);
+        shared_ptr<Object3D> cloud = make_shared<GridMedium>(Vector3f(60, 20, 100), Vector3f(495, 400, 480), 64, 64, 64,
+                smoke, 0.02, materials.henyeyGreenstein(Vector3f(0.9, 0.9, 0.9), 0.6));
+
+        group->addObject(r1);
+        group->addObject(r2);
+        group->addObject(l);
+        group->addObject(r3);
+        group->addObject(r4);
+        group->addObject(r5);
+        group->addObject(cloud);
+
+        lights->addObject(l);
+
+        camera = new PerspectiveCamera(lookfrom, lookat, vup, imgW, imgH,
+                DegreesToRadians(angle), aperture, focus_dis);
+    }
+
     void bunny() {
         std::cout<<"scene: bunny"<<std::endl;
         imgW = 600;
@@ -232,10 +294,10 @@ protected:
         group = new Group(7);
         lights = new Group(1);
 
-        shared_ptr<Material> red = make_shared<Lambertian>(Vector3f(.65, .05, .05));
-        shared_ptr<Material> white = make_shared<Lambertian>(Vector3f(.73, .73, .73));
-        shared_ptr<Material> green = make_shared<Lambertian>(Vector3f(.12, .45, .15));
-        shared_ptr<Material> light = make_shared<DiffuseLight>(Vector3f(1, 1, 1), 7);
+        shared_ptr<Material> red = materials.lambertian(Vector3f(.65, .05, .05));
+        shared_ptr<Material> white = materials.lambertian(Vector3f(.73, .73, .73));
+        shared_ptr<Material> green = materials.lambertian(Vector3f(.12, .45, .15));
+        shared_ptr<Material> light = materials.diffuseLight(Vector3f(1, 1, 1), 7);
 
         shared_ptr<Object3D> r1 = make_shared<Rectangle>(Vector3f(555,278,278), Vector3f(0,0,1), Vector3f(0,-1,0), 555, 555, green);
         shared_ptr<Object3D> r2 = make_shared<Rectangle>(Vector3f(0,278,278), Vector3f(0,0,1), Vector3f(0,-1,0), 555, 555, red);
@@ -246,7 +308,7 @@ protected:
 
         Group boxes;
 
-        shared_ptr<Object3D> bunny = make_shared<Mesh>("mesh/bunny.fine.obj", make_shared<Lambertian>(Vector3f(0.79, 0.66, 0.44)));
+        shared_ptr<Object3D> bunny = make_shared<Mesh>("mesh/bunny.fine.obj", materials.lambertian(Vector3f(0.79, 0.66, 0.44)));
         bunny = make_shared<Transform>(bunny, Vector3f(1000, 1000, 1000), Vector3f(278, 100, 278), 0, 180, 0);
         
         group->addObject(r1);
@@ -284,10 +346,10 @@ protected:
         group = new Group(7);
         lights = new Group(1);
 
-        shared_ptr<Material> red = make_shared<Lambertian>(Vector3f(.65, .05, .05));
-        shared_ptr<Material> white = make_shared<Lambertian>(Vector3f(.73, .73, .73));
-        shared_ptr<Material> green = make_shared<Lambertian>(Vector3f(.12, .45, .15));
-        shared_ptr<Material> light = make_shared<DiffuseLight>(Vector3f(1, 1, 1), 7);
+        shared_ptr<Material> red = materials.lambertian(Vector3f(.65, .05, .05));
+        shared_ptr<Material> white = materials.lambertian(Vector3f(.73, .73, .73));
+        shared_ptr<Material> green = materials.lambertian(Vector3f(.12, .45, .15));
+        shared_ptr<Material> light = materials.diffuseLight(Vector3f(1, 1, 1), 7);
 
         shared_ptr<Object3D> r1 = make_shared<Rectangle>(Vector3f(555,278,278), Vector3f(0,0,1), Vector3f(0,-1,0), 555, 555, green);
         shared_ptr<Object3D> r2 = make_shared<Rectangle>(Vector3f(0,278,278), Vector3f(0,0,1), Vector3f(0,-1,0), 555, 555, red);
@@ -304,12 +366,12 @@ protected:
         shared_ptr<Curve> curve = make_shared<BezierCurve>(points);
         shared_ptr<Object3D> vase;
 
-        shared_ptr<Material> vase_img = make_shared<Lambertian>(make_shared<ImageTexture>("resource/vase.png"));
+        shared_ptr<Material> vase_img = materials.lambertian(make_shared<ImageTexture>("resource/vase.png"));
         // vase = make_shared<RevSurface>(curve, vase_img);
         // vase = make_shared<Transform>(vase, Vector3f(30, 30, 30), Vector3f(278, 278, 278), 0, 0, 0);
         // group->addObject(vase);
 
-        vase = make_shared<RevSurface>(curve, make_shared<Metal>(Vector3f(0.8,0.8,0.9)));
+        vase = make_shared<RevSurface>(curve, materials.metal(Vector3f(0.8,0.8,0.9)));
         vase = make_shared<Transform>(vase, Vector3f(30, 30, 30), Vector3f(278, 278, 278), 0, 0, 0);
         group->addObject(vase);
 
@@ -347,7 +409,7 @@ protected:
         lights = new Group(2);
 
         Group boxes1;
-        shared_ptr<Material> ground = make_shared<Lambertian>(Vector3f(0.48, 0.83, 0.53));
+        shared_ptr<Material> ground = materials.lambertian(Vector3f(0.48, 0.83, 0.53));
 
         const int boxes_per_side = 20;
         for (int i = 0; i < boxes_per_side; i++) {
@@ -367,22 +429,22 @@ protected:
         shared_ptr<Object3D> boxes1_bvh = make_shared<BVHnode>(boxes1, 0, 1);
         group->addObject(boxes1_bvh); // 1
         
-        shared_ptr<Material> light = make_shared<DiffuseLight>(Vector3f(1, 1, 1), 7);
+        shared_ptr<Material> light = materials.diffuseLight(Vector3f(1, 1, 1), 7);
         shared_ptr<Object3D> globalLight = make_shared<Rectangle>(Vector3f(273, 554, 279.5), Vector3f(1,0,0), Vector3f(0,0,1), 300, 265, light);
         group->addObject(globalLight); // 2
         lights->addObject(globalLight);
 
         Vector3f center1 = Vector3f(400, 400, 200);
         Vector3f center2 = center1 + Vector3f(30,0,0);
-        shared_ptr<Material> moving_sphere_material = make_shared<Lambertian>(Vector3f(0.7, 0.3, 0.1));
+        shared_ptr<Material> moving_sphere_material = materials.lambertian(Vector3f(0.7, 0.3, 0.1));
         shared_ptr<Object3D> moving_sphere = make_shared<MovingSphere>(center1, center2, 0, 1, 50, moving_sphere_material);
         group->addObject(moving_sphere); // 3
 
-        shared_ptr<Material> d = make_shared<Dielectric>(1.5);
+        shared_ptr<Material> d = materials.dielectric(1.5);
         shared_ptr<Object3D> d_sphere = make_shared<Sphere>(Vector3f(260, 150, 45), 50, d);
         group->addObject(d_sphere); // 4
 
-        shared_ptr<Object3D> bunny = make_shared<Mesh>("mesh/bunny.fine.obj", make_shared<Lambertian>(Vector3f(0.79, 0.66, 0.44)));
+        shared_ptr<Object3D> bunny = make_shared<Mesh>("mesh/bunny.fine.obj", materials.lambertian(Vector3f(0.79, 0.66, 0.44)));
         bunny = make_shared<Transform>(bunny, Vector3f(700, 700, 700), Vector3f(180, 90, -70), 0, 150, 0);
         group->addObject(bunny);
 
@@ -417,34 +479,35 @@ protected:
         points.push_back(Vector3f( 0.000000, -2.458802, 0.0 ));
 
         shared_ptr<Curve> curve = make_shared<BsplineCurve>(points);
-        shared_ptr<Material> m = make_shared<Metal>(Vector3f(0.8,0.8,0.9),0.2);
-        shared_ptr<Object3D> wineglass = make_shared<RevSurface>(curve, m, true);
+        shared_ptr<Material> m = materials.metal(Vector3f(0.8,0.8,0.9),0.2);
+        float tolerance = RevSurface::screenTolerance(DegreesToRadians(angle), imgH, (Vector3f(30, 200, 125) - lookfrom).length(), 30);
+        shared_ptr<Object3D> wineglass = make_shared<RevSurface>(curve, m, true, tolerance);
         wineglass = make_shared<Transform>(wineglass, Vector3f(30, 30, 30), Vector3f(30, 200, 125), 0, 0, 0);
         group->addObject(wineglass);
 
-        // shared_ptr<Material> m = make_shared<Metal>(Vector3f(0.8,0.8,0.9),1.0);
+        // shared_ptr<Material> m = materials.metal(Vector3f(0.8,0.8,0.9),1.0);
         // shared_ptr<Object3D> m_sphere = make_shared<Sphere>(Vector3f(0, 150, 145), 50, m);
         // group->addObject(m_sphere); // 5
 
         shared_ptr<Object3D> boundary = make_shared<Sphere>(Vector3f(360,150,145), 70, d);
         group->addObject(boundary); // 6
-        boundary = make_shared<ConstantMedium>(boundary, 0.2, Vector3f(0.2, 0.4, 0.9));
+        boundary = make_shared<ConstantMedium>(boundary, 0.2, materials.isotropic(Vector3f(0.2, 0.4, 0.9)));
         group->addObject(boundary); // 7
         boundary = make_shared<Sphere>(Vector3f(0,0,0), 5000, d);
-        boundary = make_shared<ConstantMedium>(boundary, 0.0001, Vector3f(1, 1, 1));
+        boundary = make_shared<ConstantMedium>(boundary, 0.0001, materials.isotropic(Vector3f(1, 1, 1)));
         group->addObject(boundary); // 8
 
         shared_ptr<Texture> etext = make_shared<ImageTexture>("resource/sunmap.jpg");
-        shared_ptr<Material> emat = make_shared<DiffuseLight>(etext, 5);
+        shared_ptr<Material> emat = materials.diffuseLight(etext, 5);
         shared_ptr<Object3D> esphere = make_shared<Sphere>(Vector3f(400,200,400), 100, emat);
         group->addObject(esphere); // 9
         shared_ptr<Texture> pertext = make_shared<NoiseTexture>(0.1);
-        shared_ptr<Material> per_lam = make_shared<Lambertian>(pertext);
+        shared_ptr<Material> per_lam = materials.lambertian(pertext);
         shared_ptr<Object3D> per_sphere = make_shared<Sphere>(Vector3f(220,280,300),80,per_lam);
         group->addObject(per_sphere);
         
         Group boxes2;
-        shared_ptr<Material> white = make_shared<Lambertian>(Vector3f(0.73, 0.73, 0.73));
+        shared_ptr<Material> white = materials.lambertian(Vector3f(0.73, 0.73, 0.73));
         int ns = 1000;
         shared_ptr<Object3D> wsphere = nullptr;
         for (int j = 0; j < ns; j++) {
@@ -477,22 +540,18 @@ protected:
 
         background = Vector3f(0,0,0);
 
-        group = new Group(7);
-        lights = new Group(5);
-
-        shared_ptr<Material> head = make_shared<DiffuseLight>(make_shared<ImageTexture>("resource/skyboxes3/1.jpg"), 1.0);
-        shared_ptr<Material> behind = make_shared<DiffuseLight>(make_shared<ImageTexture>("resource/skyboxes3/2.jpg"), 1.0);
-        shared_ptr<Material> left = make_shared<DiffuseLight>(make_shared<ImageTexture>("resource/skyboxes3/3.jpg"), 1.0);
-        shared_ptr<Material> front = make_shared<DiffuseLight>(make_shared<ImageTexture>("resource/skyboxes3/4.jpg"), 1.0);
-        shared_ptr<Material> right = make_shared<DiffuseLight>(make_shared<ImageTexture>("resource/skyboxes3/5.jpg"), 1.0);
-        shared_ptr<Material> foot = make_shared<DiffuseLight>(make_shared<ImageTexture>("resource/skyboxes3/6.jpg"), 1.0);
-
-        shared_ptr<Object3D> r1 = make_shared<Rectangle>(Vector3f(555,278,277.5), Vector3f(0,0,1), Vector3f(0,1,0), 555, 555, left);
-        shared_ptr<Object3D> r2 = make_shared<Rectangle>(Vector3f(0,278,277.5), Vector3f(0,0,-1), Vector3f(0,1,0), 555, 555, right);
-        shared_ptr<Object3D> r3 = make_shared<Rectangle>(Vector3f(277.5, 0.5, 278), Vector3f(0,0,1), Vector3f(1,0,0), 555, 555, foot);
-        shared_ptr<Object3D> r4 = make_shared<Rectangle>(Vector3f(278, 555, 278), Vector3f(0,0,1), Vector3f(-1,0,0), 555, 555, head);
-        shared_ptr<Object3D> r5 = make_shared<Rectangle>(Vector3f(277.5, 278, 555), Vector3f(-1,0,0),Vector3f(0,1,0), 555, 555, front);
-        shared_ptr<Object3D> r6 = make_shared<Rectangle>(Vector3f(277.5, 277.75, 0), Vector3f(1,0,0),Vector3f(0,1,0), 555, 555, behind);
+        group = new Group(1);
+        lights = new Group();
+
+        // the skybox is an environment at infinity, faces as seen from the center
+        std::vector<EnvironmentFace> sky;
+        sky.push_back(EnvironmentFace(make_shared<ImageTexture>("resource/skyboxes3/3.jpg"), Vector3f(1,0,0), Vector3f(0,0,1), Vector3f(0,1,0)));
+        sky.push_back(EnvironmentFace(make_shared<ImageTexture>("resource/skyboxes3/5.jpg"), Vector3f(-1,0,0), Vector3f(0,0,-1), Vector3f(0,1,0)));
+        sky.push_back(EnvironmentFace(make_shared<ImageTexture>("resource/skyboxes3/6.jpg"), Vector3f(0,-1,0), Vector3f(0,0,1), Vector3f(1,0,0)));
+        sky.push_back(EnvironmentFace(make_shared<ImageTexture>("resource/skyboxes3/1.jpg"), Vector3f(0,1,0), Vector3f(0,0,1), Vector3f(-1,0,0)));
+        sky.push_back(EnvironmentFace(make_shared<ImageTexture>("resource/skyboxes3/4.jpg"), Vector3f(0,0,1), Vector3f(-1,0,0), Vector3f(0,1,0)));
+        sky.push_back(EnvironmentFace(make_shared<ImageTexture>("resource/skyboxes3/2.jpg"), Vector3f(0,0,-1), Vector3f(1,0,0), Vector3f(0,1,0)));
+        environment = make_shared<Environment>(sky, 1.0);
 
         std::vector<Vector3f> points;
         points.push_back(Vector3f( 0, 6, 0 ));
@@ -500,24 +559,11 @@ protected:
         points.push_back(Vector3f( -3, 0, 0 ));
         points.push_back(Vector3f( 0, -0.5, 0 ));
         shared_ptr<Curve> curve = make_shared<BezierCurve>(points);
-        shared_ptr<Object3D> drop = make_shared<RevSurface>(curve, make_shared<Metal>(Vector3f(0.8,0.8,0.8),0.0),true);
+        float tolerance = RevSurface::screenTolerance(DegreesToRadians(angle), imgH, (Vector3f(278, 220, 278) - lookfrom).length(), 30);
+        shared_ptr<Object3D> drop = make_shared<RevSurface>(curve, materials.metal(Vector3f(0.8,0.8,0.8),0.0),true, tolerance);
         drop = make_shared<Transform>(drop, Vector3f(30, 30, 30), Vector3f(278, 220, 278), 0, 0, 0);
         group->addObject(drop);
 
-        group->addObject(r1);
-        group->addObject(r2);
-        group->addObject(r3);
-        group->addObject(r4);
-        group->addObject(r5);
-        group->addObject(r6);
-
-        lights->addObject(r1);
-        lights->addObject(r2);
-        lights->addObject(r3);
-        lights->addObject(r4);
-        lights->addObject(r5);
-        lights->addObject(r6);
-
         
         camera = new PerspectiveCamera(lookfrom, lookat, vup, imgW, imgH,
             DegreesToRadians(angle), aperture, focus_dis, 0.0, 1.0);
@@ -540,41 +586,23 @@ protected:
 
         background = Vector3f(0,0,0);
 
-        group = new Group(7);
-        lights = new Group(5);
-
-        shared_ptr<Material> head = make_shared<DiffuseLight>(make_shared<ImageTexture>("resource/skyboxes2/1.png"), 1.0);
-        shared_ptr<Material> behind = make_shared<DiffuseLight>(make_shared<ImageTexture>("resource/skyboxes2/2.png"), 1.0);
-        shared_ptr<Material> left = make_shared<DiffuseLight>(make_shared<ImageTexture>("resource/skyboxes2/3.png"), 1.0);
-        shared_ptr<Material> front = make_shared<DiffuseLight>(make_shared<ImageTexture>("resource/skyboxes2/4.png"), 1.0);
-        shared_ptr<Material> right = make_shared<DiffuseLight>(make_shared<ImageTexture>("resource/skyboxes2/5.png"), 1.0);
-        shared_ptr<Material> foot = make_shared<DiffuseLight>(make_shared<ImageTexture>("resource/skyboxes2/6.png"), 1.0);
-
-        shared_ptr<Object3D> r1 = make_shared<Rectangle>(Vector3f(555,278,277.5), Vector3f(0,0,1), Vector3f(0,1,0), 555, 555, left);
-        shared_ptr<Object3D> r2 = make_shared<Rectangle>(Vector3f(0,278,277.5), Vector3f(0,0,-1), Vector3f(0,1,0), 555, 555, right);
-        shared_ptr<Object3D> r3 = make_shared<Rectangle>(Vector3f(277.5, 0.5, 278), Vector3f(0,0,1), Vector3f(1,0,0), 555, 555, foot);
-        shared_ptr<Object3D> r4 = make_shared<Rectangle>(Vector3f(278, 555, 278), Vector3f(0,0,1), Vector3f(-1,0,0), 555, 555, head);
-        shared_ptr<Object3D> r5 = make_shared<Rectangle>(Vector3f(277.5, 278, 555), Vector3f(-1,0,0),Vector3f(0,1,0), 555, 555, front);
-        shared_ptr<Object3D> r6 = make_shared<Rectangle>(Vector3f(277.5, 277.75, 0), Vector3f(1,0,0),Vector3f(0,1,0), 555, 555, behind);
-
-        shared_ptr<Object3D> dragon = make_shared<Mesh>("mesh/fixed.perfect.dragon.100K.0.07.obj", make_shared<Metal>(Vector3f(0, 0.545, 0.545), 0.5));
+        group = new Group(1);
+        lights = new Group();
+
+        // the skybox is an environment at infinity, faces as seen from the center
+        std::vector<EnvironmentFace> sky;
+        sky.push_back(EnvironmentFace(make_shared<ImageTexture>("resource/skyboxes2/3.png"), Vector3f(1,0,0), Vector3f(0,0,1), Vector3f(0,1,0)));
+        sky.push_back(EnvironmentFace(make_shared<ImageTexture>("resource/skyboxes2/5.png"), Vector3f(-1,0,0), Vector3f(0,0,-1), Vector3f(0,1,0)));
+        sky.push_back(EnvironmentFace(make_shared<ImageTexture>("resource/skyboxes2/6.png"), Vector3f(0,-1,0), Vector3f(0,0,1), Vector3f(1,0,0)));
+        sky.push_back(EnvironmentFace(make_shared<ImageTexture>("resource/skyboxes2/1.png"), Vector3f(0,1,0), Vector3f(0,0,1), Vector3f(-1,0,0)));
+        sky.push_back(EnvironmentFace(make_shared<ImageTexture>("resource/skyboxes2/4.png"), Vector3f(0,0,1), Vector3f(-1,0,0), Vector3f(0,1,0)));
+        sky.push_back(EnvironmentFace(make_shared<ImageTexture>("resource/skyboxes2/2.png"), Vector3f(0,0,-1), Vector3f(1,0,0), Vector3f(0,1,0)));
+        environment = make_shared<Environment>(sky, 1.0);
+
+        shared_ptr<Object3D> dragon = make_shared<Mesh>("mesh/fixed.perfect.dragon.100K.0.07.obj", materials.metal(Vector3f(0, 0.545, 0.545), 0.5));
         dragon = make_shared<Transform>(dragon, Vector3f(150, 150, 150), Vector3f(278, 278, 278), 0, 180, 0);
         group->addObject(dragon);
 
-        group->addObject(r1);
-        group->addObject(r2);
-        group->addObject(r3);
-        group->addObject(r4);
-        group->addObject(r5);
-        group->addObject(r6);
-
-        lights->addObject(r1);
-        lights->addObject(r2);
-        lights->addObject(r3);
-        lights->addObject(r4);
-        lights->addObject(r5);
-        lights->addObject(r6);
-
         
         camera = new PerspectiveCamera(lookfrom, lookat, vup, imgW, imgH,
             DegreesToRadians(angle), aperture, focus_dis, 0.0, 1.0);
@@ -8,6 +8,7 @@
 class Camera;
 class Light;
 class Material;
+class MaterialTable;
 class Texture;
 class Object3D;
 class Group;
@@ -20,6 +21,7 @@ class Mesh;
 class MovingSphere;
 class Curve;
 class RevSurface;
+class Environment;
 
 using std::shared_ptr;
 
@@ -53,6 +55,11 @@ public:
         return background_color;
     }
 
+    // nullptr unless the Background block names an environment map
+    Environment *getEnvironment() const {
+        return environment.get();
+    }
+
     // int getNumLights() const {
     //     return num_lights;
     // }
@@ -133,11 +140,13 @@ private:
     float init_weight;
     Camera *camera;
     Vector3f background_color;
+    shared_ptr<Environment> environment;
     // int num_lights;
     // Light **lights;
     // Light *ambientLight;
     int num_materials;
     shared_ptr<Material>* materials;
+    MaterialTable *material_table;  // owns the records behind materials
     shared_ptr<Material> current_material;
     int num_textures;
     shared_ptr<Texture> *textures;
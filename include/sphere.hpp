@@ -24,29 +24,22 @@ public:
     ~Sphere() override = default;
 
     bool intersect(const Ray &r, Hit &h, float tmin = 0.0, float tmax = infinity ) const override {
-        Vector3f oc = r.getOrigin() - center;
-        auto a = r.getDirection().squaredLength();
-        auto half_b = Vector3f::dot(oc, r.getDirection());
-        auto c = oc.squaredLength() - radius*radius;
-
-        auto discriminant = half_b*half_b - a*c;
-        if (discriminant < 0) return false;
-        auto sqrtd = sqrt(discriminant);
-
-        // Find the nearest root that lies in the acceptable range.
-        auto root = (-half_b - sqrtd) / a;
-        if (root < tmin || tmax < root) {
-            root = (-half_b + sqrtd) / a;
-            if (root < tmin || tmax < root)
-                return false;
-        }
+        float root;
+        if (!hitRoot(r, tmin, tmax, root))
+            return false;
         Vector3f intersec_point=r.pointAtParameter(root);
         Vector3f n=(intersec_point-center)/radius;
-        h.set(root, material, n, r);
+        h.set(root, material.get(), n, r);
         get_sphere_uv(n, h.u, h.v);
+        h.uv_rate = 1 / (M_PI * radius);
         return true;
     }
 
+    bool occluded(const Ray &r, float tmin = 0.0, float tmax = infinity) const override {
+        float root;
+        return hitRoot(r, tmin, tmax, root);
+    }
+
     bool bounding_box(double time0, double time1, AABB& output_box) const override {
         output_box = AABB(
             center - Vector3f(radius, radius, radius),
@@ -54,18 +47,24 @@ public:
         return true;
     }
 
-    double pdf_value(const Vector3f& o, const Vector3f& v) const {
-        Hit rec;
-        if (!this->intersect(Ray(o, v), rec, 0.001, infinity))
+    // Uniform over the cone of directions from o that see the sphere: v is
+    // inside if its angle to the center is within theta_max, no root solving.
+    double pdf_value(const Vector3f& o, const Vector3f& v) const override {
+        Vector3f oc = center - o;
+        double distance_squared = oc.squaredLength();
+        double radius_squared = radius*radius;
+        if (distance_squared <= radius_squared) return 0;
+        double cosine = Vector3f::dot(oc, v);
+        if (cosine <= 0 || cosine*cosine < (distance_squared - radius_squared) * v.squaredLength())
             return 0;
+        return 1 / (2*M_PI*oneMinusCosThetaMax(radius_squared / distance_squared));
+    }
 
-        auto cos_theta_max = sqrt(1 - radius*radius/(center-o).squaredLength());
-        auto solid_angle = 2*M_PI*(1-cos_theta_max);
-
-        return  1 / solid_angle;
+    double area() const override {
+        return 4 * M_PI * radius * radius;
     }
 
-    Vector3f random(const Vector3f& o) const {
+    Vector3f random(const Vector3f& o) const override {
         Vector3f direction = center - o;
         auto distance_squared = direction.squaredLength();
         ONB uvw;
@@ -76,16 +75,41 @@ public:
 protected:
     Vector3f center;
     float radius;
+
+    // Find the nearest root that lies in the acceptable range.
+    bool hitRoot(const Ray &r, float tmin, float tmax, float &root) const {
+        Vector3f oc = r.getOrigin() - center;
+        auto a = r.getDirection().squaredLength();
+        auto half_b = Vector3f::dot(oc, r.getDirection());
+        auto c = oc.squaredLength() - radius*radius;
+
+        auto discriminant = half_b*half_b - a*c;
+        if (discriminant < 0) return false;
+        auto sqrtd = sqrt(discriminant);
+
+        root = (-half_b - sqrtd) / a;
+        if (root < tmin || tmax < root) {
+            root = (-half_b + sqrtd) / a;
+            if (root < tmin || tmax < root)
+                return false;
+        }
+        return true;
+    }
     static void get_sphere_uv(const Vector3f& p, float& u, float& v)  {
         auto phi = atan2(p.z(), p.x());
         auto theta = asin(p.y());
         u = 1-(phi + M_PI) / (2*M_PI);
         v = (theta + M_PI/2) / M_PI;
     }
+    // 1 - cos(theta_max) for sin^2(theta_max) = x, without the cancellation
+    // of 1 - sqrt(1 - x) for small, distant spheres
+    static double oneMinusCosThetaMax(double x) {
+        return x / (1 + sqrt(1 - x));
+    }
     static Vector3f random_to_sphere(double radius, double distance_squared) {
         auto r1 = random_double();
         auto r2 = random_double();
-        auto z = 1 + r2*(sqrt(1-radius*radius/distance_squared) - 1);
+        auto z = 1 - r2*oneMinusCosThetaMax(radius*radius/distance_squared);
 
         auto phi = 2*M_PI*r1;
         auto x = cos(phi)*sqrt(1-z*z);
@@ -3,16 +3,30 @@
 
 #include "perlin.hpp"
 #include "utils.hpp"
+#include "mapped_file.hpp"
+#include "mip_file.hpp"
+#include "texture_cache.hpp"
 
 
 
 #include <vecmath.h>
 #include <iostream>
+#include <vector>
 
+// tiles each thread keeps in front of the TextureCache, a power of two
+#define TEXTURE_TILE_SLOTS 64
 
 class Texture  {
     public:
+        virtual ~Texture() = default;
+
         virtual Vector3f value(double u, double v, const Vector3f& p) const = 0;
+
+        // The texture averaged over a footprint about width wide in (u, v)
+        // around the point; textures without prefiltered levels point sample.
+        virtual Vector3f filtered(double u, double v, const Vector3f& p, float width) const {
+            return value(u, v, p);
+        }
 };
 
 
@@ -53,6 +67,16 @@ class CheckerTexture : public Texture {
             return isEven ? even->value(u, v, p) : odd->value(u, v, p);
         }
 
+        virtual Vector3f filtered(double u, double v, const Vector3f& p, float width) const override {
+            auto xInteger = static_cast<int>(std::floor(inv_scale * p.x()));
+            auto yInteger = static_cast<int>(std::floor(inv_scale * p.y()));
+            auto zInteger = static_cast<int>(std::floor(inv_scale * p.z()));
+
+            bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
+
+            return isEven ? even->filtered(u, v, p, width) : odd->filtered(u, v, p, width);
+        }
+
     public:
         shared_ptr<Texture> odd;
         shared_ptr<Texture> even;
@@ -78,23 +102,45 @@ class NoiseTexture : public Texture {
 };
 
 
+// An image as a mip pyramid of tiles (see mip_file.hpp), built when the
+// image is first loaded and kept in a memory-mapped mip file next to it, or
+// in memory if that cannot be written. Only the tiles that lookups touch are
+// decoded, into linear floats in the global TextureCache, so the resident
+// size of many large textures is bounded by the cache budget. Each thread
+// also keeps its last few tiles, which makes repeated lookups lock-free.
+// value() point samples level 0 as before; filtered() is bilinear, and
+// trilinear between the two levels matching the footprint.
 class ImageTexture : public Texture {
     public:
-        const static int bytes_per_pixel = 3;
-
-        ImageTexture()
-          : data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
+        ImageTexture() : header(), base(nullptr), id(0) {}
 
+        // 8-bit images are linearized with gamma 2, Radiance .hdr images are
+        // read as linear floats. A mip file (MIP_FILE_EXTENSION) can be
+        // given directly.
         ImageTexture(const char* filename);
 
-        ~ImageTexture();
+        ImageTexture(const ImageTexture&) = delete;
+        ImageTexture& operator=(const ImageTexture&) = delete;
 
         virtual Vector3f value(double u, double v, const Vector3f& p) const override;
 
+        virtual Vector3f filtered(double u, double v, const Vector3f& p, float width) const override;
+
+        int getWidth() const { return base ? header.width[0] : 0; }
+        int getHeight() const { return base ? header.height[0] : 0; }
+        int getLevels() const { return base ? header.levels : 0; }
+
     private:
-        unsigned char *data;
-        int width, height;
-        int bytes_per_scanline;
+        MipFileHeader header;
+        MappedFile file;
+        const char* base;
+        uint32_t id;
+
+        bool open(const char* data, size_t size);
+        static bool build(const char* filename, uint64_t source_size, int64_t source_mtime, std::vector<char>& out);
+        const TextureTile& tile(int level, int tx, int ty) const;
+        Vector3f texel(int level, int x, int y) const;
+        Vector3f bilinear(int level, double u, double v) const;
 };
 
 
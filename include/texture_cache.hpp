@@ -0,0 +1,122 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "mip_file.hpp"
+#include "utils.hpp"
+
+// default memory cap of the decoded tiles of all image textures
+#define TEXTURE_CACHE_BUDGET_MB 512
+// independently locked parts of the cache, each with its share of the budget
+#define TEXTURE_CACHE_SHARDS 16
+
+// One decoded tile of a mip level: linear RGB floats, row-major.
+struct TextureTile {
+    float texels[TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 3];
+};
+
+// Process-wide LRU cache of decoded texture tiles under a memory budget.
+// Tiles are keyed by a 64-bit key (texture id, level, tile) and decoded by
+// the caller on a miss; the least recently used ones are dropped once a
+// shard holds more than its share of the budget. Tiles are handed out as
+// shared_ptr, so a tile evicted while another thread reads it lives on
+// until that thread lets go.
+class TextureCache {
+public:
+    static TextureCache &global() {
+        static TextureCache cache;
+        return cache;
+    }
+
+    void setBudget(size_t bytes) {
+        budget_bytes = bytes;
+        for (Shard &s : shards) {
+            std::lock_guard<std::mutex> guard(s.lock);
+            trim(s);
+        }
+    }
+    size_t budget() const { return budget_bytes; }
+
+    // Directory that receives the mip files of images, empty to write them
+    // next to the images. Set it before loading textures.
+    void setMipDirectory(const std::string &dir) { mip_directory = dir; }
+    const std::string &mipDirectory() const { return mip_directory; }
+
+    // ids start at 1, a zero key is never used
+    uint32_t newTextureId() { return ++next_id; }
+
+    size_t residentBytes() {
+        size_t bytes = 0;
+        for (Shard &s : shards) {
+            std::lock_guard<std::mutex> guard(s.lock);
+            bytes += s.lru.size() * sizeof(TextureTile);
+        }
+        return bytes;
+    }
+
+    // The tile for key, decoded by load(TextureTile &) if it is not cached.
+    // Decoding runs outside the lock; two threads missing the same tile at
+    // once both decode it and one copy is kept.
+    template <typename Load>
+    shared_ptr<const TextureTile> get(uint64_t key, Load &load) {
+        Shard &s = shards[shardOf(key)];
+        {
+            std::lock_guard<std::mutex> guard(s.lock);
+            auto it = s.index.find(key);
+            if (it != s.index.end()) {
+                s.lru.splice(s.lru.begin(), s.lru, it->second);
+                return it->second->second;
+            }
+        }
+        shared_ptr<TextureTile> tile = make_shared<TextureTile>();
+        load(*tile);
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto it = s.index.find(key);
+        if (it != s.index.end()) return it->second->second;
+        s.lru.push_front(std::make_pair(key, shared_ptr<const TextureTile>(tile)));
+        s.index[key] = s.lru.begin();
+        trim(s);
+        return tile;
+    }
+
+private:
+    typedef std::list<std::pair<uint64_t, shared_ptr<const TextureTile>>> LRUList;
+
+    struct Shard {
+        std::mutex lock;
+        LRUList lru;  // most recently used first
+        std::unordered_map<uint64_t, LRUList::iterator> index;
+    };
+
+    Shard shards[TEXTURE_CACHE_SHARDS];
+    std::atomic<size_t> budget_bytes;
+    std::atomic<uint32_t> next_id;
+    std::string mip_directory;
+
+    TextureCache() : budget_bytes((size_t)TEXTURE_CACHE_BUDGET_MB << 20), next_id(0) {}
+
+    // drops the least recently used tiles of s beyond its share, keeping one
+    void trim(Shard &s) {
+        size_t cap = std::max(budget_bytes / TEXTURE_CACHE_SHARDS / sizeof(TextureTile), (size_t)1);
+        while (s.lru.size() > cap) {
+            s.index.erase(s.lru.back().first);
+            s.lru.pop_back();
+        }
+    }
+
+    static int shardOf(uint64_t key) {
+        key ^= key >> 29;
+        key *= 0xbf58476d1ce4e5b9ull;
+        return (int)(key >> 59) % TEXTURE_CACHE_SHARDS;
+    }
+};
+
+#endif // TEXTURE_CACHE_H
@@ -34,11 +34,51 @@ public:
         Ray tr(trSource, trDirection);
         bool inter = o->intersect(tr, h, tmin, tmax);
         if (inter) {
+            float uv_rate = h.uv_rate;
             h.set(h.getT(), h.getMaterial(), transformDirection(transform_ray.transposed(), h.getNormal()).normalized(), r);
+            h.uv_rate = uv_rate * uvScale();
         }
         return inter;
     }
     
+    unsigned intersectPacket(RayPacket &packet, Hit *hits, unsigned active) const override {
+        RayPacket local;
+        for (int i = 0; i < packet.size; i++) {
+            local.rays[i] = Ray(transformPoint(transform_ray, packet.rays[i].getOrigin()),
+                                transformDirection(transform_ray, packet.rays[i].getDirection()),
+                                packet.rays[i].getTime());
+        }
+        local.setup(packet.size, packet.tmin);
+        for (int i = 0; i < packet.size; i++) local.tmax[i] = packet.tmax[i];
+
+        unsigned hit = o->intersectPacket(local, hits, active);
+        if (hit) {
+            Matrix4f normal_matrix = transform_ray.transposed();
+            float uv_scale = uvScale();
+            for (int i = 0; i < packet.size; i++) {
+                if (!(hit >> i & 1u)) continue;
+                float uv_rate = hits[i].uv_rate;
+                hits[i].set(hits[i].getT(), hits[i].getMaterial(),
+                            transformDirection(normal_matrix, hits[i].getNormal()).normalized(), packet.rays[i]);
+                hits[i].uv_rate = uv_rate * uv_scale;
+                packet.tmax[i] = local.tmax[i];
+            }
+        }
+        return hit;
+    }
+
+    bool occluded(const Ray &r, float tmin = 0.0, float tmax = infinity) const override {
+        Vector3f trSource = transformPoint(transform_ray, r.getOrigin());
+        Vector3f trDirection = transformDirection(transform_ray, r.getDirection());
+        return o->occluded(Ray(trSource, trDirection, r.getTime()), tmin, tmax);
+    }
+
+    double transmittance(const Ray &r, float tmin = 0.0, float tmax = infinity) const override {
+        Vector3f trSource = transformPoint(transform_ray, r.getOrigin());
+        Vector3f trDirection = transformDirection(transform_ray, r.getDirection());
+        return o->transmittance(Ray(trSource, trDirection, r.getTime()), tmin, tmax);
+    }
+
     bool bounding_box(double time0, double time1, AABB& output_box) const override {
         o->bounding_box(time0, time1, output_box);
         Vector3f v[8];
@@ -57,7 +97,7 @@ public:
             float tmax = v[0][i];
             for (int j=1; j<8; j++) {
                 tmin = fmin(tmin, v[j][i]);
-                tmax = fmax(tmin, v[j][i]);
+                tmax = fmax(tmax, v[j][i]);
             }
             v[0][i] = tmin;
             v[7][i] = tmax;
@@ -67,7 +107,31 @@ public:
 		return true;
 	}
 
+    // Light sampling happens in object space. Directions map through the
+    // inverse linear part B, which stretches solid angle around a unit
+    // direction w by |det B| / |B w|^3.
+    double pdf_value(const Vector3f &origin, const Vector3f &v) const override {
+        Vector3f trDirection = transformDirection(transform_ray, v);
+        double stretch = v.length() / trDirection.length();
+        double jacobian = fabs(transform_ray.getSubmatrix3x3(0, 0).determinant()) * stretch * stretch * stretch;
+        return o->pdf_value(transformPoint(transform_ray, origin), trDirection) * jacobian;
+    }
+
+    Vector3f random(const Vector3f &origin) const override {
+        return transformDirection(transform, o->random(transformPoint(transform_ray, origin)));
+    }
+
+    // exact for uniform scaling
+    double area() const override {
+        return o->area() * pow(fabs(transform.getSubmatrix3x3(0, 0).determinant()), 2.0 / 3);
+    }
+
 protected:
+    // object lengths per world length, also exact for uniform scaling only
+    float uvScale() const {
+        return cbrt(fabs(transform_ray.getSubmatrix3x3(0, 0).determinant()));
+    }
+
     shared_ptr<Object3D> o; //un-transformed object
     Matrix4f transform;
     Matrix4f transform_ray;
@@ -36,32 +36,23 @@ public:
 		// }
         // return false;
 
-		Vector3f o(r.getOrigin()), dir(r.getDirection());
-        Vector3f v0v1 = vertices[1] - vertices[0];
-        Vector3f v0v2 = vertices[2] - vertices[0];
-        Vector3f pvec = Vector3f::cross(dir, v0v2);
-        float det = Vector3f::dot(v0v1, pvec);
-        // IF CULLING
-        // if (det < FLT_EPSILON) return false;
-        // ray and triangle are parallel if det is close to 0
-        if (fabs(det) < 1e-10) return false;
-        float invDet = 1 / det;
-        Vector3f tvec = o - vertices[0];
-        float u = Vector3f::dot(tvec, pvec) * invDet;
-        if (u < 0 || u > 1) return false;
-        Vector3f qvec = Vector3f::cross(tvec, v0v1);
-        float v = Vector3f::dot(dir, qvec) * invDet;
-        if (v < 0 || u + v > 1) return false;
-        float t = Vector3f::dot(v0v2, qvec) * invDet;
+		float t, u, v;
+        if (!hitMT(r, t, u, v)) return false;
         if (t <= 0 || t > h.getT()) return false;
-        Vector3f p(o + dir * t);
-        getUV(p, u, v);
+        // shading data straight from the barycentrics, only for accepted hits
 		h.u = u;
 		h.v = v;
-        h.set(t, material, getNorm(p), r);
+        getUV(u, v, h.u, h.v);
+        h.set(t, material.get(), getNorm(u, v), r);
+        h.uv_rate = uvRate();
         return true;
 	}
 
+	bool occluded(const Ray& r, float tmin = 0.0, float tmax = infinity) const override {
+		float t, u, v;
+		return hitMT(r, t, u, v) && t >= tmin && t <= tmax;
+	}
+
 	bool bounding_box(double time0, double time1, AABB& output_box) const override {
 
 		Vector3f p_min = vertices[0];
@@ -78,6 +69,21 @@ public:
 		return true;
 	}
 
+	double area() const override {
+		return 0.5 * Vector3f::cross(vertices[1] - vertices[0], vertices[2] - vertices[0]).length();
+	}
+
+	// uniform area sampling, as a light
+	double pdf_value(const Vector3f& o, const Vector3f& v) const override {
+		float t, u, w;
+		if (!hitMT(Ray(o, v), t, u, w) || t <= 0.001) return 0;
+		return triangle_pdf(1, Vector3f::cross(vertices[1] - vertices[0], vertices[2] - vertices[0]), v, t);
+	}
+
+	Vector3f random(const Vector3f& o) const override {
+		return random_on_triangle(vertices[0], vertices[1], vertices[2]) - o;
+	}
+
 	void setVNorm(const Vector3f& anorm, const Vector3f& bnorm,
                   const Vector3f& cnorm) {
         an = anorm;
@@ -103,25 +109,48 @@ protected:
     Vector3f an, bn, cn;
     Vector3f bound[2];
     float d;
+
+    // Moller-Trumbore: ray parameter t and barycentrics u, v of the hit with
+    // the triangle's plane, false if the ray misses the triangle.
+    bool hitMT(const Ray& r, float& t, float& u, float& v) const {
+		Vector3f o(r.getOrigin()), dir(r.getDirection());
+        Vector3f v0v1 = vertices[1] - vertices[0];
+        Vector3f v0v2 = vertices[2] - vertices[0];
+        Vector3f pvec = Vector3f::cross(dir, v0v2);
+        float det = Vector3f::dot(v0v1, pvec);
+        // IF CULLING
+        // if (det < FLT_EPSILON) return false;
+        // ray and triangle are parallel if det is close to 0
+        if (fabs(det) < 1e-10) return false;
+        float invDet = 1 / det;
+        Vector3f tvec = o - vertices[0];
+        u = Vector3f::dot(tvec, pvec) * invDet;
+        if (u < 0 || u > 1) return false;
+        Vector3f qvec = Vector3f::cross(tvec, v0v1);
+        v = Vector3f::dot(dir, qvec) * invDet;
+        if (v < 0 || u + v > 1) return false;
+        t = Vector3f::dot(v0v2, qvec) * invDet;
+        return true;
+    }
     
-	Vector3f getNorm(const Vector3f& p) const {
+	// u, v are the Moller-Trumbore barycentrics, the weights of vertices 1 and 2
+	Vector3f getNorm(float u, float v) const {
         if (!nSet) return normal;
-        Vector3f va = (vertices[0] - p), vb = (vertices[1] - p), vc = (vertices[2] - p);
-        float ra = Vector3f::cross(vb, vc).length(),
-              rb = Vector3f::cross(vc, va).length(),
-              rc = Vector3f::cross(va, vb).length();
-        return (ra * an + rb * bn + rc * cn).normalized();
+        return ((1 - u - v) * an + u * bn + v * cn).normalized();
+    }
+
+    // square root of the ratio of the areas in (u, v) and in space
+    float uvRate() const {
+        double uv_area = tSet ? fabs((bt.x() - at.x()) * (ct.y() - at.y()) - (bt.y() - at.y()) * (ct.x() - at.x())) : 1;
+        double cross = Vector3f::cross(vertices[1] - vertices[0], vertices[2] - vertices[0]).length();
+        return cross > 0 ? sqrt(uv_area / cross) : 0;
     }
 
-    void getUV(const Vector3f& p, float& u, float& v) const {
+    void getUV(float u, float v, float& tu, float& tv) const {
         if (!tSet) return;
-        Vector3f va = (vertices[0] - p), vb = (vertices[1] - p), vc = (vertices[2] - p);
-        float ra = Vector3f::cross(vb, vc).length(),
-              rb = Vector3f::cross(vc, va).length(),
-              rc = Vector3f::cross(va, vb).length();
-        Vector2f uv = (ra * at + rb * bt + rc * ct) / (ra + rb + rc);
-        u = uv.x();
-        v = uv.y();
+        Vector2f uv = (1 - u - v) * at + u * bt + v * ct;
+        tu = uv.x();
+        tv = uv.y();
     }
 };
 
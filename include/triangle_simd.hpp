@@ -0,0 +1,83 @@
+#ifndef TRIANGLE_SIMD_H
+#define TRIANGLE_SIMD_H
+
+#include <cstdint>
+#include <vector>
+#include <vecmath.h>
+
+// Width of the widest triangle kernel. Mesh leaves hold at most this many
+// triangles, so one kernel call covers a whole leaf.
+#define TRIANGLE_BLOCK_SIZE 8
+
+// Triangles in structure-of-arrays form with precomputed edges
+// e1 = v1 - v0 and e2 = v2 - v0. The nine arrays v0.x, v0.y, v0.z, e1.x, ...
+// e2.z follow each other in one block, each padded with TRIANGLE_BLOCK_SIZE
+// zero triangles so that a kernel may always load a full block starting at
+// any triangle. The block is either owned or attached (a mapped file).
+struct TriangleSoA {
+    enum { V0_X, V0_Y, V0_Z, E1_X, E1_Y, E1_Z, E2_X, E2_Y, E2_Z, ARRAYS };
+
+    size_t count = 0;
+
+    static size_t floatsFor(size_t n) { return ARRAYS * (n + TRIANGLE_BLOCK_SIZE); }
+
+    void resize(size_t n) {
+        count = n;
+        attached = nullptr;
+        storage.assign(floatsFor(n), 0.0f);
+    }
+
+    void attach(const float *block, size_t n) {
+        std::vector<float>().swap(storage);
+        attached = block;
+        count = n;
+    }
+
+    void set(size_t i, const Vector3f &a, const Vector3f &b, const Vector3f &c) {
+        size_t stride = count + TRIANGLE_BLOCK_SIZE;
+        for (int k = 0; k < 3; k++) {
+            storage[(V0_X + k) * stride + i] = a[k];
+            storage[(E1_X + k) * stride + i] = b[k] - a[k];
+            storage[(E2_X + k) * stride + i] = c[k] - a[k];
+        }
+    }
+
+    void clear() {
+        count = 0;
+        attached = nullptr;
+        std::vector<float>().swap(storage);
+    }
+
+    const float *data() const { return storage.empty() ? attached : storage.data(); }
+
+    // one of V0_X ... E2_Z
+    const float *array(int which) const { return data() + which * (count + TRIANGLE_BLOCK_SIZE); }
+
+    // attached blocks are not counted
+    size_t memoryBytes() const { return storage.capacity() * sizeof(float); }
+
+private:
+    std::vector<float> storage;
+    const float *attached = nullptr;
+};
+
+// Moller-Trumbore of one ray against the triangles [first, first+count),
+// count <= TRIANGLE_BLOCK_SIZE. Returns the index (relative to first) of the
+// nearest hit with tmin < t < tmax and its t and barycentrics u (weight of
+// v1) and v (weight of v2), or -1 if there is none. Ties go to the lower
+// index, so every kernel returns the same triangle as the scalar one.
+typedef int (*TriangleKernel)(const TriangleSoA &tris, uint32_t first, uint32_t count,
+                              const float o[3], const float d[3], float tmin, float tmax,
+                              float &t, float &u, float &v);
+
+// Reference implementation, also used where no SIMD kernel is available.
+int intersectTrianglesScalar(const TriangleSoA &tris, uint32_t first, uint32_t count,
+                             const float o[3], const float d[3], float tmin, float tmax,
+                             float &t, float &u, float &v);
+
+// Widest kernel supported by the running CPU (AVX, SSE or scalar), chosen
+// once on first use.
+TriangleKernel triangleKernel();
+const char *triangleKernelName();
+
+#endif // TRIANGLE_SIMD_H
@@ -97,6 +97,36 @@ inline Vector3f random_cosine_direction() {
     return Vector3f(x, y, z);
 }
 
+// Uniformly distributed point on the triangle abc.
+inline Vector3f random_on_triangle(const Vector3f &a, const Vector3f &b, const Vector3f &c) {
+    auto su = sqrt(random_double());
+    auto r2 = random_double();
+    return (1 - su) * a + su * (1 - r2) * b + su * r2 * c;
+}
+
+// Solid-angle density at the ray origin of the point at parameter t along
+// dir, sampled uniformly by area from a triangle with edge cross product e
+// (twice its area along its normal), the triangle picked with probability
+// prob.
+inline double triangle_pdf(double prob, const Vector3f &e, const Vector3f &dir, float t) {
+    double cosine_area = fabs(Vector3f::dot(e, dir));  // 2 * area * cosine * |dir|
+    if (cosine_area <= 0) return 0;
+    double len = dir.length();
+    return prob * 2 * t * t * len * len * len / cosine_area;
+}
+
+// Rec. 709 luminance of a linear RGB color.
+inline double luminance(const Vector3f &c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+// MIS weight of a sample drawn with density pdf_a against a second strategy
+// with density pdf_b (power heuristic, beta = 2).
+inline double powerHeuristic(double pdf_a, double pdf_b) {
+    double a = pdf_a * pdf_a, b = pdf_b * pdf_b;
+    return a + b > 0 ? a / (a + b) : 0;
+}
+
 // transforms a 3D point using a matrix, returning a 3D point
 static Vector3f transformPoint(const Matrix4f &mat, const Vector3f &point) {
     return (mat * Vector4f(point, 1)).xyz();
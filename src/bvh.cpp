@@ -77,7 +77,63 @@ bool BVHnode::intersect(const Ray& r, Hit& rec, float t_min, float t_max) const
 }
 
 
+unsigned BVHnode::intersectPacket(RayPacket& packet, Hit* hits, unsigned active) const {
+    float bmin[3] = {box.minimum.x(), box.minimum.y(), box.minimum.z()};
+    float bmax[3] = {box.maximum.x(), box.maximum.y(), box.maximum.z()};
+    active = packet.hitBox(bmin, bmax, active);
+    if (!active)
+        return 0;
+
+    // the packet has diverged to one ray, finish it on the single-ray path
+    if (packetLaneCount(active) == 1) {
+        int i = packetFirstLane(active);
+        if (!intersect(packet.rays[i], hits[i], packet.tmin, packet.tmax[i]))
+            return 0;
+        packet.tmax[i] = hits[i].getT();
+        return active;
+    }
+
+    unsigned hit_left = left->intersectPacket(packet, hits, active);
+    unsigned hit_right = right == left ? 0 : right->intersectPacket(packet, hits, active);
+
+    return hit_left | hit_right;
+}
+
+
+bool BVHnode::occluded(const Ray& r, float t_min, float t_max) const {
+    if (!box.intersect(r, t_min, t_max))
+        return false;
+
+    return left->occluded(r, t_min, t_max) || (right != left && right->occluded(r, t_min, t_max));
+}
+
+
+double BVHnode::transmittance(const Ray& r, float t_min, float t_max) const {
+    if (!box.intersect(r, t_min, t_max))
+        return 1;
+
+    double T = left->transmittance(r, t_min, t_max);
+    if (T > 0 && right != left)
+        T *= right->transmittance(r, t_min, t_max);
+    return T;
+}
+
+
 bool BVHnode::bounding_box(double time0, double time1, AABB& output_box) const {
     output_box = box;
     return true;
 }
+
+
+shared_ptr<Object3D> make_bvh(const std::vector<shared_ptr<Object3D>>& objects, BVHMode mode) {
+    switch (mode) {
+        case BVH_FLAT:
+            return make_shared<FlatBVHGroup<FullBVHNode>>(objects);
+        case BVH_COMPACT16:
+            return make_shared<FlatBVHGroup<QuantizedBVHNode16>>(objects);
+        case BVH_COMPACT8:
+            return make_shared<FlatBVHGroup<QuantizedBVHNode8>>(objects);
+        default:
+            return make_shared<BVHnode>(objects, 0, objects.size(), 0, 0);
+    }
+}
@@ -0,0 +1,91 @@
+#include "mapped_file.hpp"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+bool MappedFile::open(const char *filename, bool sequential) {
+    close();
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL | (sequential ? FILE_FLAG_SEQUENTIAL_SCAN : 0), NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size)) {
+        CloseHandle(file);
+        return false;
+    }
+    handle = file;
+    opened = true;
+    length = (size_t)file_size.QuadPart;
+    if (length == 0) return true;
+    HANDLE map = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!map) {
+        close();
+        return false;
+    }
+    mapping = map;
+    ptr = (const char *)MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+    if (!ptr) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::close() {
+    if (ptr) UnmapViewOfFile(ptr);
+    if (mapping) CloseHandle((HANDLE)mapping);
+    if (handle) CloseHandle((HANDLE)handle);
+    ptr = nullptr;
+    mapping = nullptr;
+    handle = nullptr;
+    length = 0;
+    opened = false;
+}
+
+#else
+
+bool MappedFile::open(const char *filename, bool sequential) {
+    close();
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    opened = true;
+    length = (size_t)st.st_size;
+    if (length > 0) {
+        void *p = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            opened = false;
+            length = 0;
+            return false;
+        }
+        if (sequential) madvise(p, length, MADV_SEQUENTIAL);
+        ptr = (const char *)p;
+    }
+    // the mapping stays valid without the descriptor
+    ::close(fd);
+    return true;
+}
+
+void MappedFile::close() {
+    if (ptr) munmap((void *)ptr, length);
+    ptr = nullptr;
+    length = 0;
+    opened = false;
+}
+
+#endif
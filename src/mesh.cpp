@@ -1,169 +1,323 @@
-#include "bvh.hpp"
 #include "mesh.hpp"
 #include "aabb.hpp"
+#include "obj_loader.hpp"
+#include "mesh_file.hpp"
 
-#define TINYOBJLOADER_IMPLEMENTATION // define this in only *one* .cc
-#include "../deps/tiny_obj/tiny_obj_loader.h"
-
-
-#include <fstream>
+#include <cstring>
 #include <iostream>
 #include <algorithm>
 #include <cstdlib>
 #include <utility>
-#include <sstream>
+
+bool Mesh::hitTriangle(uint32_t f, const Vector3f &o, const Vector3f &dir, float &tt, float &u, float &w) const {
+    const TriangleIndex &tri = faces[f];
+    const Vector3f &v0 = vertices[tri[0]];
+    Vector3f v0v1 = vertices[tri[1]] - v0;
+    Vector3f v0v2 = vertices[tri[2]] - v0;
+    Vector3f pvec = Vector3f::cross(dir, v0v2);
+    float det = Vector3f::dot(v0v1, pvec);
+    // ray and triangle are parallel if det is close to 0
+    if (fabs(det) < 1e-10) return false;
+    float invDet = 1 / det;
+    Vector3f tvec = o - v0;
+    u = Vector3f::dot(tvec, pvec) * invDet;
+    if (u < 0 || u > 1) return false;
+    Vector3f qvec = Vector3f::cross(tvec, v0v1);
+    w = Vector3f::dot(dir, qvec) * invDet;
+    if (w < 0 || u + w > 1) return false;
+    tt = Vector3f::dot(v0v2, qvec) * invDet;
+    return true;
+}
+
+void Mesh::setHit(const Ray &r, Hit &h, const TriangleHit &th) const {
+    const TriangleIndex &tri = faces[th.face];
+    float w = 1 - th.u - th.v;
+    Vector3f normal;
+    const TriangleIndex &ni = normal_faces.empty() ? tri : normal_faces[th.face];
+    if (normals.empty() || ni[0] < 0) {
+        normal = Vector3f::cross(vertices[tri[1]] - vertices[tri[0]], vertices[tri[2]] - vertices[tri[0]]).normalized();
+    } else {
+        normal = (w * normals[ni[0]] + th.u * normals[ni[1]] + th.v * normals[ni[2]]).normalized();
+    }
+    // without texture coordinates the barycentrics are used, as Triangle does
+    h.u = th.u;
+    h.v = th.v;
+    // twice the area of the triangle in (u, v)
+    double uv_area = 1;
+    const TriangleIndex &ti = texcoord_faces.empty() ? tri : texcoord_faces[th.face];
+    if (!texcoords.empty() && ti[0] >= 0) {
+        Vector2f uv = w * texcoords[ti[0]] + th.u * texcoords[ti[1]] + th.v * texcoords[ti[2]];
+        h.u = uv.x();
+        h.v = uv.y();
+        Vector2f e1 = texcoords[ti[1]] - texcoords[ti[0]], e2 = texcoords[ti[2]] - texcoords[ti[0]];
+        uv_area = fabs(e1.x() * e2.y() - e1.y() * e2.x());
+    }
+    h.set(th.t, material.get(), normal, r);
+    double area = Vector3f::cross(vertices[tri[1]] - vertices[tri[0]], vertices[tri[2]] - vertices[tri[0]]).length();
+    h.uv_rate = area > 0 ? sqrt(uv_area / area) : 0;
+}
+
+bool Mesh::hitLeaf(uint32_t first, uint32_t count, const Ray &r, float tmin, float tmax, TriangleHit &th) const {
+    if (soa.count) {
+        const Vector3f &o = r.getOrigin(), &d = r.getDirection();
+        float of[3] = {o.x(), o.y(), o.z()}, df[3] = {d.x(), d.y(), d.z()};
+        int i = kernel(soa, first, count, of, df, tmin, tmax, th.t, th.u, th.v);
+        if (i < 0) return false;
+        th.face = first + i;
+        return true;
+    }
+    // low-memory mode, no precomputed edges
+    bool found = false;
+    float tt, u, w;
+    for (uint32_t f = first; f < first + count; f++) {
+        if (hitTriangle(f, r.getOrigin(), r.getDirection(), tt, u, w) && tt > tmin && tt < tmax) {
+            tmax = tt;
+            th.face = f; th.t = tt; th.u = u; th.v = w;
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool Mesh::LeafIntersect::operator()(uint32_t first, uint32_t count, float &tmax) {
+    if (!self->hitLeaf(first, count, *r, tmin, tmax, *hit)) return false;
+    tmax = hit->t;
+    return true;
+}
+
+bool Mesh::LeafPacket::operator()(uint32_t first, uint32_t count, int lane) {
+    if (!self->hitLeaf(first, count, packet->rays[lane], packet->tmin, packet->tmax[lane], hits[lane])) return false;
+    packet->tmax[lane] = hits[lane].t;
+    return true;
+}
+
+bool Mesh::LeafOccluded::operator()(uint32_t first, uint32_t count, float tmax) {
+    // hitLeaf excludes both ends of the range
+    TriangleHit th;
+    return self->hitLeaf(first, count, *r, tmin, tmax, th);
+}
+
+bool Mesh::LeafPdf::operator()(uint32_t first, uint32_t count, float tmax) {
+    const Vector3f &o = r->getOrigin(), &d = r->getDirection();
+    float t, u, w;
+    for (uint32_t f = first; f < first + count; f++) {
+        if (!self->hitTriangle(f, o, d, t, u, w) || t <= tmin || t >= tmax) continue;
+        const TriangleIndex &tri = self->faces[f];
+        Vector3f e = Vector3f::cross(self->vertices[tri[1]] - self->vertices[tri[0]],
+                                     self->vertices[tri[2]] - self->vertices[tri[0]]);
+        pdf += triangle_pdf(self->light_table.probability(f), e, d, t);
+    }
+    // keep going, every leaf along the ray counts
+    return false;
+}
 
 bool Mesh::intersect(const Ray &r, Hit &h, float tmin, float tmax) const {
+    TriangleHit th;
+    LeafIntersect leaf = {this, &r, tmin, &th};
+    bool hit;
+    switch (mode) {
+        case BVH_COMPACT16: hit = tree16.intersect(r, tmin, tmax, leaf); break;
+        case BVH_COMPACT8: hit = tree8.intersect(r, tmin, tmax, leaf); break;
+        default: hit = tree.intersect(r, tmin, tmax, leaf); break;
+    }
+    if (hit) setHit(r, h, th);
+    return hit;
+}
+
+unsigned Mesh::intersectPacket(RayPacket &packet, Hit *hits, unsigned active) const {
+    TriangleHit th[RAY_PACKET_SIZE];
+    LeafPacket leaf = {this, &packet, th};
+    unsigned hit;
+    switch (mode) {
+        case BVH_COMPACT16: hit = tree16.intersectPacket(packet, active, leaf); break;
+        case BVH_COMPACT8: hit = tree8.intersectPacket(packet, active, leaf); break;
+        default: hit = tree.intersectPacket(packet, active, leaf); break;
+    }
+    for (unsigned m = hit; m; m &= m - 1) {
+        int lane = packetFirstLane(m);
+        setHit(packet.rays[lane], hits[lane], th[lane]);
+    }
+    return hit;
+}
+
+bool Mesh::occluded(const Ray &r, float tmin, float tmax) const {
+    LeafOccluded leaf = {this, &r, tmin};
+    switch (mode) {
+        case BVH_COMPACT16: return tree16.occluded(r, tmin, tmax, leaf);
+        case BVH_COMPACT8: return tree8.occluded(r, tmin, tmax, leaf);
+        default: return tree.occluded(r, tmin, tmax, leaf);
+    }
+}
 
-    // Optional: Change this brute force method into a faster one.
-    return triangle_bvh->intersect(r, h, tmin, tmax);
+double Mesh::area() const {
+    return total_area;
+}
+
+double Mesh::pdf_value(const Vector3f &o, const Vector3f &v) const {
+    if (light_table.empty()) return 0;
+    Ray r(o, v);
+    LeafPdf leaf = {this, &r, 0.001f, 0};
+    switch (mode) {
+        case BVH_COMPACT16: tree16.occluded(r, 0.001f, infinity, leaf); break;
+        case BVH_COMPACT8: tree8.occluded(r, 0.001f, infinity, leaf); break;
+        default: tree.occluded(r, 0.001f, infinity, leaf); break;
+    }
+    return leaf.pdf;
+}
+
+Vector3f Mesh::random(const Vector3f &o) const {
+    if (light_table.empty()) return Vector3f(1, 0, 0);
+    const TriangleIndex &tri = faces[light_table.sample()];
+    return random_on_triangle(vertices[tri[0]], vertices[tri[1]], vertices[tri[2]]) - o;
 }
 
 bool Mesh::bounding_box(double time0, double time1, AABB& output_box) const {
 
-    triangle_bvh->bounding_box(time0, time1, output_box);
+    switch (mode) {
+        case BVH_COMPACT16: if (tree16.empty()) return false; output_box = tree16.box(); break;
+        case BVH_COMPACT8: if (tree8.empty()) return false; output_box = tree8.box(); break;
+        default: if (tree.empty()) return false; output_box = tree.box(); break;
+    }
     std::cout << "bounding box of mesh: min "<< output_box.min() << " max "<< output_box.max() << std::endl;
 
 	return true;
 }
 
-Mesh::Mesh(const std::vector<shared_ptr<Object3D>> &tri, shared_ptr<Material> m) : Object3D(m) {
-    triangle = tri;
-    triangle_bvh = make_shared<BVHnode>(triangle, 0, triangle.size(), 0, 0);
-}
-
-Mesh::Mesh(const char *filename, shared_ptr<Material> material) : Object3D(material) {
-
-    // std::ifstream f;
-    // f.open(filename);
-    // if (!f.is_open()) {
-    //     std::cout << "Cannot open " << filename << "\n";
-    //     return;
-    // }
-    // std::string line;
-    // std::string vTok("v");
-    // std::string fTok("f");
-    // std::string texTok("vt");
-    // char bslash = '/', space = ' ';
-    // std::string tok;
-    // int texID;
-    // while (true) {
-    //     std::getline(f, line);
-    //     if (f.eof()) {
-    //         break;
-    //     }
-    //     if (line.size() < 3) {
-    //         continue;
-    //     }
-    //     if (line.at(0) == '#') {
-    //         continue;
-    //     }
-    //     std::stringstream ss(line);
-    //     ss >> tok;
-    //     if (tok == vTok) {
-    //         Vector3f vec;
-    //         ss >> vec[0] >> vec[1] >> vec[2];
-    //         v.push_back(vec);
-    //     } else if (tok == fTok) {
-    //         if (line.find(bslash) != std::string::npos) {
-    //             std::replace(line.begin(), line.end(), bslash, space);
-    //             std::stringstream facess(line);
-    //             TriangleIndex trig;
-    //             facess >> tok;
-    //             for (int ii = 0; ii < 3; ii++) {
-    //                 facess >> trig[ii] >> texID;
-    //                 trig[ii]--;
-    //             }
-    //             t.push_back(trig);
-    //         } else {
-    //             TriangleIndex trig;
-    //             for (int ii = 0; ii < 3; ii++) {
-    //                 ss >> trig[ii];
-    //                 trig[ii]--;
-    //             }
-    //             t.push_back(trig);
-    //         }
-    //     } else if (tok == texTok) {
-    //         Vector2f texcoord;
-    //         ss >> texcoord[0];
-    //         ss >> texcoord[1];
-    //     }
-    // }
-    // f.close();
-
-    std::string inputfile = filename;
-    tinyobj::ObjReaderConfig reader_config;
-    reader_config.mtl_search_path = ""; // Path to material files
-
-    tinyobj::ObjReader reader;
-
-    if (!reader.ParseFromFile(inputfile, reader_config)) {
-    if (!reader.Error().empty()) {
-        std::cerr << "TinyObjReader: " << reader.Error();
-    }
-    exit(1);
-    }
-
-    if (!reader.Warning().empty()) {
-    std::cout << "TinyObjReader: " << reader.Warning();
-    }
-
-    auto& attrib = reader.GetAttrib();
-    auto& shapes = reader.GetShapes();
-    auto& materials = reader.GetMaterials();
-
-    std::cout<< "obj readed!" << std::endl;
-
-    triangle.reserve(shapes[0].mesh.num_face_vertices.size());
-    // Loop over shapes
-    for (size_t s = 0; s < shapes.size(); s++) {
-        // Loop over faces(polygon)
-        size_t index_offset = 0;
-        for (size_t f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
-            size_t fv = size_t(shapes[s].mesh.num_face_vertices[f]);
-
-            Vector3f tri_v[3],tri_vn[3]; Vector2f tri_vt[3];
-
-            // Loop over vertices in the face.
-            for (size_t v = 0; v < fv; v++) {
-                // access to vertex
-                tinyobj::index_t idx = shapes[s].mesh.indices[index_offset + v];
-                tinyobj::real_t vx = attrib.vertices[3*size_t(idx.vertex_index)+0];
-                tinyobj::real_t vy = attrib.vertices[3*size_t(idx.vertex_index)+1];
-                tinyobj::real_t vz = attrib.vertices[3*size_t(idx.vertex_index)+2];
-                tri_v[v] = Vector3f(float(vx), float(vy), float(vz));
-
-                // Check if `normal_index` is zero or positive. negative = no normal data
-                if (idx.normal_index >= 0) {
-                    tinyobj::real_t nx = attrib.normals[3*size_t(idx.normal_index)+0];
-                    tinyobj::real_t ny = attrib.normals[3*size_t(idx.normal_index)+1];
-                    tinyobj::real_t nz = attrib.normals[3*size_t(idx.normal_index)+2];
-                    tri_vn[v] = Vector3f(float(nx), float(ny), float(nz));
-                }
-
-                // Check if `texcoord_index` is zero or positive. negative = no texcoord data
-                if (idx.texcoord_index >= 0) {
-                    tinyobj::real_t tx = attrib.texcoords[2*size_t(idx.texcoord_index)+0];
-                    tinyobj::real_t ty = attrib.texcoords[2*size_t(idx.texcoord_index)+1];
-                    tri_vt[v] = Vector2f(float(tx), float(ty));
-                } 
+size_t Mesh::memoryBytes() const {
+    return v.capacity() * sizeof(Vector3f) + n.capacity() * sizeof(Vector3f) + vt.capacity() * sizeof(Vector2f) +
+           (t.capacity() + tn.capacity() + tt.capacity()) * sizeof(TriangleIndex) +
+           face_material.capacity() * sizeof(int) + soa.memoryBytes() +
+           tree.memoryBytes() + tree16.memoryBytes() + tree8.memoryBytes() + light_table.memoryBytes();
+}
+
+template <typename T>
+static void permute(std::vector<T> &items, const std::vector<uint32_t> &order) {
+    if (items.empty()) return;
+    std::vector<T> sorted(order.size());
+    for (size_t i = 0; i < order.size(); i++) sorted[i] = items[order[i]];
+    items.swap(sorted);
+}
+
+void Mesh::bindBuffers() {
+    vertices = v;
+    normals = n;
+    texcoords = vt;
+    faces = t;
+    normal_faces = tn;
+    texcoord_faces = tt;
+    face_materials = face_material;
+}
 
+void Mesh::buildBVH(BVHMode bvh_mode) {
+    mode = bvh_mode == BVH_POINTER ? BVH_FLAT : bvh_mode;
+    std::vector<AABB> boxes(faces.size());
+    for (size_t f = 0; f < faces.size(); f++) {
+        Vector3f p_min = vertices[faces[f][0]], p_max = vertices[faces[f][0]];
+        for (int i = 1; i < 3; i++) {
+            for (int j = 0; j < 3; j++) {
+                p_min[j] = fmin(p_min[j], vertices[faces[f][i]][j]);
+                p_max[j] = fmax(p_max[j], vertices[faces[f][i]][j]);
             }
-            shared_ptr<Triangle> t = make_shared<Triangle>(tri_v[0], tri_v[1], tri_v[2], material);
-            // t->setVT(tri_vt[0], tri_vt[1], tri_vt[2]);
-            // t->setVNorm(tri_vn[0],tri_vn[1],tri_vn[2]);
-            shared_ptr<Object3D> tri = t;
-            triangle.push_back(tri);    
-
-            index_offset += fv;
-            // per-face material
-            shapes[s].mesh.material_ids[f];
         }
+        boxes[f] = AABB(p_min - Vector3f(0.001, 0.001, 0.001), p_max + Vector3f(0.001, 0.001, 0.001));
+    }
+    std::vector<uint32_t> order;
+    switch (mode) {
+        case BVH_COMPACT16: tree16.build(boxes, order, MESH_LEAF_SIZE); break;
+        case BVH_COMPACT8: tree8.build(boxes, order, MESH_LEAF_SIZE); break;
+        default: tree.build(boxes, order, MESH_LEAF_SIZE); break;
     }
-    std::cout<< "obj loaded!" << std::endl;
+    // leaves reference contiguous triangle ranges, the face buffers are
+    // always owned at this point
+    permute(t, order);
+    permute(tn, order);
+    permute(tt, order);
+    permute(face_material, order);
+    faces = t;
+    normal_faces = tn;
+    texcoord_faces = tt;
+    face_materials = face_material;
+    buildSoA();
+}
 
-    triangle_bvh = make_shared<BVHnode>(triangle, 0, triangle.size(), 0, 0);
-    std::cout<< "bvh builded!" << std::endl;
+void Mesh::buildSoA() {
+    // the low-memory mode does without the SoA copy and computes edges on the fly
+    kernel = triangleKernel();
+    if (mode == BVH_COMPACT8) {
+        soa.clear();
+        return;
+    }
+    soa.resize(faces.size());
+    for (size_t f = 0; f < faces.size(); f++) {
+        soa.set(f, vertices[faces[f][0]], vertices[faces[f][1]], vertices[faces[f][2]]);
+    }
+}
 
+void Mesh::buildLightTable() {
+    std::vector<double> area(faces.size()), weight(faces.size());
+    total_area = 0;
+    double total_weight = 0;
+    bool emits = material && material->type == DIFFUSE_LIGHT;
+    for (size_t f = 0; f < faces.size(); f++) {
+        const TriangleIndex &tri = faces[f];
+        const Vector3f &a = vertices[tri[0]], &b = vertices[tri[1]], &c = vertices[tri[2]];
+        area[f] = 0.5 * Vector3f::cross(b - a, c - a).length();
+        total_area += area[f];
+        if (!emits) continue;
+        // emission at the center, texture coordinates as setHit finds them
+        float u = 1.0f / 3, v = 1.0f / 3;
+        const TriangleIndex &ti = texcoord_faces.empty() ? tri : texcoord_faces[f];
+        if (!texcoords.empty() && ti[0] >= 0) {
+            Vector2f uv = (texcoords[ti[0]] + texcoords[ti[1]] + texcoords[ti[2]]) / 3;
+            u = uv.x();
+            v = uv.y();
+        }
+        weight[f] = area[f] * std::max(luminance(material->albedo(u, v, (a + b + c) / 3)), 0.0);
+        total_weight += weight[f];
+    }
+    if (!emits) return;
+    // black at every center, fall back to area alone
+    light_table = AliasTable(total_weight > 0 ? weight : area);
+}
+
+Mesh::Mesh(const std::vector<Vector3f> &vertices, const std::vector<TriangleIndex> &faces,
+           const std::vector<Vector3f> &normals, shared_ptr<Material> material, BVHMode mode)
+    : Object3D(material), v(vertices), t(faces), n(normals) {
+    if (!n.empty() && n.size() != v.size()) {
+        printf("Mesh needs one normal per vertex, got %d for %d vertices.\n", (int)n.size(), (int)v.size());
+        exit(0);
+    }
+    bindBuffers();
+    buildBVH(mode);
+    buildLightTable();
+}
+
+static bool hasExtension(const char *filename, const char *ext) {
+    size_t len = strlen(filename), ext_len = strlen(ext);
+    return len >= ext_len && !strcmp(filename + len - ext_len, ext);
 }
 
+Mesh::Mesh(const char *filename, shared_ptr<Material> material, BVHMode mode) : Object3D(material) {
+
+    if (hasExtension(filename, MESH_FILE_EXTENSION)) {
+        if (!loadBinary(filename, mode)) {
+            exit(1);
+        }
+        std::cout<< "mesh file mapped! " << numTriangles() << " triangles, " << memoryBytes() / 1024 << " KiB copied, "
+                 << triangleKernelName() << " triangle kernel" << std::endl;
+        buildLightTable();
+        return;
+    }
+
+    if (!loadOBJ(filename, *this)) {
+        exit(1);
+    }
+    std::cout<< "obj loaded! " << v.size() << " vertices" << std::endl;
+
+    bindBuffers();
+    buildBVH(mode);
+    buildLightTable();
+    std::cout<< "bvh builded! " << t.size() << " triangles, " << memoryBytes() / 1024 << " KiB, "
+             << triangleKernelName() << " triangle kernel" << std::endl;
+
+}
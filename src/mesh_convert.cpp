@@ -0,0 +1,34 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "mesh.hpp"
+#include "mesh_file.hpp"
+
+// Converts an OBJ file into the binary mesh container of mesh_file.hpp,
+// including the BVH and the SoA triangle block, so that the renderer can map
+// it without parsing or building anything.
+int main(int argc, char *argv[]) {
+    if (argc != 3 && argc != 4) {
+        std::cout << "Usage: ./bin/MESH_CONVERT <input obj file> <output " MESH_FILE_EXTENSION " file> "
+                     "[flat|compact16|compact8]" << std::endl;
+        return 1;
+    }
+    BVHMode mode = BVH_FLAT;
+    if (argc == 4) {
+        if (!strcmp(argv[3], "flat")) {
+            mode = BVH_FLAT;
+        } else if (!strcmp(argv[3], "compact16")) {
+            mode = BVH_COMPACT16;
+        } else if (!strcmp(argv[3], "compact8")) {
+            mode = BVH_COMPACT8;
+        } else {
+            printf("Unknown bvh layout '%s'\n", argv[3]);
+            return 1;
+        }
+    }
+    Mesh mesh(argv[1], nullptr, mode);
+    if (!mesh.saveBinary(argv[2])) return 1;
+    std::cout << "written " << argv[2] << std::endl;
+    return 0;
+}
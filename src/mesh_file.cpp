@@ -0,0 +1,291 @@
+#include "mesh.hpp"
+#include "mesh_file.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+static_assert(sizeof(Vector3f) == 3 * sizeof(float), "mesh files store Vector3f as three floats");
+static_assert(sizeof(Vector2f) == 2 * sizeof(float), "mesh files store Vector2f as two floats");
+static_assert(sizeof(Mesh::TriangleIndex) == 3 * sizeof(int32_t), "mesh files store faces as three int32");
+
+static uint64_t alignUp(uint64_t x) {
+    return (x + MESH_FILE_ALIGNMENT - 1) / MESH_FILE_ALIGNMENT * MESH_FILE_ALIGNMENT;
+}
+
+// Size in bytes of one counted element of a section.
+static size_t elementSize(int section, int bvh_mode) {
+    switch (section) {
+        case MESH_SECTION_POSITIONS:
+        case MESH_SECTION_NORMALS: return sizeof(Vector3f);
+        case MESH_SECTION_TEXCOORDS: return sizeof(Vector2f);
+        case MESH_SECTION_FACES:
+        case MESH_SECTION_NORMAL_FACES:
+        case MESH_SECTION_TEXCOORD_FACES: return sizeof(Mesh::TriangleIndex);
+        case MESH_SECTION_FACE_MATERIALS: return sizeof(int32_t);
+        case MESH_SECTION_MATERIAL_NAMES: return 1;
+        case MESH_SECTION_BVH_NODES:
+            switch (bvh_mode) {
+                case BVH_COMPACT16: return sizeof(QuantizedBVHNode16);
+                case BVH_COMPACT8: return sizeof(QuantizedBVHNode8);
+                default: return sizeof(FullBVHNode);
+            }
+        default: return 0;
+    }
+}
+
+static uint64_t sectionBytes(const MeshFileHeader &header, int section) {
+    if (section == MESH_SECTION_TRIANGLE_SOA) {
+        return header.count[section] ? TriangleSoA::floatsFor(header.count[section]) * sizeof(float) : 0;
+    }
+    return header.count[section] * elementSize(section, header.bvh_mode);
+}
+
+// The section lies within a file of size bytes. Counts come from the file,
+// so the room left is divided rather than the count multiplied, which a
+// corrupt count could wrap.
+static bool sectionFits(const MeshFileHeader &header, int section, uint64_t size) {
+    if (header.offset[section] > size) return false;
+    uint64_t room = size - header.offset[section];
+    if (section == MESH_SECTION_TRIANGLE_SOA) {
+        uint64_t triangles = room / (TriangleSoA::ARRAYS * sizeof(float));
+        return triangles >= TRIANGLE_BLOCK_SIZE && header.count[section] <= triangles - TRIANGLE_BLOCK_SIZE;
+    }
+    size_t element = elementSize(section, header.bvh_mode);
+    return element && header.count[section] <= room / element;
+}
+
+// Every index of faces is below limit. With optional, a face whose first
+// index is negative has none, as Mesh::setHit reads it.
+static bool facesInRange(ArrayView<Mesh::TriangleIndex> faces, size_t limit, bool optional) {
+    for (size_t f = 0; f < faces.size(); f++) {
+        const Mesh::TriangleIndex &tri = faces[f];
+        if (optional && tri[0] < 0) continue;
+        for (int k = 0; k < 3; k++) {
+            if (tri[k] < 0 || (size_t)tri[k] >= limit) return false;
+        }
+    }
+    return true;
+}
+
+// Every child of the stored tree is a later node or a leaf range within the
+// faces, every node has one parent and the depth fits the traversal stack,
+// so traversal stays in bounds and ends.
+template <typename Node>
+static bool treeInRange(const Node *nodes, uint64_t num_nodes, uint64_t num_faces) {
+    typedef FlatBVH<Node> Tree;
+    std::vector<int> depth(num_nodes, -1);
+    depth[0] = 0;
+    for (uint64_t i = 0; i < num_nodes; i++) {
+        if (depth[i] < 0) continue;  // unreachable
+        for (int c = 0; c < 2; c++) {
+            uint32_t ref = nodes[i].child[c];
+            if (ref & Tree::LEAF_BIT) {
+                uint64_t first = ref & Tree::FIRST_MASK, count = (ref & ~Tree::LEAF_BIT) >> Tree::COUNT_SHIFT;
+                if (count > TRIANGLE_BLOCK_SIZE || first + count > num_faces) return false;
+                continue;
+            }
+            if (ref <= i || ref >= num_nodes || depth[ref] >= 0 || depth[i] + 2 >= BVH_STACK_SIZE) return false;
+            depth[ref] = depth[i] + 1;
+        }
+    }
+    return true;
+}
+
+bool Mesh::saveBinary(const char *filename) const {
+    MeshFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MESH_FILE_MAGIC, sizeof(MESH_FILE_MAGIC));
+    header.version = MESH_FILE_VERSION;
+    header.header_size = sizeof(MeshFileHeader);
+    header.bvh_mode = mode;
+
+    std::string names;
+    for (size_t i = 0; i < material_names.size(); i++) {
+        names += material_names[i];
+        names += '\0';
+    }
+
+    const void *data[MESH_SECTION_COUNT];
+    memset(data, 0, sizeof(data));
+    data[MESH_SECTION_POSITIONS] = vertices.ptr;
+    header.count[MESH_SECTION_POSITIONS] = vertices.size();
+    data[MESH_SECTION_NORMALS] = normals.ptr;
+    header.count[MESH_SECTION_NORMALS] = normals.size();
+    data[MESH_SECTION_TEXCOORDS] = texcoords.ptr;
+    header.count[MESH_SECTION_TEXCOORDS] = texcoords.size();
+    data[MESH_SECTION_FACES] = faces.ptr;
+    header.count[MESH_SECTION_FACES] = faces.size();
+    data[MESH_SECTION_NORMAL_FACES] = normal_faces.ptr;
+    header.count[MESH_SECTION_NORMAL_FACES] = normal_faces.size();
+    data[MESH_SECTION_TEXCOORD_FACES] = texcoord_faces.ptr;
+    header.count[MESH_SECTION_TEXCOORD_FACES] = texcoord_faces.size();
+    data[MESH_SECTION_FACE_MATERIALS] = face_materials.ptr;
+    header.count[MESH_SECTION_FACE_MATERIALS] = face_materials.size();
+    data[MESH_SECTION_MATERIAL_NAMES] = names.data();
+    header.count[MESH_SECTION_MATERIAL_NAMES] = names.size();
+
+    AABB bounds;
+    switch (mode) {
+        case BVH_COMPACT16:
+            data[MESH_SECTION_BVH_NODES] = tree16.data();
+            header.count[MESH_SECTION_BVH_NODES] = tree16.size();
+            header.bvh_leaf_size = tree16.leafSize();
+            bounds = tree16.box();
+            break;
+        case BVH_COMPACT8:
+            data[MESH_SECTION_BVH_NODES] = tree8.data();
+            header.count[MESH_SECTION_BVH_NODES] = tree8.size();
+            header.bvh_leaf_size = tree8.leafSize();
+            bounds = tree8.box();
+            break;
+        default:
+            data[MESH_SECTION_BVH_NODES] = tree.data();
+            header.count[MESH_SECTION_BVH_NODES] = tree.size();
+            header.bvh_leaf_size = tree.leafSize();
+            bounds = tree.box();
+            break;
+    }
+    for (int a = 0; a < 3; a++) {
+        header.bounds[a] = bounds.minimum[a];
+        header.bounds[3 + a] = bounds.maximum[a];
+    }
+    data[MESH_SECTION_TRIANGLE_SOA] = soa.count ? soa.data() : nullptr;
+    header.count[MESH_SECTION_TRIANGLE_SOA] = soa.count;
+
+    uint64_t pos = alignUp(sizeof(MeshFileHeader));
+    for (int s = 0; s < MESH_SECTION_COUNT; s++) {
+        if (!header.count[s]) continue;
+        header.offset[s] = pos;
+        pos = alignUp(pos + sectionBytes(header, s));
+    }
+
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        std::cerr << "Cannot write " << filename << "\n";
+        return false;
+    }
+    static const char zeros[MESH_FILE_ALIGNMENT] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    uint64_t written = sizeof(header);
+    for (int s = 0; s < MESH_SECTION_COUNT && ok; s++) {
+        if (!header.count[s]) continue;
+        ok = fwrite(zeros, 1, header.offset[s] - written, file) == header.offset[s] - written;
+        uint64_t bytes = sectionBytes(header, s);
+        ok = ok && fwrite(data[s], 1, bytes, file) == bytes;
+        written = header.offset[s] + bytes;
+    }
+    ok = ok && fwrite(zeros, 1, pos - written, file) == pos - written;
+    ok = fclose(file) == 0 && ok;
+    if (!ok) std::cerr << "Cannot write " << filename << "\n";
+    return ok;
+}
+
+bool Mesh::loadBinary(const char *filename, BVHMode requested) {
+    mapping = make_shared<MappedFile>();
+    if (!mapping->open(filename)) {
+        std::cerr << "Cannot open " << filename << "\n";
+        return false;
+    }
+    MeshFileHeader header;
+    if (mapping->size() < sizeof(header)) {
+        std::cerr << filename << " is not a mesh file\n";
+        return false;
+    }
+    memcpy(&header, mapping->data(), sizeof(header));
+    if (memcmp(header.magic, MESH_FILE_MAGIC, sizeof(MESH_FILE_MAGIC)) != 0) {
+        std::cerr << filename << " is not a mesh file\n";
+        return false;
+    }
+    if (header.version != MESH_FILE_VERSION || header.header_size != sizeof(MeshFileHeader) ||
+        header.bvh_mode < BVH_FLAT || header.bvh_mode > BVH_COMPACT8) {
+        std::cerr << filename << " was written by an incompatible version, convert it again\n";
+        return false;
+    }
+    for (int s = 0; s < MESH_SECTION_COUNT; s++) {
+        if (!header.count[s]) continue;
+        if (header.offset[s] % MESH_FILE_ALIGNMENT || !sectionFits(header, s, mapping->size())) {
+            std::cerr << filename << " is truncated or corrupt\n";
+            return false;
+        }
+    }
+
+    // everything below points into the mapping
+    const char *base = mapping->data();
+    #define SECTION(type, s) ArrayView<type>((const type *)(base + header.offset[s]), header.count[s])
+    vertices = SECTION(Vector3f, MESH_SECTION_POSITIONS);
+    normals = SECTION(Vector3f, MESH_SECTION_NORMALS);
+    texcoords = SECTION(Vector2f, MESH_SECTION_TEXCOORDS);
+    faces = SECTION(TriangleIndex, MESH_SECTION_FACES);
+    normal_faces = SECTION(TriangleIndex, MESH_SECTION_NORMAL_FACES);
+    texcoord_faces = SECTION(TriangleIndex, MESH_SECTION_TEXCOORD_FACES);
+    face_materials = SECTION(int, MESH_SECTION_FACE_MATERIALS);
+    #undef SECTION
+
+    const char *names = base + header.offset[MESH_SECTION_MATERIAL_NAMES];
+    uint64_t names_size = header.count[MESH_SECTION_MATERIAL_NAMES];
+    for (uint64_t i = 0; i < names_size;) {
+        size_t len = strnlen(names + i, names_size - i);
+        material_names.push_back(std::string(names + i, len));
+        i += len + 1;
+    }
+
+    // a corrupt file must not make any lookup read outside the mapping;
+    // without separate normal or texcoord faces the position indices are used
+    bool valid = facesInRange(faces, vertices.size(), false) &&
+                 (normal_faces.empty() ? normals.empty() || facesInRange(faces, normals.size(), false)
+                                       : normal_faces.size() == faces.size() &&
+                                             facesInRange(normal_faces, normals.size(), true)) &&
+                 (texcoord_faces.empty() ? texcoords.empty() || facesInRange(faces, texcoords.size(), false)
+                                         : texcoord_faces.size() == faces.size() &&
+                                               facesInRange(texcoord_faces, texcoords.size(), true)) &&
+                 (face_materials.empty() || face_materials.size() == faces.size());
+    for (size_t f = 0; valid && f < face_materials.size(); f++) {
+        valid = face_materials[f] >= -1 && face_materials[f] < (int64_t)material_names.size();
+    }
+    if (!valid) {
+        std::cerr << filename << " has indices out of range, it is corrupt\n";
+        return false;
+    }
+
+    uint64_t num_nodes = header.count[MESH_SECTION_BVH_NODES];
+    if (!num_nodes) {
+        // no stored tree: the faces have to be sorted, so they are copied
+        t.assign(faces.ptr, faces.ptr + faces.size());
+        tn.assign(normal_faces.ptr, normal_faces.ptr + normal_faces.size());
+        tt.assign(texcoord_faces.ptr, texcoord_faces.ptr + texcoord_faces.size());
+        face_material.assign(face_materials.ptr, face_materials.ptr + face_materials.size());
+        buildBVH(requested);
+        return true;
+    }
+
+    mode = (BVHMode)header.bvh_mode;
+    if (requested != BVH_POINTER && requested != BVH_FLAT && requested != mode) {
+        std::cout << filename << " keeps the BVH layout it was converted with" << std::endl;
+    }
+    AABB bounds(Vector3f(header.bounds[0], header.bounds[1], header.bounds[2]),
+                Vector3f(header.bounds[3], header.bounds[4], header.bounds[5]));
+    const char *nodes = base + header.offset[MESH_SECTION_BVH_NODES];
+    switch (mode) {
+        case BVH_COMPACT16: valid = treeInRange((const QuantizedBVHNode16 *)nodes, num_nodes, faces.size()); break;
+        case BVH_COMPACT8: valid = treeInRange((const QuantizedBVHNode8 *)nodes, num_nodes, faces.size()); break;
+        default: valid = treeInRange((const FullBVHNode *)nodes, num_nodes, faces.size()); break;
+    }
+    if (!valid) {
+        std::cerr << filename << " has a BVH out of range, it is corrupt\n";
+        return false;
+    }
+    switch (mode) {
+        case BVH_COMPACT16: tree16.attach((const QuantizedBVHNode16 *)nodes, num_nodes, bounds, header.bvh_leaf_size); break;
+        case BVH_COMPACT8: tree8.attach((const QuantizedBVHNode8 *)nodes, num_nodes, bounds, header.bvh_leaf_size); break;
+        default: tree.attach((const FullBVHNode *)nodes, num_nodes, bounds, header.bvh_leaf_size); break;
+    }
+
+    if (header.count[MESH_SECTION_TRIANGLE_SOA] == faces.size() && mode != BVH_COMPACT8) {
+        kernel = triangleKernel();
+        soa.attach((const float *)(base + header.offset[MESH_SECTION_TRIANGLE_SOA]), faces.size());
+    } else {
+        buildSoA();
+    }
+    return true;
+}
@@ -0,0 +1,334 @@
+#include "obj_loader.hpp"
+#include "mapped_file.hpp"
+#include "mesh.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Chunks per thread, several so that dynamic scheduling can even out chunks
+// with different amounts of face lines.
+#define OBJ_CHUNKS_PER_THREAD 4
+
+namespace {
+
+typedef Mesh::TriangleIndex TriangleIndex;
+
+inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+inline const char *skipBlank(const char *p, const char *e) {
+    while (p < e && isBlank(*p)) p++;
+    return p;
+}
+
+// Decimal float without locale or allocation. Up to 19 significant digits
+// are accumulated in an integer and scaled once, which is far more than a
+// float can hold.
+const char *parseFloat(const char *p, const char *e, float &out) {
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    p = skipBlank(p, e);
+    bool negative = false;
+    if (p < e && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    const char *start = p;
+    for (; p < e && isDigit(*p); p++) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa) digits++;
+        } else {
+            exponent++;
+        }
+    }
+    if (p < e && *p == '.') {
+        for (p++; p < e && isDigit(*p); p++) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa) digits++;
+                exponent--;
+            }
+        }
+    }
+    if (p == start) {
+        out = 0;
+        return p;
+    }
+    if (p < e && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool exp_negative = false;
+        if (p < e && (*p == '-' || *p == '+')) exp_negative = *p++ == '-';
+        int value = 0;
+        for (; p < e && isDigit(*p); p++) {
+            if (value < 10000) value = value * 10 + (*p - '0');
+        }
+        exponent += exp_negative ? -value : value;
+    }
+    double result = (double)mantissa;
+    if (exponent < 0 && exponent >= -22) result /= pow10[-exponent];
+    else if (exponent > 0 && exponent <= 22) result *= pow10[exponent];
+    else if (exponent != 0) result *= std::pow(10.0, exponent);
+    out = (float)(negative ? -result : result);
+    return p;
+}
+
+// Returns nullptr if there is no integer at p.
+const char *parseInt(const char *p, const char *e, int &out) {
+    bool negative = false;
+    if (p < e && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    if (p == e || !isDigit(*p)) return nullptr;
+    long long value = 0;
+    for (; p < e && isDigit(*p); p++) {
+        if (value < (1ll << 40)) value = value * 10 + (*p - '0');
+    }
+    out = (int)(negative ? -value : value);
+    return p;
+}
+
+// Number of `v`, `vn` and `vt` lines in front of a chunk.
+struct AttributeCounts {
+    size_t v = 0, vn = 0, vt = 0;
+};
+
+struct Chunk {
+    const char *begin, *end;
+    AttributeCounts count;  // lines in this chunk
+    AttributeCounts base;   // lines in all previous chunks
+    std::vector<TriangleIndex> t, tn, tt;
+    std::vector<int> face_material;
+    // usemtl names in order of appearance, and the material active at the
+    // start of the chunk
+    std::vector<std::string> materials;
+    int material = -1;
+    bool bad = false;
+};
+
+enum LineType { LINE_OTHER, LINE_V, LINE_VN, LINE_VT, LINE_F, LINE_USEMTL };
+
+// q points at the first non-blank character of a line ending at e.
+inline LineType lineType(const char *q, const char *e) {
+    if (e - q < 2) return LINE_OTHER;
+    if (q[0] == 'f' && isBlank(q[1])) return LINE_F;
+    if (e - q > 7 && !memcmp(q, "usemtl", 6) && isBlank(q[6])) return LINE_USEMTL;
+    if (q[0] != 'v') return LINE_OTHER;
+    if (isBlank(q[1])) return LINE_V;
+    if (e - q < 3 || !isBlank(q[2])) return LINE_OTHER;
+    if (q[1] == 'n') return LINE_VN;
+    if (q[1] == 't') return LINE_VT;
+    return LINE_OTHER;
+}
+
+inline const char *nextLine(const char *p, const char *e) {
+    const char *n = (const char *)memchr(p, '\n', e - p);
+    return n ? n + 1 : e;
+}
+
+// Name of a usemtl line, trailing blanks stripped.
+std::string materialName(const char *q, const char *e) {
+    q = skipBlank(q + 6, e);
+    while (e > q && isBlank(e[-1])) e--;
+    return std::string(q, e);
+}
+
+void countAttributes(Chunk &chunk) {
+    for (const char *p = chunk.begin; p < chunk.end; ) {
+        const char *next = nextLine(p, chunk.end);
+        const char *line_end = next[-1] == '\n' ? next - 1 : next;
+        switch (lineType(skipBlank(p, line_end), line_end)) {
+            case LINE_V: chunk.count.v++; break;
+            case LINE_VN: chunk.count.vn++; break;
+            case LINE_VT: chunk.count.vt++; break;
+            case LINE_USEMTL: chunk.materials.push_back(materialName(skipBlank(p, line_end), line_end)); break;
+            default: break;
+        }
+        p = next;
+    }
+}
+
+// OBJ indices are 1-based, negative ones count back from the last element
+// read so far. Returns -1 for out-of-range indices.
+inline int resolveIndex(int index, size_t seen, size_t total) {
+    long long i = index > 0 ? (long long)index - 1 : (long long)seen + index;
+    return (index != 0 && i >= 0 && i < (long long)total) ? (int)i : -1;
+}
+
+void parseChunk(Chunk &chunk, const AttributeCounts &total, const std::map<std::string, int> &material_ids, Mesh &mesh) {
+    size_t nv = chunk.base.v, nvn = chunk.base.vn, nvt = chunk.base.vt;
+    std::vector<int> corner_v, corner_vt, corner_vn;
+    for (const char *p = chunk.begin; p < chunk.end; ) {
+        const char *line_end = (const char *)memchr(p, '\n', chunk.end - p);
+        if (!line_end) line_end = chunk.end;
+        const char *q = skipBlank(p, line_end);
+        p = line_end + 1;
+        LineType type = lineType(q, line_end);
+
+        if (type == LINE_V) {
+            float x, y, z;
+            q = parseFloat(q + 1, line_end, x);
+            q = parseFloat(q, line_end, y);
+            parseFloat(q, line_end, z);
+            mesh.v[nv++] = Vector3f(x, y, z);
+        } else if (type == LINE_VN) {
+            float x, y, z;
+            q = parseFloat(q + 2, line_end, x);
+            q = parseFloat(q, line_end, y);
+            parseFloat(q, line_end, z);
+            mesh.n[nvn++] = Vector3f(x, y, z);
+        } else if (type == LINE_VT) {
+            float s, t;
+            q = parseFloat(q + 2, line_end, s);
+            parseFloat(q, line_end, t);
+            mesh.vt[nvt++] = Vector2f(s, t);
+        } else if (type == LINE_USEMTL) {
+            chunk.material = material_ids.find(materialName(q, line_end))->second;
+        } else if (type == LINE_F) {
+            // v, v/vt, v//vn or v/vt/vn per corner, up to a trailing comment
+            const char *face_end = (const char *)memchr(q, '#', line_end - q);
+            if (!face_end) face_end = line_end;
+            corner_v.clear(); corner_vt.clear(); corner_vn.clear();
+            bool all_vt = true, all_vn = true;
+            q = skipBlank(q + 1, face_end);
+            while (q < face_end) {
+                int iv, ivt = 0, ivn = 0;
+                q = parseInt(q, face_end, iv);
+                if (!q) break;
+                if (q < face_end && *q == '/') {
+                    q++;
+                    if (q < face_end && *q != '/') q = parseInt(q, face_end, ivt);
+                    if (q && q < face_end && *q == '/') q = parseInt(q + 1, face_end, ivn);
+                    if (!q) break;
+                }
+                int rv = resolveIndex(iv, nv, total.v);
+                if (rv < 0) chunk.bad = true;
+                corner_v.push_back(rv);
+                corner_vt.push_back(ivt ? resolveIndex(ivt, nvt, total.vt) : -1);
+                corner_vn.push_back(ivn ? resolveIndex(ivn, nvn, total.vn) : -1);
+                all_vt = all_vt && corner_vt.back() >= 0;
+                all_vn = all_vn && corner_vn.back() >= 0;
+                q = skipBlank(q, face_end);
+            }
+            if (!q) chunk.bad = true;
+            if (chunk.bad) continue;
+            // fan triangulation
+            for (size_t k = 1; k + 1 < corner_v.size(); k++) {
+                chunk.t.push_back(TriangleIndex(corner_v[0], corner_v[k], corner_v[k + 1]));
+                if (!material_ids.empty()) chunk.face_material.push_back(chunk.material);
+                // -1 = no normal / texcoord data for this face
+                if (total.vn) {
+                    chunk.tn.push_back(all_vn ? TriangleIndex(corner_vn[0], corner_vn[k], corner_vn[k + 1])
+                                              : TriangleIndex(-1, -1, -1));
+                }
+                if (total.vt) {
+                    chunk.tt.push_back(all_vt ? TriangleIndex(corner_vt[0], corner_vt[k], corner_vt[k + 1])
+                                              : TriangleIndex(-1, -1, -1));
+                }
+            }
+        }
+    }
+}
+
+template <typename T>
+void append(std::vector<T> &dst, const std::vector<T> &src, size_t offset) {
+    if (!src.empty()) memcpy(&dst[offset], src.data(), src.size() * sizeof(T));
+}
+
+} // namespace
+
+bool loadOBJ(const char *filename, Mesh &mesh) {
+    MappedFile file;
+    if (!file.open(filename, true)) {
+        std::cerr << "Cannot open " << filename << "\n";
+        return false;
+    }
+    const char *data = file.data(), *data_end = data + file.size();
+
+    // chunk boundaries right after a newline
+#ifdef _OPENMP
+    int threads = omp_get_max_threads();
+#else
+    int threads = 1;
+#endif
+    int num_chunks = file.size() < (1 << 20) ? 1 : threads * OBJ_CHUNKS_PER_THREAD;
+    std::vector<Chunk> chunks(num_chunks);
+    const char *p = data;
+    for (int c = 0; c < num_chunks; c++) {
+        chunks[c].begin = p;
+        if (c + 1 < num_chunks) {
+            const char *split = data + file.size() / num_chunks * (c + 1);
+            p = split > p ? nextLine(split, data_end) : p;
+        } else {
+            p = data_end;
+        }
+        chunks[c].end = p;
+    }
+
+    // pass 1: count attributes so that every chunk knows where its vertices
+    // go and how to resolve relative indices
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int c = 0; c < num_chunks; c++) countAttributes(chunks[c]);
+    AttributeCounts total;
+    std::map<std::string, int> material_ids;
+    int material = -1;
+    for (int c = 0; c < num_chunks; c++) {
+        chunks[c].base = total;
+        total.v += chunks[c].count.v;
+        total.vn += chunks[c].count.vn;
+        total.vt += chunks[c].count.vt;
+        // material ids in order of first use
+        chunks[c].material = material;
+        for (size_t i = 0; i < chunks[c].materials.size(); i++) {
+            const std::string &name = chunks[c].materials[i];
+            if (!material_ids.count(name)) {
+                material_ids[name] = (int)mesh.material_names.size();
+                mesh.material_names.push_back(name);
+            }
+            material = material_ids[name];
+        }
+    }
+    mesh.v.resize(total.v);
+    mesh.n.resize(total.vn);
+    mesh.vt.resize(total.vt);
+
+    // pass 2: vertices are written in place, faces go to per-chunk lists
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int c = 0; c < num_chunks; c++) parseChunk(chunks[c], total, material_ids, mesh);
+
+    size_t num_faces = 0;
+    for (int c = 0; c < num_chunks; c++) {
+        if (chunks[c].bad) {
+            std::cerr << "Invalid face in " << filename << "\n";
+            return false;
+        }
+        num_faces += chunks[c].t.size();
+    }
+    mesh.t.resize(num_faces);
+    mesh.tn.resize(total.vn ? num_faces : 0);
+    mesh.tt.resize(total.vt ? num_faces : 0);
+    mesh.face_material.resize(material_ids.empty() ? 0 : num_faces);
+    std::vector<size_t> offset(num_chunks + 1, 0);
+    for (int c = 0; c < num_chunks; c++) offset[c + 1] = offset[c] + chunks[c].t.size();
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int c = 0; c < num_chunks; c++) {
+        append(mesh.t, chunks[c].t, offset[c]);
+        append(mesh.tn, chunks[c].tn, offset[c]);
+        append(mesh.tt, chunks[c].tt, offset[c]);
+        append(mesh.face_material, chunks[c].face_material, offset[c]);
+    }
+    return true;
+}
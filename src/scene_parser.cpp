@@ -12,6 +12,7 @@
 #include "object3d.hpp"
 #include "group.hpp"
 #include "mesh.hpp"
+#include "mesh_file.hpp"
 #include "sphere.hpp"
 #include "plane.hpp"
 #include "rectangle.hpp"
@@ -20,6 +21,7 @@
 #include "moving_sphere.hpp"
 #include "curve.hpp"
 #include "revsurface.hpp"
+#include "environment.hpp"
 
 SceneParser::SceneParser(const char *filename) {
 
@@ -32,6 +34,7 @@ SceneParser::SceneParser(const char *filename) {
     // ambientLight = nullptr;
     num_materials = 0;
     materials = nullptr;
+    material_table = new MaterialTable;
     current_material = nullptr;
     num_textures = 0;
     textures = nullptr;
@@ -61,6 +64,9 @@ SceneParser::SceneParser(const char *filename) {
 
 SceneParser::~SceneParser() {
 
+    // the materials stay alive through the shared_ptrs the table handed out
+    delete material_table;
+
     // delete group;
     // delete camera;
 
@@ -117,6 +123,18 @@ void SceneParser::parseGlobal() {
             max_depth = readInt();
         } else if (!strcmp(token, "weight")){
             init_weight = readFloat();
+        } else if (!strcmp(token, "textureCache")){
+            // memory cap of the decoded image texture tiles, in MB
+            int mb = readInt();
+            if (mb < 0) {
+                printf("textureCache must not be negative, got %d\n", mb);
+                exit(0);
+            }
+            TextureCache::global().setBudget((size_t)mb << 20);
+        } else if (!strcmp(token, "textureCacheDir")){
+            // where the mip files of image textures go, instead of next to the images
+            getToken(token);
+            TextureCache::global().setMipDirectory(token);
         } else if (!strcmp(token, "}")){
             break;
         }
@@ -168,8 +186,18 @@ void SceneParser::parsePerspectiveCamera() {
     camera = new PerspectiveCamera(lookFrom, lookAt, up, width, height, angle_radians, aperture, focus, time0, time1);
 }
 
+// Background {
+//     color <r g b>
+//     environment <latlong image>  |  cubemap <+x> <-x> <+y> <-y> <+z> <-z>
+//     intensity <f>
+// }
+// Cube faces are seen from inside the cube, +y up on the side faces.
 void SceneParser::parseBackground() {
     char token[MAX_PARSER_TOKEN_LENGTH];
+    char filename[MAX_PARSER_TOKEN_LENGTH];
+    shared_ptr<ImageTexture> latlong;
+    std::vector<shared_ptr<ImageTexture>> cube;
+    float intensity = 1;
     // read in the background color
     getToken(token);
     assert (!strcmp(token, "{"));
@@ -179,11 +207,34 @@ void SceneParser::parseBackground() {
             break;
         } else if (!strcmp(token, "color")) {
             background_color = readVector3f();
+        } else if (!strcmp(token, "environment")) {
+            getToken(filename);
+            latlong = make_shared<ImageTexture>(filename);
+        } else if (!strcmp(token, "cubemap")) {
+            for (int i = 0; i < 6; ++i) {
+                getToken(filename);
+                cube.push_back(make_shared<ImageTexture>(filename));
+            }
+        } else if (!strcmp(token, "intensity")) {
+            intensity = readFloat();
         } else {
             printf("Unknown token in parseBackground: '%s'\n", token);
             assert(0);
         }
     }
+    if (latlong) {
+        environment = make_shared<Environment>(latlong, intensity);
+    } else if (!cube.empty()) {
+        const Vector3f centers[6] = {Vector3f(1, 0, 0), Vector3f(-1, 0, 0), Vector3f(0, 1, 0),
+                                     Vector3f(0, -1, 0), Vector3f(0, 0, 1), Vector3f(0, 0, -1)};
+        const Vector3f ups[6] = {Vector3f(0, 1, 0), Vector3f(0, 1, 0), Vector3f(-1, 0, 0),
+                                 Vector3f(1, 0, 0), Vector3f(0, 1, 0), Vector3f(0, 1, 0)};
+        std::vector<EnvironmentFace> faces;
+        for (int i = 0; i < 6; ++i) {
+            faces.push_back(EnvironmentFace(cube[i], centers[i], Vector3f::cross(centers[i], ups[i]), ups[i]));
+        }
+        environment = make_shared<Environment>(faces, intensity);
+    }
 }
 
 // ====================================================================
@@ -297,7 +348,8 @@ void SceneParser::parseMaterials() {
 shared_ptr<Material> SceneParser::parseMaterial(char type[MAX_PARSER_TOKEN_LENGTH]) {
     char token[MAX_PARSER_TOKEN_LENGTH];
     Vector3f ambientColor(0, 0, 0), diffuseColor(0, 0, 0), specularColor(0, 0, 0), albedo(0, 0, 0);
-    float shininess = 0, fuzz = 0, ir=0, illumination=1;
+    float ir=0, illumination=1;
+    float roughness = -1;  // given: a GGX Metal / Dielectric
     shared_ptr<Texture> m_texture = nullptr;
     Vector3f lightColor(1, 1, 1);
     getToken(token);
@@ -310,12 +362,13 @@ shared_ptr<Material> SceneParser::parseMaterial(char type[MAX_PARSER_TOKEN_LENGT
             diffuseColor = readVector3f();
         } else if (strcmp(token, "specularColor") == 0) {
             specularColor = readVector3f();
-        } else if (strcmp(token, "shininess") == 0) {
-            shininess = readFloat();
+        } else if (strcmp(token, "shininess") == 0 || strcmp(token, "fuzz") == 0) {
+            // Phong exponent and fuzz of older scenes, no material takes them
+            readFloat();
         } else if (strcmp(token, "albedo") == 0){
             albedo = readVector3f();
-        } else if (strcmp(token, "fuzz") == 0){
-            fuzz = readFloat();
+        } else if (strcmp(token, "roughness") == 0){
+            roughness = readFloat();
         } else if (strcmp(token, "ir") == 0){
             ir = readFloat(); 
         } else if (strcmp(token, "texture") == 0) {
@@ -331,18 +384,19 @@ shared_ptr<Material> SceneParser::parseMaterial(char type[MAX_PARSER_TOKEN_LENGT
     }
     shared_ptr<Material> answer = nullptr;
     if(!strcmp(type, "Material")||!strcmp(type, "Lambertian")){
-        if (!m_texture) m_texture = make_shared<SolidColor>(Vector3f::ZERO);
-        answer = make_shared<Lambertian>(ambientColor, diffuseColor, specularColor, shininess, m_texture);
+        answer = m_texture ? material_table->lambertian(m_texture) : material_table->lambertian(Vector3f::ZERO);
+    } else if (!strcmp(type, "Metal") && roughness >= 0){
+        answer = m_texture ? material_table->roughConductor(m_texture, roughness)
+                           : material_table->roughConductor(albedo, roughness);
     } else if (!strcmp(type, "Metal")){
-        if (!m_texture) m_texture = make_shared<SolidColor>(Vector3f::ZERO);
-        answer = make_shared<Lambertian>(ambientColor, diffuseColor, specularColor, shininess, m_texture);
+        answer = m_texture ? material_table->lambertian(m_texture) : material_table->lambertian(Vector3f::ZERO);
     } else if (!strcmp(type, "Dielectric")){
-        answer = make_shared<Dielectric>(ambientColor, diffuseColor, specularColor, shininess, ir);
+        answer = roughness >= 0 ? material_table->roughDielectric(ir, roughness) : material_table->dielectric(ir);
     } else if (!strcmp(type, "Light")){
         if (m_texture) {
-            answer = make_shared<DiffuseLight>(ambientColor, diffuseColor, specularColor, shininess, m_texture, illumination);
+            answer = material_table->diffuseLight(m_texture, illumination);
         } else {
-            answer = make_shared<DiffuseLight>(ambientColor, diffuseColor, specularColor, shininess, lightColor, illumination);
+            answer = material_table->diffuseLight(lightColor, illumination);
         } 
     }
     return answer;
@@ -479,7 +533,7 @@ Group *SceneParser::parseGroup() {
             int index = readInt();
             assert (index >= 0 && index <= getNumMaterials());
             current_material = getMaterial(index);
-            if (std::dynamic_pointer_cast<DiffuseLight>(current_material)) {
+            if (current_material->type == DIFFUSE_LIGHT) {
                 isLight = true;
             } else {
                 isLight = false;
@@ -587,13 +641,40 @@ shared_ptr<Mesh> SceneParser::parseTriangleMesh() {
     getToken(token);
     assert (!strcmp(token, "{"));
     getToken(token);
-    assert (!strcmp(token, "obj_file"));
+    // obj_file also takes a converted mesh file (MESH_FILE_EXTENSION)
+    assert (!strcmp(token, "obj_file") || !strcmp(token, "mesh_file"));
     getToken(filename);
-    getToken(token);
-    assert (!strcmp(token, "}"));
-    const char *ext = &filename[strlen(filename) - 4];
-    assert(!strcmp(ext, ".obj"));
-    return make_shared<Mesh>(filename, current_material) ;
+    BVHMode mode = BVH_POINTER;
+    while (true) {
+        getToken(token);
+        if (!strcmp(token, "bvh")) {
+            // optional BVH layout, "compact8" is the low-memory mode
+            getToken(token);
+            if (!strcmp(token, "pointer")) {
+                mode = BVH_POINTER;
+            } else if (!strcmp(token, "flat")) {
+                mode = BVH_FLAT;
+            } else if (!strcmp(token, "compact16")) {
+                mode = BVH_COMPACT16;
+            } else if (!strcmp(token, "compact8")) {
+                mode = BVH_COMPACT8;
+            } else {
+                printf("Unknown bvh layout in parseTriangleMesh: '%s'\n", token);
+                exit(0);
+            }
+        } else {
+            assert (!strcmp(token, "}"));
+            break;
+        }
+    }
+    size_t len = strlen(filename), mesh_ext_len = strlen(MESH_FILE_EXTENSION);
+    bool is_obj = len >= 4 && !strcmp(filename + len - 4, ".obj");
+    bool is_mesh_file = len >= mesh_ext_len && !strcmp(filename + len - mesh_ext_len, MESH_FILE_EXTENSION);
+    if (!is_obj && !is_mesh_file) {
+        printf("TriangleMesh needs an .obj or %s file: '%s'\n", MESH_FILE_EXTENSION, filename);
+        exit(0);
+    }
+    return make_shared<Mesh>(filename, current_material, mode) ;
 }
 
 
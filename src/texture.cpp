@@ -1,34 +1,372 @@
 #define STB_IMAGE_IMPLEMENTATION
-#define STBI_FAILURE_USERMSG 
+#define STBI_FAILURE_USERMSG
 #include "../deps/stb_image/stb_image.h"
 
 #include "texture.hpp"
 
-ImageTexture::ImageTexture(const char* filename) {
-    auto components_per_pixel = bytes_per_pixel;
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <sys/stat.h>
 
-    data = stbi_load(
-        filename, &width, &height, &components_per_pixel, components_per_pixel);
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
 
-    if (!data) {
-        std::cerr << "ERROR: Could not load Texture image file '" << filename << "'.\n";
-        std::cerr << "Reason: " << stbi_failure_reason() <<std::endl;
-        width = height = 0;
-        exit(0);
+static uint64_t alignUp(uint64_t x) {
+    return (x + MIP_FILE_ALIGNMENT - 1) / MIP_FILE_ALIGNMENT * MIP_FILE_ALIGNMENT;
+}
+
+static bool hasExtension(const char *filename, const char *ext) {
+    size_t len = strlen(filename), ext_len = strlen(ext);
+    return len >= ext_len && !strcmp(filename + len - ext_len, ext);
+}
+
+static size_t texelBytes(uint32_t format) {
+    return format == MIP_FORMAT_RGB8 ? 3 : 3 * sizeof(float);
+}
+
+static int tilesAcross(uint32_t texels) {
+    return (texels + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+}
+
+static uint64_t tileBytes(const MipFileHeader &header) {
+    return (uint64_t)TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * texelBytes(header.format);
+}
+
+static uint64_t levelBytes(const MipFileHeader &header, int level) {
+    return (uint64_t)tilesAcross(header.width[level]) * tilesAcross(header.height[level]) * tileBytes(header);
+}
+
+// byte offset of texel (x, y) from the start of its level
+static uint64_t texelOffset(const MipFileHeader &header, int level, int x, int y) {
+    uint64_t tile = (uint64_t)(y / TEXTURE_TILE_SIZE) * tilesAcross(header.width[level]) + x / TEXTURE_TILE_SIZE;
+    return tile * tileBytes(header) + ((y % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + x % TEXTURE_TILE_SIZE) *
+                                          texelBytes(header.format);
+}
+
+// linear value of every 8-bit texel, gamma 2
+static const float *gammaTable() {
+    static float table[256];
+    static bool filled = [] {
+        for (int i = 0; i < 256; i++) table[i] = (i / 255.0f) * (i / 255.0f);
+        return true;
+    }();
+    (void)filled;
+    return table;
+}
+
+// Decodes the image and lays out its mip file in out, false if it cannot be
+// read.
+bool ImageTexture::build(const char* filename, uint64_t source_size, int64_t source_mtime, std::vector<char>& out) {
+    int width, height, components;
+    unsigned char *bytes = nullptr;
+    float *floats = nullptr;
+    if (stbi_is_hdr(filename)) {
+        floats = stbi_loadf(filename, &width, &height, &components, 3);
+    } else {
+        bytes = stbi_load(filename, &width, &height, &components, 3);
+    }
+    if (!bytes && !floats) return false;
+    if ((uint32_t)width > MIP_FILE_MAX_SIZE || (uint32_t)height > MIP_FILE_MAX_SIZE) {
+        std::cerr << filename << " is " << width << " x " << height << ", textures are at most "
+                  << MIP_FILE_MAX_SIZE << " texels on a side\n";
+        STBI_FREE(bytes);
+        STBI_FREE(floats);
+        return false;
+    }
+
+    MipFileHeader header = MipFileHeader();
+    memcpy(header.magic, MIP_FILE_MAGIC, sizeof(MIP_FILE_MAGIC));
+    header.version = MIP_FILE_VERSION;
+    header.header_size = sizeof(MipFileHeader);
+    header.format = floats ? MIP_FORMAT_RGB32F : MIP_FORMAT_RGB8;
+    header.tile_size = TEXTURE_TILE_SIZE;
+    header.source_size = source_size;
+    header.source_mtime = source_mtime;
+    uint64_t pos = alignUp(sizeof(MipFileHeader));
+    for (uint32_t w = width, h = height; header.levels < MIP_FILE_MAX_LEVELS; w = std::max(w / 2, 1u), h = std::max(h / 2, 1u)) {
+        int l = header.levels++;
+        header.width[l] = w;
+        header.height[l] = h;
+        header.offset[l] = pos;
+        pos = alignUp(pos + levelBytes(header, l));
+        if (w == 1 && h == 1) break;
+    }
+    out.assign(pos, 0);
+    memcpy(out.data(), &header, sizeof(header));
+
+    const float *gamma = gammaTable();
+    size_t texel = texelBytes(header.format);
+    auto at = [&](int level, int x, int y) { return out.data() + header.offset[level] + texelOffset(header, level, x, y); };
+    auto read = [&](int level, int x, int y, float *rgb) {
+        const char *p = at(level, x, y);
+        if (header.format == MIP_FORMAT_RGB32F) {
+            memcpy(rgb, p, 3 * sizeof(float));
+        } else {
+            for (int c = 0; c < 3; c++) rgb[c] = gamma[(unsigned char)p[c]];
+        }
+    };
+    auto write = [&](int level, int x, int y, const float *rgb) {
+        char *p = at(level, x, y);
+        if (header.format == MIP_FORMAT_RGB32F) {
+            memcpy(p, rgb, 3 * sizeof(float));
+        } else {
+            for (int c = 0; c < 3; c++) p[c] = (char)(unsigned char)(sqrt(clamp(rgb[c], 0.0f, 1.0f)) * 255 + 0.5f);
+        }
+    };
+
+    // level 0 is copied as is, every further one averages the texels of the
+    // previous one it covers; the averages are kept as floats for the next
+    // level, so 8-bit levels are rounded once
+    const char *source = floats ? (const char *)floats : (const char *)bytes;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) memcpy(at(0, x, y), source + ((size_t)y * width + x) * texel, texel);
+    }
+    std::vector<float> prev, next;
+    for (uint32_t l = 1; l < header.levels; l++) {
+        int pw = header.width[l - 1], ph = header.height[l - 1], w = header.width[l], h = header.height[l];
+        next.resize((size_t)w * h * 3);
+        for (int y = 0; y < h; y++) {
+            int y0 = y * ph / h, y1 = std::max(y0 + 1, ((y + 1) * ph + h - 1) / h);
+            for (int x = 0; x < w; x++) {
+                int x0 = x * pw / w, x1 = std::max(x0 + 1, ((x + 1) * pw + w - 1) / w);
+                float *sum = &next[((size_t)y * w + x) * 3], rgb[3];
+                sum[0] = sum[1] = sum[2] = 0;
+                for (int sy = y0; sy < y1; sy++) {
+                    for (int sx = x0; sx < x1; sx++) {
+                        if (l == 1) {
+                            read(0, sx, sy, rgb);
+                        } else {
+                            memcpy(rgb, &prev[((size_t)sy * pw + sx) * 3], sizeof(rgb));
+                        }
+                        for (int c = 0; c < 3; c++) sum[c] += rgb[c];
+                    }
+                }
+                for (int c = 0; c < 3; c++) sum[c] /= (x1 - x0) * (y1 - y0);
+                write(l, x, y, sum);
+            }
+        }
+        prev.swap(next);
+    }
+    // pad the edge tiles with the last column and row
+    for (uint32_t l = 0; l < header.levels; l++) {
+        int w = header.width[l], h = header.height[l];
+        int pw = tilesAcross(w) * TEXTURE_TILE_SIZE, ph = tilesAcross(h) * TEXTURE_TILE_SIZE;
+        for (int y = 0; y < ph; y++) {
+            for (int x = (y < h ? w : 0); x < pw; x++) {
+                memcpy(at(l, x, y), at(l, std::min(x, w - 1), std::min(y, h - 1)), texel);
+            }
+        }
+    }
+    STBI_FREE(bytes);
+    STBI_FREE(floats);
+    return true;
+}
+
+// Written under a name no other writer uses and renamed over path, so a
+// concurrent load maps either the old file or the complete new one.
+static bool writeFile(const std::string &path, const std::vector<char> &data) {
+    static std::atomic<unsigned> counter(0);
+#ifdef _WIN32
+    int pid = _getpid();
+#else
+    int pid = getpid();
+#endif
+    std::string tmp = path + "." + std::to_string(pid) + "-" + std::to_string(counter++) + ".tmp";
+    FILE *file = fopen(tmp.c_str(), "wb");
+    if (!file) return false;
+    bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+    ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+    ok = ok && MoveFileExA(tmp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+#endif
+    if (!ok) remove(tmp.c_str());
+    return ok;
+}
+
+// Name of the mip file of filename inside a shared directory: the image's
+// name and a hash of its absolute path, so that images of the same name in
+// different folders do not collide.
+static std::string mipFileIn(const std::string &dir, const char *filename) {
+    char full[4096];
+#ifdef _WIN32
+    const char *path = _fullpath(full, filename, sizeof(full)) ? full : filename;
+#else
+    const char *path = realpath(filename, full) ? full : filename;
+#endif
+    uint64_t hash = 0xcbf29ce484222325ull;  // FNV-1a
+    for (const char *c = path; *c; c++) hash = (hash ^ (unsigned char)*c) * 0x100000001b3ull;
+    const char *name = filename;
+    for (const char *c = filename; *c; c++) {
+        if (*c == '/' || *c == '\\') name = c + 1;
     }
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%016llx", (unsigned long long)hash);
+    return dir + "/" + name + suffix + MIP_FILE_EXTENSION;
+}
 
-    bytes_per_scanline = bytes_per_pixel * width;
+static std::string tempDirectory() {
+#ifdef _WIN32
+    const char *dir = getenv("TEMP");
+    return dir ? dir : ".";
+#else
+    const char *dir = getenv("TMPDIR");
+    return dir && *dir ? dir : "/tmp";
+#endif
 }
 
-ImageTexture::~ImageTexture() {
-    STBI_FREE(data);
+ImageTexture::ImageTexture(const char* filename) : header(), base(nullptr), id(0) {
+    if (hasExtension(filename, MIP_FILE_EXTENSION)) {
+        if (!file.open(filename) || !open(file.data(), file.size())) {
+            std::cerr << "ERROR: Could not load mip file '" << filename << "'.\n";
+            exit(0);
+        }
+    } else {
+        struct stat st;
+        if (stat(filename, &st) != 0) {
+            std::cerr << "ERROR: Could not load Texture image file '" << filename << "'.\n";
+            std::cerr << "Reason: no such file" << std::endl;
+            exit(0);
+        }
+        // the configured directory or next to the image, then the
+        // temporary directory; the decoded pyramid is only ever reached
+        // through a mapped file, so its tiles count against the cache budget
+        const std::string &dir = TextureCache::global().mipDirectory();
+        std::string paths[2] = {dir.empty() ? std::string(filename) + MIP_FILE_EXTENSION : mipFileIn(dir, filename),
+                                mipFileIn(tempDirectory(), filename)};
+        for (const std::string &path : paths) {
+            if (file.open(path.c_str()) && open(file.data(), file.size()) &&
+                header.source_size == (uint64_t)st.st_size && header.source_mtime == (int64_t)st.st_mtime) {
+                break;
+            }
+            file.close();
+            base = nullptr;
+        }
+        if (!base) {
+            std::vector<char> image;
+            if (!build(filename, st.st_size, st.st_mtime, image)) {
+                std::cerr << "ERROR: Could not load Texture image file '" << filename << "'.\n";
+                if (stbi_failure_reason()) std::cerr << "Reason: " << stbi_failure_reason() << std::endl;
+                exit(0);
+            }
+            if (!dir.empty()) {
+#ifdef _WIN32
+                _mkdir(dir.c_str());
+#else
+                mkdir(dir.c_str(), 0777);
+#endif
+            }
+            for (const std::string &path : paths) {
+                if (writeFile(path, image) && file.open(path.c_str()) && open(file.data(), file.size())) break;
+                std::cerr << "Cannot write the mip file of " << filename << " to " << path << '\n';
+                file.close();
+                base = nullptr;
+            }
+            if (!base) {
+                std::cerr << "ERROR: Nowhere to write the mip file of '" << filename
+                          << "', set a writable textureCacheDir.\n";
+                exit(0);
+            }
+        }
+    }
+    id = TextureCache::global().newTextureId();
+}
+
+bool ImageTexture::open(const char* data, size_t size) {
+    base = nullptr;
+    if (size < sizeof(MipFileHeader)) return false;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, MIP_FILE_MAGIC, sizeof(MIP_FILE_MAGIC)) != 0 || header.version != MIP_FILE_VERSION ||
+        header.header_size != sizeof(MipFileHeader) || header.tile_size != TEXTURE_TILE_SIZE ||
+        header.format > MIP_FORMAT_RGB32F || header.levels < 1 || header.levels > MIP_FILE_MAX_LEVELS) {
+        return false;
+    }
+    // sizes come from the file and may be hostile: each level must halve
+    // the last one and fit in what is left after its offset, by division so
+    // that nothing wraps
+    for (uint32_t l = 0; l < header.levels; l++) {
+        uint32_t w = header.width[l], h = header.height[l];
+        if (l == 0 ? !w || !h || w > MIP_FILE_MAX_SIZE || h > MIP_FILE_MAX_SIZE
+                   : w != std::max(header.width[l - 1] / 2, 1u) || h != std::max(header.height[l - 1] / 2, 1u)) {
+            return false;
+        }
+        if (header.offset[l] % MIP_FILE_ALIGNMENT || header.offset[l] > size ||
+            (size - header.offset[l]) / tileBytes(header) / tilesAcross(w) < (uint64_t)tilesAcross(h)) {
+            return false;
+        }
+    }
+    uint32_t last = header.levels - 1;
+    if (header.width[last] != 1 || header.height[last] != 1) return false;
+    base = data;
+    return true;
+}
+
+namespace {
+struct TileSlot {
+    uint64_t key = 0;
+    shared_ptr<const TextureTile> tile;
+};
+}
+
+// the tiles each thread used last, direct-mapped by key
+static thread_local TileSlot tile_slots[TEXTURE_TILE_SLOTS];
+
+const TextureTile& ImageTexture::tile(int level, int tx, int ty) const {
+    uint64_t index = (uint64_t)ty * tilesAcross(header.width[level]) + tx;
+    uint64_t key = (uint64_t)id << 40 | (uint64_t)level << 35 | index;
+    TileSlot &slot = tile_slots[(key * 0x9e3779b97f4a7c15ull) >> 32 & (TEXTURE_TILE_SLOTS - 1)];
+    if (slot.key != key) {
+        auto load = [&](TextureTile &t) {
+            const char *src = base + header.offset[level] + index * tileBytes(header);
+            if (header.format == MIP_FORMAT_RGB32F) {
+                memcpy(t.texels, src, sizeof(t.texels));
+                return;
+            }
+            const float *gamma = gammaTable();
+            for (int i = 0; i < TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE * 3; i++) t.texels[i] = gamma[(unsigned char)src[i]];
+        };
+        slot.tile = TextureCache::global().get(key, load);
+        slot.key = key;
+    }
+    return *slot.tile;
+}
+
+Vector3f ImageTexture::texel(int level, int x, int y) const {
+    const float *t = tile(level, x / TEXTURE_TILE_SIZE, y / TEXTURE_TILE_SIZE).texels +
+                     ((y % TEXTURE_TILE_SIZE) * TEXTURE_TILE_SIZE + x % TEXTURE_TILE_SIZE) * 3;
+    return Vector3f(t[0], t[1], t[2]);
+}
+
+Vector3f ImageTexture::bilinear(int level, double u, double v) const {
+    int w = header.width[level], h = header.height[level];
+    double x = clamp(u, 0.0, 1.0) * w - 0.5, y = (1.0 - clamp(v, 0.0, 1.0)) * h - 0.5;
+    int x0 = (int)floor(x), y0 = (int)floor(y);
+    float fx = x - x0, fy = y - y0;
+    int x1 = std::min(x0 + 1, w - 1), y1 = std::min(y0 + 1, h - 1);
+    x0 = std::max(x0, 0);
+    y0 = std::max(y0, 0);
+    return (1 - fy) * ((1 - fx) * texel(level, x0, y0) + fx * texel(level, x1, y0)) +
+           fy * ((1 - fx) * texel(level, x0, y1) + fx * texel(level, x1, y1));
 }
 
 Vector3f ImageTexture::value(double u, double v, const Vector3f& p) const {
     // If we have no Texture data, then return solid cyan as a debugging aid.
-    if (data == nullptr)
+    if (base == nullptr)
         return Vector3f(0,1,1);
 
+    int width = header.width[0], height = header.height[0];
+
     // Clamp input Texture coordinates to [0,1] x [1,0]
     u = clamp(u, 0.0, 1.0);
     v = 1.0 - clamp(v, 0.0, 1.0);  // Flip V to image coordinates
@@ -40,8 +378,19 @@ Vector3f ImageTexture::value(double u, double v, const Vector3f& p) const {
     if (i >= width)  i = width-1;
     if (j >= height) j = height-1;
 
-    const auto color_scale = 1.0 / 255.0;
-    auto pixel = data + j*bytes_per_scanline + i*bytes_per_pixel;
+    return texel(0, i, j);
+}
+
+Vector3f ImageTexture::filtered(double u, double v, const Vector3f& p, float width) const {
+    if (base == nullptr)
+        return Vector3f(0,1,1);
 
-    return Vector3f(pow(color_scale*pixel[0],2), pow(color_scale*pixel[1],2), pow(color_scale*pixel[2],2));
-}
\ No newline at end of file
+    // level whose texels are as wide as the footprint
+    double lambda = width > 0 ? log2(width * std::max(header.width[0], header.height[0])) : 0;
+    if (lambda <= 0) return bilinear(0, u, v);
+    int top = header.levels - 1;
+    if (lambda >= top) return bilinear(top, u, v);
+    int level = (int)lambda;
+    float f = lambda - level;
+    return (1 - f) * bilinear(level, u, v) + f * bilinear(level + 1, u, v);
+}
@@ -0,0 +1,239 @@
+#include "triangle_simd.hpp"
+
+#include <cassert>
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TRIANGLE_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// All kernels evaluate exactly the same expressions in the same order as the
+// scalar reference, so they agree with it bit for bit (barring FMA
+// contraction when the whole program is built with -mfma).
+
+int intersectTrianglesScalar(const TriangleSoA &tris, uint32_t first, uint32_t count,
+                             const float o[3], const float d[3], float tmin, float tmax,
+                             float &t, float &u, float &v) {
+    const float *V0[3] = {tris.array(TriangleSoA::V0_X), tris.array(TriangleSoA::V0_Y), tris.array(TriangleSoA::V0_Z)};
+    const float *E1[3] = {tris.array(TriangleSoA::E1_X), tris.array(TriangleSoA::E1_Y), tris.array(TriangleSoA::E1_Z)};
+    const float *E2[3] = {tris.array(TriangleSoA::E2_X), tris.array(TriangleSoA::E2_Y), tris.array(TriangleSoA::E2_Z)};
+    int best = -1;
+    for (uint32_t i = 0; i < count; i++) {
+        size_t k = first + i;
+        float e1x = E1[0][k], e1y = E1[1][k], e1z = E1[2][k];
+        float e2x = E2[0][k], e2y = E2[1][k], e2z = E2[2][k];
+        // pvec = d x e2
+        float px = d[1] * e2z - d[2] * e2y;
+        float py = d[2] * e2x - d[0] * e2z;
+        float pz = d[0] * e2y - d[1] * e2x;
+        float det = e1x * px + e1y * py + e1z * pz;
+        // ray and triangle are parallel if det is close to 0
+        if (fabsf(det) < 1e-10f) continue;
+        float inv = 1.0f / det;
+        float sx = o[0] - V0[0][k], sy = o[1] - V0[1][k], sz = o[2] - V0[2][k];
+        float uu = (sx * px + sy * py + sz * pz) * inv;
+        if (uu < 0 || uu > 1) continue;
+        // qvec = s x e1
+        float qx = sy * e1z - sz * e1y;
+        float qy = sz * e1x - sx * e1z;
+        float qz = sx * e1y - sy * e1x;
+        float vv = (d[0] * qx + d[1] * qy + d[2] * qz) * inv;
+        if (vv < 0 || uu + vv > 1) continue;
+        float tt = (e2x * qx + e2y * qy + e2z * qz) * inv;
+        if (tt <= tmin || tt >= tmax) continue;
+        tmax = tt;
+        best = (int)i;
+        t = tt; u = uu; v = vv;
+    }
+    return best;
+}
+
+#ifdef TRIANGLE_SIMD_X86
+
+// 4 triangles per step, run twice for a full block.
+__attribute__((target("sse2")))
+static int intersectTrianglesSSE(const TriangleSoA &tris, uint32_t first, uint32_t count,
+                                 const float o[3], const float d[3], float tmin, float tmax,
+                                 float &t, float &u, float &v) {
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    const __m128 eps = _mm_set1_ps(1e-10f), abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    const __m128 dx = _mm_set1_ps(d[0]), dy = _mm_set1_ps(d[1]), dz = _mm_set1_ps(d[2]);
+    const __m128 ox = _mm_set1_ps(o[0]), oy = _mm_set1_ps(o[1]), oz = _mm_set1_ps(o[2]);
+    const __m128 vmin = _mm_set1_ps(tmin);
+    const float *V0[3] = {tris.array(TriangleSoA::V0_X), tris.array(TriangleSoA::V0_Y), tris.array(TriangleSoA::V0_Z)};
+    const float *E1[3] = {tris.array(TriangleSoA::E1_X), tris.array(TriangleSoA::E1_Y), tris.array(TriangleSoA::E1_Z)};
+    const float *E2[3] = {tris.array(TriangleSoA::E2_X), tris.array(TriangleSoA::E2_Y), tris.array(TriangleSoA::E2_Z)};
+    int best = -1;
+    for (uint32_t base = 0; base < count; base += 4) {
+        size_t k = first + base;
+        __m128 e1x = _mm_loadu_ps(&E1[0][k]), e1y = _mm_loadu_ps(&E1[1][k]), e1z = _mm_loadu_ps(&E1[2][k]);
+        __m128 e2x = _mm_loadu_ps(&E2[0][k]), e2y = _mm_loadu_ps(&E2[1][k]), e2z = _mm_loadu_ps(&E2[2][k]);
+        __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+        __m128 valid = _mm_cmpge_ps(_mm_and_ps(det, abs_mask), eps);
+        __m128 inv = _mm_div_ps(one, det);
+        __m128 sx = _mm_sub_ps(ox, _mm_loadu_ps(&V0[0][k]));
+        __m128 sy = _mm_sub_ps(oy, _mm_loadu_ps(&V0[1][k]));
+        __m128 sz = _mm_sub_ps(oz, _mm_loadu_ps(&V0[2][k]));
+        __m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), inv);
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inv);
+        __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inv);
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(uu, zero), _mm_cmple_ps(uu, one)));
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(vv, zero), _mm_cmple_ps(_mm_add_ps(uu, vv), one)));
+        valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(tt, vmin), _mm_cmplt_ps(tt, _mm_set1_ps(tmax))));
+        int mask = _mm_movemask_ps(valid) & (count - base >= 4 ? 0xf : (1 << (count - base)) - 1);
+        if (!mask) continue;
+        float lanes_t[4], lanes_u[4], lanes_v[4];
+        _mm_storeu_ps(lanes_t, tt);
+        _mm_storeu_ps(lanes_u, uu);
+        _mm_storeu_ps(lanes_v, vv);
+        for (int i = 0; i < 4; i++) {
+            if ((mask >> i & 1) && lanes_t[i] < tmax) {
+                tmax = lanes_t[i];
+                best = (int)(base + i);
+                t = lanes_t[i]; u = lanes_u[i]; v = lanes_v[i];
+            }
+        }
+    }
+    return best;
+}
+
+// A whole block in one step. Only 8-wide float arithmetic is needed, so AVX
+// is enough.
+__attribute__((target("avx")))
+static int intersectTrianglesAVX(const TriangleSoA &tris, uint32_t first, uint32_t count,
+                                 const float o[3], const float d[3], float tmin, float tmax,
+                                 float &t, float &u, float &v) {
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+    const __m256 eps = _mm256_set1_ps(1e-10f), abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 dx = _mm256_set1_ps(d[0]), dy = _mm256_set1_ps(d[1]), dz = _mm256_set1_ps(d[2]);
+    const float *V0[3] = {tris.array(TriangleSoA::V0_X), tris.array(TriangleSoA::V0_Y), tris.array(TriangleSoA::V0_Z)};
+    const float *E1[3] = {tris.array(TriangleSoA::E1_X), tris.array(TriangleSoA::E1_Y), tris.array(TriangleSoA::E1_Z)};
+    const float *E2[3] = {tris.array(TriangleSoA::E2_X), tris.array(TriangleSoA::E2_Y), tris.array(TriangleSoA::E2_Z)};
+    size_t k = first;
+    __m256 e1x = _mm256_loadu_ps(&E1[0][k]), e1y = _mm256_loadu_ps(&E1[1][k]), e1z = _mm256_loadu_ps(&E1[2][k]);
+    __m256 e2x = _mm256_loadu_ps(&E2[0][k]), e2y = _mm256_loadu_ps(&E2[1][k]), e2z = _mm256_loadu_ps(&E2[2][k]);
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+    __m256 valid = _mm256_cmp_ps(_mm256_and_ps(det, abs_mask), eps, _CMP_GE_OQ);
+    __m256 inv = _mm256_div_ps(one, det);
+    __m256 sx = _mm256_sub_ps(_mm256_set1_ps(o[0]), _mm256_loadu_ps(&V0[0][k]));
+    __m256 sy = _mm256_sub_ps(_mm256_set1_ps(o[1]), _mm256_loadu_ps(&V0[1][k]));
+    __m256 sz = _mm256_sub_ps(_mm256_set1_ps(o[2]), _mm256_loadu_ps(&V0[2][k]));
+    __m256 uu = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), inv);
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+    __m256 vv = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inv);
+    __m256 tt = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inv);
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(uu, zero, _CMP_GE_OQ), _mm256_cmp_ps(uu, one, _CMP_LE_OQ)));
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(vv, zero, _CMP_GE_OQ),
+                                               _mm256_cmp_ps(_mm256_add_ps(uu, vv), one, _CMP_LE_OQ)));
+    valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(tt, _mm256_set1_ps(tmin), _CMP_GT_OQ),
+                                               _mm256_cmp_ps(tt, _mm256_set1_ps(tmax), _CMP_LT_OQ)));
+    // lanes past count belong to the next leaf (or the padding)
+    const __m256 lane = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(lane, _mm256_set1_ps((float)count), _CMP_LT_OQ));
+    int mask = _mm256_movemask_ps(valid);
+    if (!mask) return -1;
+    // nearest valid lane, the lowest one on ties
+    __m256 tm = _mm256_blendv_ps(_mm256_set1_ps(INFINITY), tt, valid);
+    __m256 m = _mm256_min_ps(tm, _mm256_permute2f128_ps(tm, tm, 1));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+    int lanes = _mm256_movemask_ps(_mm256_cmp_ps(tm, m, _CMP_EQ_OQ)) & mask;
+    int best = __builtin_ctz(lanes);
+    float lanes_t[8], lanes_u[8], lanes_v[8];
+    _mm256_storeu_ps(lanes_t, tt);
+    _mm256_storeu_ps(lanes_u, uu);
+    _mm256_storeu_ps(lanes_v, vv);
+    t = lanes_t[best]; u = lanes_u[best]; v = lanes_v[best];
+    return best;
+}
+
+#endif // TRIANGLE_SIMD_X86
+
+#ifndef NDEBUG
+// Runs kernel and the scalar reference on random leaves mixing ordinary,
+// degenerate (collinear or collapsed), edge-on and duplicated triangles, and
+// reports whether they always return the same triangle, t, u and v.
+static bool kernelMatchesScalar(TriangleKernel kernel) {
+    uint32_t state = 0x9e3779b9u;
+    auto rnd = [&state]() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return (state >> 8) * (2.0f / 16777216.0f) - 1.0f;
+    };
+    auto point = [&rnd]() { return Vector3f(rnd(), rnd(), rnd()); };
+    TriangleSoA tris;
+    for (int trial = 0; trial < 4096; trial++) {
+        uint32_t count = 1 + trial % TRIANGLE_BLOCK_SIZE;
+        Vector3f o = 4 * point(), target = point();
+        Vector3f d = target - o;
+        tris.resize(count);
+        Vector3f a, b, c;
+        for (uint32_t i = 0; i < count; i++) {
+            a = point(), b = point(), c = point();
+            switch ((trial + i) % 5) {
+                case 1: c = a + rnd() * (b - a); break;    // collinear
+                case 2: b = c = a; break;                  // a point
+                case 3: b = a + d; c = a + rnd() * (target - a); break;  // edge-on
+                default: break;
+            }
+            if ((trial + i) % 7 == 6 && i > 0) {
+                // the same triangle twice, the lower index must win
+                tris.set(i, a, b, c);
+                tris.set(i - 1, a, b, c);
+                continue;
+            }
+            tris.set(i, a, b, c);
+        }
+        float o3[3] = {o.x(), o.y(), o.z()}, d3[3] = {d.x(), d.y(), d.z()};
+        float t0 = 0, u0 = 0, v0 = 0, t1 = 0, u1 = 0, v1 = 0;
+        int i0 = intersectTrianglesScalar(tris, 0, count, o3, d3, 0, 1e30f, t0, u0, v0);
+        int i1 = kernel(tris, 0, count, o3, d3, 0, 1e30f, t1, u1, v1);
+        if (i0 != i1 || (i0 >= 0 && (t0 != t1 || u0 != u1 || v0 != v1))) return false;
+    }
+    return true;
+}
+#endif
+
+static TriangleKernel selectTriangleKernel(const char *&name) {
+    TriangleKernel kernel = intersectTrianglesScalar;
+    name = "scalar";
+#ifdef TRIANGLE_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx")) {
+        kernel = intersectTrianglesAVX;
+        name = "avx";
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernel = intersectTrianglesSSE;
+        name = "sse";
+    }
+#endif
+    // debug builds check the kernel against the reference before using it
+    assert(kernelMatchesScalar(kernel));
+    return kernel;
+}
+
+static const char *selected_name = "scalar";
+
+TriangleKernel triangleKernel() {
+    // initialized once, thread-safe
+    static const TriangleKernel kernel = selectTriangleKernel(selected_name);
+    return kernel;
+}
+
+const char *triangleKernelName() {
+    triangleKernel();
+    return selected_name;
+}